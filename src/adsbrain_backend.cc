@@ -27,7 +27,43 @@
 #include "adsbrain_backend.h"
 
 #include <dlfcn.h>
-
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif  // __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#ifdef TRITON_ADSBRAIN_ENABLE_LZ4
+#include <lz4.h>
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+#include <zstd.h>
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+
+#include "adsbrain_capture.h"
+#include "adsbrain_huge_pages.h"
+#include "adsbrain_payload_header.h"
 #include "triton/backend/backend_common.h"
 #include "triton/backend/backend_input_collector.h"
 #include "triton/backend/backend_model.h"
@@ -38,11 +74,408 @@
 namespace triton { namespace backend { namespace adsbrain {
 
 //
-// Adsbrain Backend for C++ based model. This backend works
-// for any model that has 1 input with STRING datatype and the shape [1] and
-// 1 output with the shape [1] and STRING datatype. The backend
-// supports both batching and non-batching models.
+// Adsbrain Backend for C++ based model. This backend works for any
+// model whose inputs and outputs are STRING, FP32 or INT64 tensors.
+// The inputs are passed to the model as typed views over the whole
+// batch. The backend supports both batching and non-batching models.
+//
+
+//
+// The metrics reported by every model instance, on top of the
+// statistics reported through TRITONBACKEND_ModelInstanceReportStatistics.
+// They need the custom metrics API of Triton and are only reported
+// when the backend is built with TRITON_ADSBRAIN_ENABLE_METRICS.
+//
+enum class InstanceMetric {
+  REQUESTS,
+  BATCHES,
+  INPUT_BYTES,
+  OUTPUT_BYTES,
+  PARSE_DURATION_US,
+  INFER_DURATION_US,
+  SERIALIZE_DURATION_US,
+  MODEL_EXCEPTIONS,
+  OUTPUT_MISMATCHES,
+  SHED_REQUESTS,
+  SHADOW_BATCHES,
+  SHADOW_DROPPED_BATCHES,
+  SHADOW_FAILED_BATCHES,
+  SHADOW_OUTPUT_DIFFS,
+  SHADOW_PRIMARY_INFER_DURATION_US,
+  SHADOW_INFER_DURATION_US,
+  SHADOW_PRIMARY_CPU_US,
+  SHADOW_CPU_US,
+  BATCH_SIZE_CAP,
+  BATCH_OVERHEAD_US,
+  BATCH_ROW_COST_US,
+  COUNT
+};
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+struct InstanceMetricSpec {
+  TRITONSERVER_MetricKind kind;
+  const char* name;
+  const char* description;
+};
+
+// Indexed by InstanceMetric. The batches are counted per batch size
+// bucket.
+const InstanceMetricSpec kInstanceMetricSpecs[] = {
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_requests",
+     "Number of requests run through the model"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_batches",
+     "Number of batches run through the model, by batch size bucket"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_input_bytes",
+     "Input bytes received by the model"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_output_bytes",
+     "Output bytes sent in the responses"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_parse_duration_us",
+     "Cumulative time spent parsing and decoding the inputs"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_infer_duration_us",
+     "Cumulative time spent in the model"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_serialize_duration_us",
+     "Cumulative time spent serializing the outputs"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_model_exceptions",
+     "Number of batches in which the model threw an exception"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_output_mismatches",
+     "Number of outputs whose element count or shapes did not match the "
+     "requests"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_shed_requests",
+     "Number of requests shed under overload"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_shadow_batches",
+     "Number of batches mirrored to the shadow model"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_shadow_dropped_batches",
+     "Number of sampled batches dropped because the shadow model was busy"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_shadow_failed_batches",
+     "Number of mirrored batches in which the shadow model threw an "
+     "exception"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_shadow_output_diffs",
+     "Number of mirrored batches whose shadow outputs differed from the "
+     "model outputs"},
+    {TRITONSERVER_METRIC_KIND_COUNTER,
+     "adsbrain_shadow_primary_infer_duration_us",
+     "Cumulative time spent in the model on the mirrored batches"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_shadow_infer_duration_us",
+     "Cumulative time spent in the shadow model on the mirrored batches"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_shadow_primary_cpu_us",
+     "Cumulative CPU time of the model on the mirrored batches"},
+    {TRITONSERVER_METRIC_KIND_COUNTER, "adsbrain_shadow_cpu_us",
+     "Cumulative CPU time of the shadow model on the mirrored batches"},
+    {TRITONSERVER_METRIC_KIND_GAUGE, "adsbrain_batch_size_cap",
+     "Batch size cap of the latency target controller"},
+    {TRITONSERVER_METRIC_KIND_GAUGE, "adsbrain_batch_overhead_us",
+     "Fixed cost of a batch fitted by the latency target controller"},
+    {TRITONSERVER_METRIC_KIND_GAUGE, "adsbrain_batch_row_cost_us",
+     "Cost per row fitted by the latency target controller"},
+};
+static_assert(
+    sizeof(kInstanceMetricSpecs) / sizeof(kInstanceMetricSpecs[0]) ==
+        static_cast<size_t>(InstanceMetric::COUNT),
+    "every instance metric needs a spec");
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+
+typedef std::unique_ptr<triton::backend::adsbrain::AdsbrainInferenceModel> (
+    *createAdsbrainInferenceModel)();
+typedef uint32_t (*adsbrainModelAbiVersion)();
+
+//
+// ModelLibrary
+//
+// An opened model library, closed when the last reference to it is
+// released.
+//
+class ModelLibrary {
+ public:
+  // Open the library at 'path', check the ABI version it was built
+  // with and find its CreateInferenceModel function.
+  static TRITONSERVER_Error* Open(
+      const std::string& path, std::shared_ptr<ModelLibrary>* library);
+  ~ModelLibrary() { dlclose(handle_); }
+
+  std::unique_ptr<AdsbrainInferenceModel> CreateModel() const
+  {
+    return (*create_model_func_)();
+  }
+
+ private:
+  ModelLibrary(void* handle, createAdsbrainInferenceModel create_model_func)
+      : handle_(handle), create_model_func_(create_model_func)
+  {
+  }
+
+  void* handle_;
+  createAdsbrainInferenceModel create_model_func_;
+};
+
+TRITONSERVER_Error*
+ModelLibrary::Open(
+    const std::string& path, std::shared_ptr<ModelLibrary>* library)
+{
+  void* handle = dlopen(path.c_str(), RTLD_NOW);
+  RETURN_ERROR_IF_TRUE(
+      handle == nullptr, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("Cannot open library: ") + dlerror());
+
+  // A library built against another version of adsbrain_backend.h does
+  // not have the virtual functions the backend calls.
+  adsbrainModelAbiVersion abi_version_func =
+      (adsbrainModelAbiVersion)dlsym(handle, "AdsbrainModelAbiVersion");
+  const std::string abi_version =
+      (abi_version_func != nullptr) ? std::to_string((*abi_version_func)())
+                                    : "none";
+  if (abi_version != std::to_string(ADSBRAIN_MODEL_ABI_VERSION)) {
+    dlclose(handle);
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("model library " + path +
+         " was built against another adsbrain_backend.h (ABI version " +
+         abi_version + ", expected " +
+         std::to_string(ADSBRAIN_MODEL_ABI_VERSION) + ") and must be rebuilt")
+            .c_str());
+  }
+
+  createAdsbrainInferenceModel create_model_func =
+      (createAdsbrainInferenceModel)dlsym(handle, "CreateInferenceModel");
+  if (create_model_func == nullptr) {
+    const std::string error = dlerror();
+    dlclose(handle);
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("Cannot load symbol CreateInferenceModel: " + error).c_str());
+  }
+
+  library->reset(new ModelLibrary(handle, create_model_func));
+  return nullptr;  // success
+}
+
+//
+// BackendState
+//
+// State shared by all the models and model instances of the backend.
 //
+class BackendState {
+ public:
+  static TRITONSERVER_Error* Create(BackendState** state);
+  ~BackendState();
+
+  // Get the state of the backend of 'triton_model'.
+  static TRITONSERVER_Error* ForModel(
+      TRITONBACKEND_Model* triton_model, BackendState** state);
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  // The family of 'metric'. Families are created once for the process
+  // and every instance reports into them under its own labels.
+  TRITONSERVER_MetricFamily* MetricFamily(const InstanceMetric metric) const
+  {
+    return metric_families_[static_cast<size_t>(metric)];
+  }
+
+  // The family of the model metric 'name', created by the first
+  // instance registering it. Fails if it was created with another
+  // kind.
+  TRITONSERVER_Error* ModelMetricFamily(
+      const std::string& name, const TRITONSERVER_MetricKind kind,
+      const std::string& description, TRITONSERVER_MetricFamily** family);
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+
+  // The model library at 'path', opened by the first model using it
+  // and shared with the models using it until they are all destroyed.
+  TRITONSERVER_Error* AcquireModelLibrary(
+      const std::string& path, std::shared_ptr<ModelLibrary>* library);
+
+  // The shared asset 'name' of type 'type', loaded with 'load' if no
+  // model holds it. The asset keeps 'library', which loaded it and
+  // holds the code destroying it, open until it is released. Throws
+  // like SharedAssets::Get.
+  std::shared_ptr<void> SharedAsset(
+      const std::string& name, const std::string& type,
+      const std::shared_ptr<ModelLibrary>& library,
+      const std::function<std::shared_ptr<void>()>& load);
+
+ private:
+  BackendState() = default;
+
+  // Held by the models until they are destroyed, the registry only
+  // keeps weak references so they are released with the last model.
+  std::mutex library_mu_;
+  std::unordered_map<std::string, std::weak_ptr<ModelLibrary>> libraries_;
+
+  struct SharedAssetSlot {
+    // Held while the asset is loaded.
+    std::mutex mu;
+    std::string type;
+    std::weak_ptr<void> asset;
+  };
+  std::mutex asset_mu_;
+  std::unordered_map<std::string, std::shared_ptr<SharedAssetSlot>> assets_;
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  std::vector<TRITONSERVER_MetricFamily*> metric_families_;
+
+  std::mutex model_metric_mu_;
+  typedef std::pair<TRITONSERVER_MetricKind, TRITONSERVER_MetricFamily*>
+      KindAndFamily;
+  std::unordered_map<std::string, KindAndFamily> model_metric_families_;
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+};
+
+TRITONSERVER_Error*
+BackendState::Create(BackendState** state)
+{
+  std::unique_ptr<BackendState> backend_state(new BackendState());
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  for (const auto& spec : kInstanceMetricSpecs) {
+    TRITONSERVER_MetricFamily* family;
+    RETURN_IF_ERROR(TRITONSERVER_MetricFamilyNew(
+        &family, spec.kind, spec.name, spec.description));
+    backend_state->metric_families_.push_back(family);
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+
+  *state = backend_state.release();
+  return nullptr;  // success
+}
+
+BackendState::~BackendState()
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  for (auto family : metric_families_) {
+    LOG_IF_ERROR(
+        TRITONSERVER_MetricFamilyDelete(family),
+        "failed to delete metric family");
+  }
+  for (const auto& family : model_metric_families_) {
+    LOG_IF_ERROR(
+        TRITONSERVER_MetricFamilyDelete(family.second.second),
+        "failed to delete metric family");
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+}
+
+TRITONSERVER_Error*
+BackendState::ForModel(TRITONBACKEND_Model* triton_model, BackendState** state)
+{
+  TRITONBACKEND_Backend* backend;
+  RETURN_IF_ERROR(TRITONBACKEND_ModelBackend(triton_model, &backend));
+  void* vstate;
+  RETURN_IF_ERROR(TRITONBACKEND_BackendState(backend, &vstate));
+  *state = reinterpret_cast<BackendState*>(vstate);
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+BackendState::AcquireModelLibrary(
+    const std::string& path, std::shared_ptr<ModelLibrary>* library)
+{
+  // The libraries are registered under their resolved path so the
+  // models naming the same file differently share it.
+  std::string key = path;
+  char* resolved_path = realpath(path.c_str(), nullptr);
+  if (resolved_path != nullptr) {
+    key = resolved_path;
+    free(resolved_path);
+  }
+
+  std::lock_guard<std::mutex> lock(library_mu_);
+  std::weak_ptr<ModelLibrary>& registered = libraries_[key];
+  *library = registered.lock();
+  if (*library != nullptr) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_VERBOSE,
+        (std::string("sharing model library ") + key).c_str());
+    return nullptr;  // success
+  }
+
+  RETURN_IF_ERROR(ModelLibrary::Open(path, library));
+  registered = *library;
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      (std::string("opened model library ") + key).c_str());
+
+  return nullptr;  // success
+}
+
+std::shared_ptr<void>
+BackendState::SharedAsset(
+    const std::string& name, const std::string& type,
+    const std::shared_ptr<ModelLibrary>& library,
+    const std::function<std::shared_ptr<void>()>& load)
+{
+  std::shared_ptr<SharedAssetSlot> slot;
+  {
+    std::lock_guard<std::mutex> lock(asset_mu_);
+    std::shared_ptr<SharedAssetSlot>& registered = assets_[name];
+    if (registered == nullptr) {
+      registered.reset(new SharedAssetSlot());
+    }
+    slot = registered;
+  }
+
+  // Only the assets of one name wait for each other to load.
+  std::lock_guard<std::mutex> lock(slot->mu);
+  std::shared_ptr<void> asset = slot->asset.lock();
+  if (asset != nullptr) {
+    if (slot->type != type) {
+      throw std::invalid_argument(
+          "shared asset '" + name + "' is held with another type");
+    }
+    return asset;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  std::shared_ptr<void> loaded = load();
+  if (loaded == nullptr) {
+    throw std::invalid_argument("shared asset '" + name + "' loaded as null");
+  }
+
+  // The asset is destroyed before the library is released.
+  struct Holder {
+    std::shared_ptr<ModelLibrary> library;
+    std::shared_ptr<void> asset;
+  };
+  std::shared_ptr<Holder> holder(new Holder{library, std::move(loaded)});
+  asset = std::shared_ptr<void>(holder, holder->asset.get());
+  slot->type = type;
+  slot->asset = asset;
+
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      (std::string("loaded shared asset '") + name + "' in " +
+       std::to_string(
+           std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - start)
+               .count()) +
+       " ms")
+          .c_str());
+
+  return asset;
+}
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+TRITONSERVER_Error*
+BackendState::ModelMetricFamily(
+    const std::string& name, const TRITONSERVER_MetricKind kind,
+    const std::string& description, TRITONSERVER_MetricFamily** family)
+{
+  std::lock_guard<std::mutex> lock(model_metric_mu_);
+  auto it = model_metric_families_.find(name);
+  if (it == model_metric_families_.end()) {
+    RETURN_IF_ERROR(TRITONSERVER_MetricFamilyNew(
+        family, kind, name.c_str(), description.c_str()));
+    model_metric_families_.emplace(name, std::make_pair(kind, *family));
+    return nullptr;  // success
+  }
+
+  RETURN_ERROR_IF_FALSE(
+      it->second.first == kind, TRITONSERVER_ERROR_ALREADY_EXISTS,
+      std::string("metric '") + name + "' exists with another kind");
+  *family = it->second.second;
+
+  return nullptr;  // success
+}
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
 
 /////////////
 
@@ -109,11 +542,16 @@ TRITONBACKEND_Initialize(TRITONBACKEND_Backend* backend)
       TRITONSERVER_LOG_INFO,
       (std::string("backend configuration:\n") + buffer).c_str());
 
-  // This backend does not require any "global" state but as an
-  // example create a string to demonstrate.
-  std::string* state = new std::string("backend state");
-  RETURN_IF_ERROR(
-      TRITONBACKEND_BackendSetState(backend, reinterpret_cast<void*>(state)));
+  // The state shared by all the models, deleted in
+  // TRITONBACKEND_Finalize.
+  BackendState* state;
+  RETURN_IF_ERROR(BackendState::Create(&state));
+  TRITONSERVER_Error* err =
+      TRITONBACKEND_BackendSetState(backend, reinterpret_cast<void*>(state));
+  if (err != nullptr) {
+    delete state;
+    return err;
+  }
 
   return nullptr;  // success
 }
@@ -127,12 +565,9 @@ TRITONBACKEND_Finalize(TRITONBACKEND_Backend* backend)
   // Delete the "global" state associated with the backend.
   void* vstate;
   RETURN_IF_ERROR(TRITONBACKEND_BackendState(backend, &vstate));
-  std::string* state = reinterpret_cast<std::string*>(vstate);
+  BackendState* state = reinterpret_cast<BackendState*>(vstate);
 
-  LOG_MESSAGE(
-      TRITONSERVER_LOG_INFO,
-      (std::string("TRITONBACKEND_Finalize: state is '") + *state + "'")
-          .c_str());
+  LOG_MESSAGE(TRITONSERVER_LOG_INFO, "TRITONBACKEND_Finalize");
 
   delete state;
 
@@ -144,595 +579,5758 @@ TRITONBACKEND_Finalize(TRITONBACKEND_Backend* backend)
 /////////////
 
 //
-// ModelState
+// TensorConfig
 //
-// State associated with a model that is using this backend. An object
-// of this class is created and associated with each
-// TRITONBACKEND_Model. ModelState is derived from BackendModel class
-// provided in the backend utilities that provides many common
-// functions.
+// Name, datatype and shape of an input or output tensor as given in
+// the model configuration. The shape does not include the batch
+// dimension (if the model has one).
 //
-class ModelState : public BackendModel {
- public:
-  static TRITONSERVER_Error* Create(
-      TRITONBACKEND_Model* triton_model, ModelState** state);
-  virtual ~ModelState() = default;
+struct TensorConfig {
+  std::string name;
+  TRITONSERVER_DataType datatype;
+  DataType adsbrain_datatype;
+  std::vector<int64_t> dims;
+};
 
-  // Name of the input and output tensor
-  const std::string& InputTensorName() const { return input_name_; }
-  const std::string& OutputTensorName() const { return output_name_; }
-  const std::unordered_map<std::string, std::string>& GetModelConfig() const
-  {
-    return adsbrain_model_configurations_;
+// Current time in nanoseconds, also available when the backend is
+// built without TRITON_ENABLE_STATS.
+uint64_t
+NowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// CPU time consumed by the calling thread in nanoseconds.
+uint64_t
+ThreadCpuNs()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
   }
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-  // Datatype of the input and output tensor
-  TRITONSERVER_DataType TensorDataType() const { return datatype_; }
+// Advance the xorshift64* generator 'state', which must not be 0, and
+// return a uniform double in [0, 1) from the top 53 bits of its output.
+double
+RandomFraction(uint64_t* state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  const uint64_t random = *state * 0x2545F4914F6CDD1Dull;
+  return (random >> 11) * (1.0 / (1ull << 53));
+}
 
-  // Shape of the input and output tensor as given in the model
-  // configuration file. This shape will not include the batch
-  // dimension (if the model has one).
-  const std::vector<int64_t>& TensorNonBatchShape() const { return nb_shape_; }
+// Split 'value' at each 'delimiter', dropping the empty parts.
+std::vector<std::string>
+SplitParameter(const std::string& value, const char delimiter)
+{
+  std::vector<std::string> parts;
+  size_t start = 0;
+  while (start <= value.size()) {
+    size_t end = value.find(delimiter, start);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    if (end > start) {
+      parts.push_back(value.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return parts;
+}
 
-  // Shape of the input and output tensor, including the batch
-  // dimension (if the model has one). This method cannot be called
-  // until the model is completely loaded and initialized, including
-  // all instances of the model. In practice, this means that backend
-  // should only call it in TRITONBACKEND_ModelInstanceExecute.
-  TRITONSERVER_Error* TensorShape(std::vector<int64_t>& shape);
+// Whether the model left 'tensor' without any element or shape.
+bool
+OutputTensorEmpty(const OutputTensor& tensor)
+{
+  return tensor.shapes.empty() && tensor.strings.empty() &&
+         tensor.data.empty();
+}
 
-  // Validate that this model is supported by this backend.
-  TRITONSERVER_Error* ValidateModelConfig();
+// Map the Triton datatype to the datatype exposed to the model. Return
+// false if the datatype is not supported by this backend.
+bool
+ToAdsbrainDataType(TRITONSERVER_DataType datatype, DataType* adsbrain_datatype)
+{
+  switch (datatype) {
+    case TRITONSERVER_TYPE_BYTES:
+      *adsbrain_datatype = DataType::BYTES;
+      return true;
+    case TRITONSERVER_TYPE_FP32:
+      *adsbrain_datatype = DataType::FP32;
+      return true;
+    case TRITONSERVER_TYPE_FP16:
+      *adsbrain_datatype = DataType::FP16;
+      return true;
+    case TRITONSERVER_TYPE_INT8:
+      *adsbrain_datatype = DataType::INT8;
+      return true;
+    case TRITONSERVER_TYPE_INT64:
+      *adsbrain_datatype = DataType::INT64;
+      return true;
+    default:
+      return false;
+  }
+}
 
- private:
-  ModelState(TRITONBACKEND_Model* triton_model);
+//
+// StateConfig
+//
+// An implicit state of a model using the sequence batcher. The state is
+// read as input 'input.name' and written as output 'output.name'; both
+// have the datatype and shape of the state.
+//
+struct StateConfig {
+  TensorConfig input;
+  TensorConfig output;
+};
 
-  std::string input_name_;
-  std::string output_name_;
+//
+// SequenceControlConfig
+//
+// A CONTROL_SEQUENCE_START or CONTROL_SEQUENCE_END control input. The
+// control is set when the first element of the input equals
+// 'true_value', the bytes of the configured true value. 'name' is empty
+// if the control is not configured.
+//
+struct SequenceControlConfig {
+  std::string name;
+  std::string true_value;
+};
 
-  TRITONSERVER_DataType datatype_;
+//
+// PayloadDecoderConfig
+//
+// Options of the payload decoding stage. 'kind' is empty if the
+// payloads are passed to the model undecoded.
+//
+struct PayloadDecoderConfig {
+  std::string kind;
+  size_t input_idx = 0;
+  std::vector<std::string> fields;
+  char delimiter = '\t';
+};
 
-  bool shape_initialized_;
-  std::vector<int64_t> nb_shape_;
-  std::vector<int64_t> shape_;
-  std::unordered_map<std::string, std::string> adsbrain_model_configurations_;
+//
+// ProfilerConfig
+//
+// Options of the sampling profiler of the executions. 'sample_rate' is
+// 0 if the profiler is disabled. When 'control_file' is set the
+// executions are only profiled while that file exists.
+//
+struct ProfilerConfig {
+  double sample_rate = 0;
+  std::string output_path;
+  uint64_t interval_ns = 0;
+  bool cpu_counters = false;
+  std::string control_file;
 };
 
-ModelState::ModelState(TRITONBACKEND_Model* triton_model)
-    : BackendModel(triton_model), shape_initialized_(false)
-{
-  // Validate that the model's configuration matches what is supported
-  // by this backend.
-  THROW_IF_BACKEND_MODEL_ERROR(ValidateModelConfig());
+//
+// PipelineStageConfig
+//
+// A model library run in process after the model of 'model_lib_path',
+// receiving the 'inputs' output by the previous stage.
+//
+struct PipelineStageConfig {
+  std::string model_lib_path;
+  std::vector<TensorConfig> inputs;
+};
 
-  // Load the model configuration parameters
-  std::string RELATIVE_PATH_KEYWORD = "$$TRITON_MODEL_DIRECTORY";
-  const char* cur_model_dir = nullptr;
-  TRITONBACKEND_ArtifactType artifact_type;
-  THROW_IF_BACKEND_MODEL_ERROR(TRITONBACKEND_ModelRepository(
-      TritonModel(), &artifact_type, &cur_model_dir));
+//
+// CaptureConfig
+//
+// Options of the capture of the batches run through the model.
+// 'sample_rate' is 0 if the batches are not captured. The model has a
+// single BYTES input, which is captured.
+//
+struct CaptureConfig {
+  double sample_rate = 0;
+  std::string output_path;
+  uint64_t max_bytes = 0;
+};
 
-  triton::common::TritonJson::Value params;
-  if (ModelConfig().Find("parameters", &params)) {
-    std::vector<std::string> names;
-    THROW_IF_BACKEND_MODEL_ERROR(params.Members(&names));
-    for (size_t i = 0; i < names.size(); ++i) {
-      std::string key = names[i];
-      std::string value;
-      THROW_IF_BACKEND_MODEL_ERROR(
-          TryParseModelStringParameter(params, key.c_str(), &value, "NULL"));
-      size_t relative_path_loc = value.find(RELATIVE_PATH_KEYWORD);
-      if (relative_path_loc != std::string::npos) {
-        value.replace(
-            relative_path_loc, RELATIVE_PATH_KEYWORD.length(), cur_model_dir);
-      }
+//
+// ShadowConfig
+//
+// Options of the shadow model run on a sample of the batches to be
+// compared with the model. 'model_lib_path' is empty if the model has
+// no shadow.
+//
+struct ShadowConfig {
+  std::string model_lib_path;
+  double sample_rate = 0;
+  size_t max_pending_batches = 0;
+  bool diff_outputs = false;
+  uint64_t report_interval_ns = 0;
+};
 
-      adsbrain_model_configurations_.emplace(std::make_pair(key, value));
-    }
+// Map the codec name used in the model configuration to the codec,
+// failing if the backend was built without it.
+TRITONSERVER_Error*
+ParsePayloadCodec(const std::string& name, PayloadCodec* codec)
+{
+  if (name == "none") {
+    *codec = PayloadCodec::NONE;
+    return nullptr;  // success
   }
-
-  if (adsbrain_model_configurations_.find("model_lib_path") ==
-      adsbrain_model_configurations_.end()) {
-    LOG_MESSAGE(
-        TRITONSERVER_LOG_ERROR,
-        "failed to find 'model_lib_path' in model config file");
+#ifdef TRITON_ADSBRAIN_ENABLE_LZ4
+  if (name == "lz4") {
+    *codec = PayloadCodec::LZ4;
+    return nullptr;  // success
   }
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+  if (name == "zstd") {
+    *codec = PayloadCodec::ZSTD;
+    return nullptr;  // success
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+  return TRITONSERVER_ErrorNew(
+      TRITONSERVER_ERROR_UNSUPPORTED,
+      (std::string("unsupported compression codec '") + name + "'").c_str());
 }
 
-TRITONSERVER_Error*
-ModelState::Create(TRITONBACKEND_Model* triton_model, ModelState** state)
-{
-  try {
-    *state = new ModelState(triton_model);
+//
+// RequestCapture
+//
+// Writes the captured batches of all the instances of a model to the
+// capture file, in the format described in adsbrain_capture.h. The
+// instances sample the batches and serialize them, the capture only
+// appends the records under a lock. The capture stops once the file
+// would exceed its size limit.
+//
+class RequestCapture {
+ public:
+  // Create the capture file and write its 'header'.
+  static TRITONSERVER_Error* Create(
+      const CaptureConfig& config, const std::string& model_name,
+      const std::string& header, std::unique_ptr<RequestCapture>* capture);
+  ~RequestCapture();
+
+  // Whether the next batch of an instance is captured, drawn with the
+  // random generator 'random_state' of the instance.
+  bool SampleBatch(uint64_t* random_state) const
+  {
+    return !stopped_.load(std::memory_order_relaxed) &&
+           (RandomFraction(random_state) < config_.sample_rate);
   }
-  catch (const BackendModelException& ex) {
-    RETURN_ERROR_IF_TRUE(
-        ex.err_ == nullptr, TRITONSERVER_ERROR_INTERNAL,
-        std::string("unexpected nullptr in BackendModelException"));
-    RETURN_IF_ERROR(ex.err_);
+
+  // The time of 'time_ns' relative to the start of the capture.
+  uint64_t CaptureTimeNs(const uint64_t time_ns) const
+  {
+    return (time_ns > start_ns_) ? (time_ns - start_ns_) : 0;
   }
 
-  return nullptr;  // success
-}
+  // Append the serialized batch 'record' to the file.
+  void Write(const std::string& record);
 
-TRITONSERVER_Error*
-ModelState::TensorShape(std::vector<int64_t>& shape)
-{
-  // This backend supports models that batch along the first dimension
-  // and those that don't batch. For non-batch models the output shape
-  // will be the shape from the model configuration. For batch models
-  // the output shape will be the shape from the model configuration
-  // prepended with [ -1 ] to represent the batch dimension. The
-  // backend "responder" utility used below will set the appropriate
-  // batch dimension value for each response. The shape needs to be
-  // initialized lazily because the SupportsFirstDimBatching function
-  // cannot be used until the model is completely loaded.
-  if (!shape_initialized_) {
-    bool supports_first_dim_batching;
-    RETURN_IF_ERROR(SupportsFirstDimBatching(&supports_first_dim_batching));
-    if (supports_first_dim_batching) {
-      shape_.push_back(-1);
-    }
+ private:
+  RequestCapture(
+      const CaptureConfig& config, const std::string& model_name, FILE* file,
+      const uint64_t written_bytes);
 
-    shape_.insert(shape_.end(), nb_shape_.begin(), nb_shape_.end());
-    shape_initialized_ = true;
-  }
+  // Stop capturing, logging 'reason'. Must be called with 'mu_' held.
+  void Stop(const std::string& reason);
 
-  shape = shape_;
+  static constexpr uint64_t kFlushIntervalNs = 1000000000;
 
-  return nullptr;  // success
+  const CaptureConfig config_;
+  const std::string model_name_;
+  const uint64_t start_ns_;
+  std::atomic<bool> stopped_;
+
+  std::mutex mu_;
+  FILE* file_;
+  uint64_t written_bytes_;
+  uint64_t records_;
+  uint64_t flushed_ns_;
+};
+
+constexpr uint64_t RequestCapture::kFlushIntervalNs;
+
+RequestCapture::RequestCapture(
+    const CaptureConfig& config, const std::string& model_name, FILE* file,
+    const uint64_t written_bytes)
+    : config_(config), model_name_(model_name), start_ns_(NowNs()),
+      stopped_(false), file_(file), written_bytes_(written_bytes),
+      records_(0), flushed_ns_(start_ns_)
+{
 }
 
-TRITONSERVER_Error*
-ModelState::ValidateModelConfig()
+RequestCapture::~RequestCapture()
 {
-  // If verbose logging is enabled, dump the model's configuration as
-  // JSON into the console output.
-  if (TRITONSERVER_LogIsEnabled(TRITONSERVER_LOG_VERBOSE)) {
-    common::TritonJson::WriteBuffer buffer;
-    RETURN_IF_ERROR(ModelConfig().PrettyWrite(&buffer));
+  if (fclose(file_) != 0) {
     LOG_MESSAGE(
-        TRITONSERVER_LOG_VERBOSE,
-        (std::string("model configuration:\n") + buffer.Contents()).c_str());
+        TRITONSERVER_LOG_ERROR,
+        (std::string("failed to close the capture file '") +
+         config_.output_path + "': " + strerror(errno))
+            .c_str());
   }
+}
 
-  // ModelConfig is the model configuration as a TritonJson
-  // object. Use the TritonJson utilities to parse the JSON and
-  // determine if the configuration is supported by this backend.
-  common::TritonJson::Value inputs, outputs;
-  RETURN_IF_ERROR(ModelConfig().MemberAsArray("input", &inputs));
-  RETURN_IF_ERROR(ModelConfig().MemberAsArray("output", &outputs));
+TRITONSERVER_Error*
+RequestCapture::Create(
+    const CaptureConfig& config, const std::string& model_name,
+    const std::string& header, std::unique_ptr<RequestCapture>* capture)
+{
+  FILE* file = fopen(config.output_path.c_str(), "wb");
+  RETURN_ERROR_IF_TRUE(
+      file == nullptr, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("failed to create the capture file '") + config.output_path +
+          "': " + strerror(errno));
+  if (fwrite(header.data(), 1, header.size(), file) != header.size()) {
+    fclose(file);
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        (std::string("failed to write the capture file '") +
+         config.output_path + "'")
+            .c_str());
+  }
 
-  // The model must have exactly 1 input and 1 output.
-  RETURN_ERROR_IF_FALSE(
-      inputs.ArraySize() == 1, TRITONSERVER_ERROR_INVALID_ARG,
-      std::string("model configuration must have 1 input"));
-  RETURN_ERROR_IF_FALSE(
-      outputs.ArraySize() == 1, TRITONSERVER_ERROR_INVALID_ARG,
-      std::string("model configuration must have 1 output"));
+  capture->reset(new RequestCapture(config, model_name, file, header.size()));
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      (std::string("model ") + model_name + ": capturing " +
+       std::to_string(config.sample_rate) + " of the batches to '" +
+       config.output_path + "'")
+          .c_str());
+  return nullptr;  // success
+}
+
+void
+RequestCapture::Write(const std::string& record)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (stopped_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (written_bytes_ + record.size() > config_.max_bytes) {
+    Stop("reached capture_max_bytes");
+    return;
+  }
+  if (fwrite(record.data(), 1, record.size(), file_) != record.size()) {
+    Stop(std::string("failed to write the file: ") + strerror(errno));
+    return;
+  }
+  written_bytes_ += record.size();
+  ++records_;
+
+  // Flush regularly so the file can be replayed while the model is
+  // still loaded.
+  const uint64_t now_ns = NowNs();
+  if (now_ns - flushed_ns_ >= kFlushIntervalNs) {
+    fflush(file_);
+    flushed_ns_ = now_ns;
+  }
+}
+
+void
+RequestCapture::Stop(const std::string& reason)
+{
+  stopped_.store(true, std::memory_order_relaxed);
+  fflush(file_);
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      (std::string("model ") + model_name_ + ": stopped capturing after " +
+       std::to_string(records_) + " batches, " +
+       std::to_string(written_bytes_) + " bytes: " + reason)
+          .c_str());
+}
 
-  common::TritonJson::Value input, output;
-  RETURN_IF_ERROR(inputs.IndexAsObject(0, &input));
-  RETURN_IF_ERROR(outputs.IndexAsObject(0, &output));
+//
+// ShardExecutor
+//
+// Runs the batches scattered to one shard of a sharded model on a
+// thread of its own, one batch at a time and in the order they are
+// enqueued, whichever instance received them.
+//
+class ShardExecutor {
+ public:
+  explicit ShardExecutor(AdsbrainInferenceModel* model)
+      : model_(model), stopping_(false), thread_(&ShardExecutor::Run, this)
+  {
+  }
+  ~ShardExecutor() { Stop(); }
 
-  // Record the input and output name in the model state.
-  const char* input_name;
-  size_t input_name_len;
-  RETURN_IF_ERROR(input.MemberAsString("name", &input_name, &input_name_len));
-  input_name_ = std::string(input_name);
+  // Run 'inputs' through the shard into 'outputs', which must remain
+  // valid until 'done' is ready. 'done' holds the exception thrown by
+  // the model, if any. Return false if the executor is stopped.
+  bool Enqueue(
+      const InferenceInputs* inputs, InferenceOutputs* outputs,
+      std::future<void>* done);
 
-  const char* output_name;
-  size_t output_name_len;
-  RETURN_IF_ERROR(
-      output.MemberAsString("name", &output_name, &output_name_len));
-  output_name_ = std::string(output_name);
+  // Stop once the batches already enqueued are run.
+  void Stop();
 
-  // Input and output must have same datatype
-  std::string input_dtype, output_dtype;
-  RETURN_IF_ERROR(input.MemberAsString("data_type", &input_dtype));
-  RETURN_IF_ERROR(output.MemberAsString("data_type", &output_dtype));
-  RETURN_ERROR_IF_FALSE(
-      input_dtype == output_dtype, TRITONSERVER_ERROR_INVALID_ARG,
-      std::string("expected input and output datatype to match, got ") +
-          input_dtype + " and " + output_dtype);
-  datatype_ = ModelConfigDataTypeToTritonServerDataType(input_dtype);
-
-  // Input and output must have same shape. Reshape is not supported
-  // on either input or output so flag an error is the model
-  // configuration uses it.
-  triton::common::TritonJson::Value reshape;
+ private:
+  void Run();
+
+  AdsbrainInferenceModel* model_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stopping_;
+  std::deque<std::packaged_task<void()>> batches_;
+  std::thread thread_;
+};
+
+bool
+ShardExecutor::Enqueue(
+    const InferenceInputs* inputs, InferenceOutputs* outputs,
+    std::future<void>* done)
+{
+  AdsbrainInferenceModel* model = model_;
+  std::packaged_task<void()> batch([model, inputs, outputs]() {
+    model->RunTensorInference(*inputs, outputs);
+  });
+  *done = batch.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (stopping_) {
+      return false;
+    }
+    batches_.push_back(std::move(batch));
+  }
+  cv_.notify_one();
+  return true;
+}
+
+void
+ShardExecutor::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  cv_.notify_one();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void
+ShardExecutor::Run()
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    cv_.wait(lock, [this]() { return stopping_ || !batches_.empty(); });
+    if (batches_.empty()) {
+      return;
+    }
+    std::packaged_task<void()> batch = std::move(batches_.front());
+    batches_.pop_front();
+    lock.unlock();
+    batch();
+    lock.lock();
+  }
+}
+
+//
+// ShardGroup
+//
+// The shards of a sharded model, each loaded and run by one model
+// instance. An instance takes the lowest free shard index, so the
+// instances created in order hold the shards of their index.
+//
+class ShardGroup {
+ public:
+  explicit ShardGroup(const size_t shard_count)
+      : joined_(shard_count, false), executors_(shard_count)
+  {
+  }
+
+  size_t ShardCount() const { return joined_.size(); }
+
+  // Reserve the shard of a new instance in 'shard_idx'. Fails if every
+  // shard is already held by an instance.
+  TRITONSERVER_Error* Join(size_t* shard_idx);
+
+  // Make the shard 'shard_idx' available to the batches once its model
+  // is initialized.
+  void Start(
+      const size_t shard_idx, const std::shared_ptr<ShardExecutor>& executor);
+
+  // Release the shard 'shard_idx' of an instance being destroyed. The
+  // batches scattered afterwards fail until another instance holds it.
+  void Leave(const size_t shard_idx);
+
+  // The executors of all the shards, in shard order. Throws if a shard
+  // is not available.
+  std::vector<std::shared_ptr<ShardExecutor>> Executors();
+
+ private:
+  std::mutex mu_;
+  std::vector<bool> joined_;
+  std::vector<std::shared_ptr<ShardExecutor>> executors_;
+};
+
+TRITONSERVER_Error*
+ShardGroup::Join(size_t* shard_idx)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = std::find(joined_.begin(), joined_.end(), false);
   RETURN_ERROR_IF_TRUE(
-      input.Find("reshape", &reshape), TRITONSERVER_ERROR_UNSUPPORTED,
-      std::string("reshape not supported for input tensor"));
+      it == joined_.end(), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("the model has more instances than the ") +
+          std::to_string(joined_.size()) + " shards of shard_count");
+  *it = true;
+  *shard_idx = it - joined_.begin();
+
+  return nullptr;  // success
+}
+
+void
+ShardGroup::Start(
+    const size_t shard_idx, const std::shared_ptr<ShardExecutor>& executor)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  executors_[shard_idx] = executor;
+}
+
+void
+ShardGroup::Leave(const size_t shard_idx)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  joined_[shard_idx] = false;
+  executors_[shard_idx].reset();
+}
+
+std::vector<std::shared_ptr<ShardExecutor>>
+ShardGroup::Executors()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  for (size_t s = 0; s < executors_.size(); ++s) {
+    if (executors_[s] == nullptr) {
+      throw std::runtime_error(
+          "shard " + std::to_string(s) + " of the model is not loaded");
+    }
+  }
+  return executors_;
+}
+
+//
+// ModelState
+//
+// State associated with a model that is using this backend. An object
+// of this class is created and associated with each
+// TRITONBACKEND_Model. ModelState is derived from BackendModel class
+// provided in the backend utilities that provides many common
+// functions.
+//
+class ModelState : public BackendModel {
+ public:
+  static TRITONSERVER_Error* Create(
+      TRITONBACKEND_Model* triton_model, ModelState** state);
+  virtual ~ModelState() = default;
+
+  // The input and output tensors, in the order of the model
+  // configuration.
+  const std::vector<TensorConfig>& Inputs() const { return inputs_; }
+  const std::vector<TensorConfig>& Outputs() const { return outputs_; }
+  const std::unordered_map<std::string, std::string>& GetModelConfig() const
+  {
+    return adsbrain_model_configurations_;
+  }
+
+  // Whether the rows of numeric input batches are padded to
+  // kTensorAlignment bytes.
+  bool AlignNumericRows() const { return align_numeric_rows_; }
+
+  // The pages backing the shared assets of the model and the staging
+  // buffers of its instances.
+  HugePages HugePagesMode() const { return huge_pages_; }
+
+  // Options of the payload decoding stage.
+  const PayloadDecoderConfig& PayloadDecoding() const
+  {
+    return payload_decoding_;
+  }
+
+  // Whether the BYTES inputs carry a compression header, and the codec
+  // used to compress the BYTES outputs at least
+  // ResponseCompressionMinBytes() long.
+  bool CompressedPayloads() const { return compressed_payloads_; }
+  // The size a compressed payload element can expand to at most.
+  size_t PayloadMaxUncompressedBytes() const
+  {
+    return payload_max_uncompressed_bytes_;
+  }
+  // The size the compressed payloads of one batch can expand to at most,
+  // over all the BYTES inputs.
+  size_t PayloadMaxBatchUncompressedBytes() const
+  {
+    return payload_max_batch_uncompressed_bytes_;
+  }
+  PayloadCodec ResponseCodec() const { return response_codec_; }
+  size_t ResponseCompressionMinBytes() const
+  {
+    return response_compression_min_bytes_;
+  }
+  int ResponseCompressionLevel() const { return response_compression_level_; }
+
+  // The optional INT64 input holding the priority of a request, empty
+  // if all the requests have the same priority. Requests with a
+  // priority above PriorityHighLevel() are low priority; up to
+  // PriorityLowShare() of the requests of an execution can be low
+  // priority requests run with the high priority ones.
+  const std::string& PriorityInput() const { return priority_input_; }
+  int64_t PriorityHighLevel() const { return priority_high_level_; }
+  double PriorityLowShare() const { return priority_low_share_; }
+
+  // The target compute time of a batch, 0 if the batch size is not
+  // adapted to it.
+  uint64_t BatchLatencyTargetNs() const { return batch_latency_target_ns_; }
+
+  // The payload bytes a batch holds at most, 0 if batches are not split
+  // by payload size.
+  size_t BatchMaxPayloadBytes() const { return batch_max_payload_bytes_; }
+
+  // The time within which an instance must be able to serve an
+  // execution, 0 if requests are never shed.
+  uint64_t ShedLatencyBudgetNs() const { return shed_latency_budget_ns_; }
+
+  // Options of the sampling profiler.
+  const ProfilerConfig& Profiling() const { return profiling_; }
+
+  // The directory of the snapshots of the initialized models, empty if
+  // the models are not snapshotted.
+  const std::string& SnapshotDirectory() const { return snapshot_directory_; }
+
+  // The stages run after the model of 'model_lib_path', empty if the
+  // model is not a pipeline.
+  const std::vector<PipelineStageConfig>& Pipeline() const
+  {
+    return pipeline_;
+  }
+
+  // The shards of the model loaded by the instances, null if the
+  // model is not sharded.
+  ShardGroup* Shards() const { return shards_.get(); }
+
+  // Options of the shadow model compared with the model on a sample of
+  // the batches.
+  const ShadowConfig& Shadow() const { return shadowing_; }
+
+  // The capture of the batches shared by the instances, null if the
+  // batches are not captured.
+  RequestCapture* Capture() const { return capture_.get(); }
+
+  // Whether the model is decoupled and can send several responses per
+  // request.
+  bool Decoupled() const { return decoupled_; }
+
+  // Whether the model uses the sequence batcher, with its implicit
+  // states and the control inputs marking the start and the end of a
+  // sequence.
+  bool SequenceBatching() const { return sequence_batching_; }
+  const std::vector<StateConfig>& States() const { return states_; }
+  const SequenceControlConfig& SequenceStart() const { return sequence_start_; }
+  const SequenceControlConfig& SequenceEnd() const { return sequence_end_; }
+
+  // Validate that this model is supported by this backend.
+  TRITONSERVER_Error* ValidateModelConfig();
+
+ private:
+  ModelState(TRITONBACKEND_Model* triton_model);
+
+  // Read the backend option 'key' from the model configuration
+  // parameters, or 'default_value' if the parameter is not set.
+  TRITONSERVER_Error* BoolParameter(
+      const std::string& key, const bool default_value, bool* value) const;
+  TRITONSERVER_Error* IntParameter(
+      const std::string& key, const int64_t default_value,
+      int64_t* value) const;
+  TRITONSERVER_Error* DoubleParameter(
+      const std::string& key, const double default_value,
+      double* value) const;
+  void StringParameter(
+      const std::string& key, const std::string& default_value,
+      std::string* value) const;
+
+  TRITONSERVER_Error* ParsePriorityConfig();
+  TRITONSERVER_Error* ParsePayloadDecoderConfig();
+  TRITONSERVER_Error* ParseProfilerConfig();
+  TRITONSERVER_Error* ParseCaptureConfig();
+  TRITONSERVER_Error* ParsePipelineConfig();
+  TRITONSERVER_Error* ParseShardConfig();
+  TRITONSERVER_Error* ParseShadowConfig();
+
+  // The header of the capture file: the captured input, the outputs
+  // and the parameters of the model.
+  std::string CaptureHeader() const;
+
+  TRITONSERVER_Error* ParseTensorConfig(
+      common::TritonJson::Value& io, const std::string& kind,
+      TensorConfig* config);
+
+  TRITONSERVER_Error* ParseSequenceBatchingConfig();
+  TRITONSERVER_Error* ParseSequenceControl(
+      common::TritonJson::Value& control_input, const std::string& name);
+
+  std::vector<TensorConfig> inputs_;
+  std::vector<TensorConfig> outputs_;
+  std::unordered_map<std::string, std::string> adsbrain_model_configurations_;
+
+  bool align_numeric_rows_;
+  HugePages huge_pages_;
+  PayloadDecoderConfig payload_decoding_;
+  bool compressed_payloads_;
+  size_t payload_max_uncompressed_bytes_;
+  size_t payload_max_batch_uncompressed_bytes_;
+  PayloadCodec response_codec_;
+  size_t response_compression_min_bytes_;
+  int response_compression_level_;
+
+  std::string priority_input_;
+  int64_t priority_high_level_;
+  double priority_low_share_;
+  uint64_t batch_latency_target_ns_;
+  size_t batch_max_payload_bytes_;
+  uint64_t shed_latency_budget_ns_;
+  ProfilerConfig profiling_;
+  std::string snapshot_directory_;
+  CaptureConfig capturing_;
+  std::vector<PipelineStageConfig> pipeline_;
+  std::unique_ptr<ShardGroup> shards_;
+  ShadowConfig shadowing_;
+  std::unique_ptr<RequestCapture> capture_;
+
+  bool decoupled_;
+  bool sequence_batching_;
+  std::vector<StateConfig> states_;
+  SequenceControlConfig sequence_start_;
+  SequenceControlConfig sequence_end_;
+};
+
+ModelState::ModelState(TRITONBACKEND_Model* triton_model)
+    : BackendModel(triton_model)
+{
+  // Validate that the model's configuration matches what is supported
+  // by this backend.
+  THROW_IF_BACKEND_MODEL_ERROR(ValidateModelConfig());
+
+  // Load the model configuration parameters
+  std::string RELATIVE_PATH_KEYWORD = "$$TRITON_MODEL_DIRECTORY";
+  const char* cur_model_dir = nullptr;
+  TRITONBACKEND_ArtifactType artifact_type;
+  THROW_IF_BACKEND_MODEL_ERROR(TRITONBACKEND_ModelRepository(
+      TritonModel(), &artifact_type, &cur_model_dir));
+
+  triton::common::TritonJson::Value params;
+  if (ModelConfig().Find("parameters", &params)) {
+    std::vector<std::string> names;
+    THROW_IF_BACKEND_MODEL_ERROR(params.Members(&names));
+    for (size_t i = 0; i < names.size(); ++i) {
+      std::string key = names[i];
+      std::string value;
+      THROW_IF_BACKEND_MODEL_ERROR(
+          TryParseModelStringParameter(params, key.c_str(), &value, "NULL"));
+      // A parameter can list several paths, e.g. the libraries of a
+      // pipeline.
+      size_t relative_path_loc = value.find(RELATIVE_PATH_KEYWORD);
+      while (relative_path_loc != std::string::npos) {
+        value.replace(
+            relative_path_loc, RELATIVE_PATH_KEYWORD.length(), cur_model_dir);
+        relative_path_loc = value.find(
+            RELATIVE_PATH_KEYWORD, relative_path_loc + strlen(cur_model_dir));
+      }
+
+      adsbrain_model_configurations_.emplace(std::make_pair(key, value));
+    }
+  }
+
+  if (adsbrain_model_configurations_.find("model_lib_path") ==
+      adsbrain_model_configurations_.end()) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_ERROR,
+        "failed to find 'model_lib_path' in model config file");
+  }
+
+  THROW_IF_BACKEND_MODEL_ERROR(
+      BoolParameter("align_numeric_rows", false, &align_numeric_rows_));
+  std::string huge_pages;
+  StringParameter("huge_pages", "none", &huge_pages);
+  if (!ParseHugePages(huge_pages, &huge_pages_)) {
+    THROW_IF_BACKEND_MODEL_ERROR(TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        (std::string("unsupported huge_pages '") + huge_pages + "'").c_str()));
+  }
+  StringParameter("snapshot_directory", "", &snapshot_directory_);
+  THROW_IF_BACKEND_MODEL_ERROR(ParsePriorityConfig());
+
+  int64_t latency_target_us;
+  THROW_IF_BACKEND_MODEL_ERROR(
+      IntParameter("batch_latency_target_us", 0, &latency_target_us));
+  if ((latency_target_us > 0) && (MaxBatchSize() <= 0)) {
+    THROW_IF_BACKEND_MODEL_ERROR(TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        "batch_latency_target_us requires a model that supports batching"));
+  }
+  batch_latency_target_ns_ = std::max<int64_t>(latency_target_us, 0) * 1000;
+
+  int64_t max_payload_bytes;
+  THROW_IF_BACKEND_MODEL_ERROR(
+      IntParameter("batch_max_payload_bytes", 0, &max_payload_bytes));
+  batch_max_payload_bytes_ = std::max<int64_t>(max_payload_bytes, 0);
+
+  int64_t shed_budget_us;
+  THROW_IF_BACKEND_MODEL_ERROR(
+      IntParameter("shed_latency_budget_us", 0, &shed_budget_us));
+  shed_latency_budget_ns_ = std::max<int64_t>(shed_budget_us, 0) * 1000;
+  THROW_IF_BACKEND_MODEL_ERROR(ParseProfilerConfig());
+  THROW_IF_BACKEND_MODEL_ERROR(ParsePayloadDecoderConfig());
+  THROW_IF_BACKEND_MODEL_ERROR(ParsePipelineConfig());
+  THROW_IF_BACKEND_MODEL_ERROR(ParseShardConfig());
+  THROW_IF_BACKEND_MODEL_ERROR(ParseShadowConfig());
+
+  THROW_IF_BACKEND_MODEL_ERROR(
+      BoolParameter("payload_compression", false, &compressed_payloads_));
+  int64_t max_uncompressed_bytes;
+  THROW_IF_BACKEND_MODEL_ERROR(IntParameter(
+      "payload_max_uncompressed_bytes", 64 << 20, &max_uncompressed_bytes));
+  if (max_uncompressed_bytes <= 0) {
+    THROW_IF_BACKEND_MODEL_ERROR(TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        "payload_max_uncompressed_bytes must be positive"));
+  }
+  payload_max_uncompressed_bytes_ = max_uncompressed_bytes;
+  int64_t max_batch_uncompressed_bytes;
+  THROW_IF_BACKEND_MODEL_ERROR(IntParameter(
+      "payload_max_batch_uncompressed_bytes", 256 << 20,
+      &max_batch_uncompressed_bytes));
+  if (max_batch_uncompressed_bytes <= 0) {
+    THROW_IF_BACKEND_MODEL_ERROR(TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        "payload_max_batch_uncompressed_bytes must be positive"));
+  }
+  payload_max_batch_uncompressed_bytes_ = max_batch_uncompressed_bytes;
+  std::string response_codec;
+  StringParameter("response_compression", "none", &response_codec);
+  THROW_IF_BACKEND_MODEL_ERROR(
+      ParsePayloadCodec(response_codec, &response_codec_));
+  int64_t min_bytes, level;
+  THROW_IF_BACKEND_MODEL_ERROR(
+      IntParameter("response_compression_min_bytes", 256, &min_bytes));
+  THROW_IF_BACKEND_MODEL_ERROR(
+      IntParameter("response_compression_level", 1, &level));
+  response_compression_min_bytes_ = std::max<int64_t>(min_bytes, 0);
+  response_compression_level_ = level;
+
+  THROW_IF_BACKEND_MODEL_ERROR(ParseCaptureConfig());
+  if (capturing_.sample_rate > 0) {
+    THROW_IF_BACKEND_MODEL_ERROR(RequestCapture::Create(
+        capturing_, Name(), CaptureHeader(), &capture_));
+  }
+}
+
+TRITONSERVER_Error*
+ModelState::IntParameter(
+    const std::string& key, const int64_t default_value, int64_t* value) const
+{
+  auto it = adsbrain_model_configurations_.find(key);
+  if (it == adsbrain_model_configurations_.end()) {
+    *value = default_value;
+    return nullptr;  // success
+  }
+
+  try {
+    size_t pos = 0;
+    *value = std::stoll(it->second, &pos);
+    if (pos != it->second.size()) {
+      throw std::invalid_argument(it->second);
+    }
+  }
+  catch (const std::exception&) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        (std::string("expected an integer for parameter '") + key +
+         "', got '" + it->second + "'")
+            .c_str());
+  }
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::DoubleParameter(
+    const std::string& key, const double default_value, double* value) const
+{
+  auto it = adsbrain_model_configurations_.find(key);
+  if (it == adsbrain_model_configurations_.end()) {
+    *value = default_value;
+    return nullptr;  // success
+  }
+
+  try {
+    size_t pos = 0;
+    *value = std::stod(it->second, &pos);
+    if (pos != it->second.size()) {
+      throw std::invalid_argument(it->second);
+    }
+  }
+  catch (const std::exception&) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        (std::string("expected a number for parameter '") + key + "', got '" +
+         it->second + "'")
+            .c_str());
+  }
+
+  return nullptr;  // success
+}
+
+void
+ModelState::StringParameter(
+    const std::string& key, const std::string& default_value,
+    std::string* value) const
+{
+  auto it = adsbrain_model_configurations_.find(key);
+  *value = (it == adsbrain_model_configurations_.end()) ? default_value
+                                                        : it->second;
+}
+
+TRITONSERVER_Error*
+ModelState::ParseProfilerConfig()
+{
+  RETURN_IF_ERROR(
+      DoubleParameter("profile_sample_rate", 0, &profiling_.sample_rate));
+  RETURN_ERROR_IF_FALSE(
+      (profiling_.sample_rate >= 0) && (profiling_.sample_rate <= 1),
+      TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("profile_sample_rate must be between 0 and 1"));
+  if (profiling_.sample_rate == 0) {
+    return nullptr;  // success
+  }
+
+  StringParameter("profile_output_path", "", &profiling_.output_path);
   RETURN_ERROR_IF_TRUE(
-      output.Find("reshape", &reshape), TRITONSERVER_ERROR_UNSUPPORTED,
-      std::string("reshape not supported for output tensor"));
+      profiling_.output_path.empty(), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("profile_output_path is required by profile_sample_rate"));
+  int64_t interval_s;
+  RETURN_IF_ERROR(IntParameter("profile_interval_s", 60, &interval_s));
+  RETURN_ERROR_IF_FALSE(
+      interval_s > 0, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("profile_interval_s must be positive"));
+  profiling_.interval_ns = interval_s * 1000000000ull;
+  RETURN_IF_ERROR(
+      BoolParameter("profile_cpu_counters", false, &profiling_.cpu_counters));
+  StringParameter("profile_control_file", "", &profiling_.control_file);
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::ParsePipelineConfig()
+{
+  std::string lib_paths;
+  StringParameter("pipeline_model_lib_paths", "", &lib_paths);
+  const std::vector<std::string> paths = SplitParameter(lib_paths, ',');
+  if (paths.empty()) {
+    return nullptr;  // success
+  }
 
-  std::vector<int64_t> input_shape, output_shape;
-  RETURN_IF_ERROR(backend::ParseShape(input, "dims", &input_shape));
-  RETURN_IF_ERROR(backend::ParseShape(output, "dims", &output_shape));
+  // The stages do not exchange implicit states.
+  RETURN_ERROR_IF_TRUE(
+      sequence_batching_, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("pipeline_model_lib_paths is not supported with the "
+                  "sequence batcher"));
 
+  std::string stage_inputs;
+  StringParameter("pipeline_stage_inputs", "", &stage_inputs);
+  const std::vector<std::string> groups = SplitParameter(stage_inputs, ';');
   RETURN_ERROR_IF_FALSE(
-      input_shape == output_shape, TRITONSERVER_ERROR_INVALID_ARG,
-      std::string("expected input and output shape to match, got ") +
-          backend::ShapeToString(input_shape) + " and " +
-          backend::ShapeToString(output_shape));
+      groups.size() == paths.size(), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("pipeline_stage_inputs must list the inputs of each of "
+                  "the ") +
+          std::to_string(paths.size()) + " stages of the pipeline");
+
+  for (size_t s = 0; s < paths.size(); ++s) {
+    PipelineStageConfig stage;
+    stage.model_lib_path = paths[s];
+    for (const auto& tensor : SplitParameter(groups[s], ',')) {
+      const size_t colon = tensor.find(':');
+      TensorConfig config;
+      config.name = tensor.substr(0, colon);
+      const std::string dtype =
+          (colon == std::string::npos) ? "" : tensor.substr(colon + 1);
+      config.datatype = ModelConfigDataTypeToTritonServerDataType(dtype);
+      RETURN_ERROR_IF_FALSE(
+          !config.name.empty() &&
+              ToAdsbrainDataType(config.datatype, &config.adsbrain_datatype),
+          TRITONSERVER_ERROR_INVALID_ARG,
+          std::string("invalid pipeline stage input '") + tensor +
+              "', expected name:datatype with a supported datatype");
+      stage.inputs.push_back(std::move(config));
+    }
+    pipeline_.push_back(std::move(stage));
+  }
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::ParseShardConfig()
+{
+  int64_t shard_count;
+  RETURN_IF_ERROR(IntParameter("shard_count", 0, &shard_count));
+  if (shard_count <= 1) {
+    return nullptr;  // success
+  }
 
-  nb_shape_ = input_shape;
+  // The outputs of the shards are combined into the final response of
+  // each batch, and the shards do not exchange implicit states.
+  RETURN_ERROR_IF_TRUE(
+      sequence_batching_ || decoupled_ || !pipeline_.empty(),
+      TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("shard_count is not supported with the sequence batcher, "
+                  "decoupled models or pipelines"));
+  shards_.reset(new ShardGroup(shard_count));
 
   return nullptr;  // success
 }
 
-
-extern "C" {
-
-// Triton calls TRITONBACKEND_ModelInitialize when a model is loaded
-// to allow the backend to create any state associated with the model,
-// and to also examine the model configuration to determine if the
-// configuration is suitable for the backend. Any errors reported by
-// this function will prevent the model from loading.
-//
 TRITONSERVER_Error*
-TRITONBACKEND_ModelInitialize(TRITONBACKEND_Model* model)
+ModelState::ParseShadowConfig()
+{
+  StringParameter("shadow_model_lib_path", "", &shadowing_.model_lib_path);
+  if (shadowing_.model_lib_path.empty()) {
+    return nullptr;  // success
+  }
+
+  // The shadow model runs the batches after the model, on copies of
+  // their inputs, so it can neither follow the implicit states of the
+  // sequences nor replace the stages or the shards of the model.
+  RETURN_ERROR_IF_TRUE(
+      sequence_batching_ || !pipeline_.empty() || (shards_ != nullptr),
+      TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("shadow_model_lib_path is not supported with the sequence "
+                  "batcher, pipelines or sharded models"));
+
+  RETURN_IF_ERROR(
+      DoubleParameter("shadow_sample_rate", 1, &shadowing_.sample_rate));
+  RETURN_ERROR_IF_FALSE(
+      (shadowing_.sample_rate >= 0) && (shadowing_.sample_rate <= 1),
+      TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("shadow_sample_rate must be between 0 and 1"));
+  int64_t max_pending;
+  RETURN_IF_ERROR(
+      IntParameter("shadow_max_pending_batches", 1, &max_pending));
+  RETURN_ERROR_IF_FALSE(
+      max_pending > 0, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("shadow_max_pending_batches must be positive"));
+  shadowing_.max_pending_batches = max_pending;
+  RETURN_IF_ERROR(
+      BoolParameter("shadow_diff_outputs", false, &shadowing_.diff_outputs));
+  int64_t interval_s;
+  RETURN_IF_ERROR(IntParameter("shadow_report_interval_s", 60, &interval_s));
+  RETURN_ERROR_IF_FALSE(
+      interval_s > 0, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("shadow_report_interval_s must be positive"));
+  shadowing_.report_interval_ns = interval_s * 1000000000ull;
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::ParseCaptureConfig()
+{
+  RETURN_IF_ERROR(
+      DoubleParameter("capture_sample_rate", 0, &capturing_.sample_rate));
+  RETURN_ERROR_IF_FALSE(
+      (capturing_.sample_rate >= 0) && (capturing_.sample_rate <= 1),
+      TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("capture_sample_rate must be between 0 and 1"));
+  if (capturing_.sample_rate == 0) {
+    return nullptr;  // success
+  }
+
+  // The replay passes the captured payloads to the model as they are,
+  // so the batches must not depend on the sequence or on the decoded
+  // payloads.
+  RETURN_ERROR_IF_TRUE(
+      sequence_batching_ || !payload_decoding_.kind.empty(),
+      TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("capture_sample_rate is not supported with the sequence "
+                  "batcher or a payload decoder"));
+
+  StringParameter("capture_output_path", "", &capturing_.output_path);
+  RETURN_ERROR_IF_TRUE(
+      capturing_.output_path.empty(), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("capture_output_path is required by capture_sample_rate"));
+
+  // The capture only holds the elements of one BYTES input, from which
+  // the replay could not rebuild the other inputs of the model.
+  RETURN_ERROR_IF_FALSE(
+      (inputs_.size() == 1) &&
+          (inputs_.front().adsbrain_datatype == DataType::BYTES),
+      TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("capture_sample_rate requires a model whose only input is "
+                  "a BYTES input"));
+
+  int64_t max_bytes;
+  RETURN_IF_ERROR(IntParameter("capture_max_bytes", 1ll << 30, &max_bytes));
+  RETURN_ERROR_IF_FALSE(
+      max_bytes > 0, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("capture_max_bytes must be positive"));
+  capturing_.max_bytes = max_bytes;
+
+  return nullptr;  // success
+}
+
+std::string
+ModelState::CaptureHeader() const
+{
+  std::string header(kCaptureMagic, sizeof(kCaptureMagic));
+  const std::string& input_name = inputs_.front().name;
+  AppendCaptureString(&header, input_name.data(), input_name.size());
+  AppendCaptureValue<uint8_t>(&header, decoupled_ ? kCaptureDecoupled : 0);
+
+  AppendCaptureValue<uint32_t>(&header, outputs_.size());
+  for (const auto& output : outputs_) {
+    AppendCaptureValue<uint8_t>(
+        &header, static_cast<uint8_t>(output.adsbrain_datatype));
+    AppendCaptureString(&header, output.name.data(), output.name.size());
+  }
+
+  AppendCaptureValue<uint32_t>(
+      &header, adsbrain_model_configurations_.size());
+  for (const auto& parameter : adsbrain_model_configurations_) {
+    AppendCaptureString(
+        &header, parameter.first.data(), parameter.first.size());
+    AppendCaptureString(
+        &header, parameter.second.data(), parameter.second.size());
+  }
+  return header;
+}
+
+TRITONSERVER_Error*
+ModelState::ParsePriorityConfig()
+{
+  StringParameter("priority_input", "", &priority_input_);
+  priority_high_level_ = 1;
+  priority_low_share_ = 0;
+  if (priority_input_.empty()) {
+    return nullptr;  // success
+  }
+
+  // The priority is read by the backend, it is not passed to the
+  // model.
+  auto it = inputs_.begin();
+  while ((it != inputs_.end()) && (it->name != priority_input_)) {
+    ++it;
+  }
+  RETURN_ERROR_IF_TRUE(
+      it == inputs_.end(), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("priority_input '") + priority_input_ +
+          "' is not an input of the model");
+  RETURN_ERROR_IF_FALSE(
+      it->datatype == TRITONSERVER_TYPE_INT64, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("priority_input '") + priority_input_ +
+          "' must be of type TYPE_INT64");
+  inputs_.erase(it);
+  RETURN_ERROR_IF_TRUE(
+      inputs_.empty(), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("model configuration must have at least 1 input besides "
+                  "the priority input"));
+
+  RETURN_IF_ERROR(
+      IntParameter("priority_high_level", 1, &priority_high_level_));
+  RETURN_IF_ERROR(
+      DoubleParameter("priority_low_share", 0, &priority_low_share_));
+  RETURN_ERROR_IF_FALSE(
+      (priority_low_share_ >= 0) && (priority_low_share_ <= 1),
+      TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("priority_low_share must be between 0 and 1"));
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::ParsePayloadDecoderConfig()
+{
+  StringParameter("payload_decoder", "", &payload_decoding_.kind);
+  if (payload_decoding_.kind.empty()) {
+    return nullptr;  // success
+  }
+
+  RETURN_ERROR_IF_FALSE(
+      (payload_decoding_.kind == "delimited") ||
+          (payload_decoding_.kind == "json"),
+      TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("unknown payload_decoder '") + payload_decoding_.kind +
+          "', expected 'delimited' or 'json'");
+
+  // Decode the first BYTES input unless another one is named.
+  std::string input_name;
+  StringParameter("payload_decoder_input", "", &input_name);
+  bool found = false;
+  for (size_t i = 0; (i < inputs_.size()) && !found; ++i) {
+    if ((inputs_[i].adsbrain_datatype == DataType::BYTES) &&
+        (input_name.empty() || (inputs_[i].name == input_name))) {
+      payload_decoding_.input_idx = i;
+      found = true;
+    }
+  }
+  RETURN_ERROR_IF_FALSE(
+      found, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("payload_decoder requires a BYTES input") +
+          (input_name.empty() ? "" : (" named '" + input_name + "'")));
+
+  std::string fields;
+  StringParameter("payload_fields", "", &fields);
+  payload_decoding_.fields = SplitParameter(fields, ',');
+  RETURN_ERROR_IF_TRUE(
+      payload_decoding_.fields.empty(), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("payload_fields must list the fields to decode"));
+
+  std::string delimiter;
+  StringParameter("payload_field_delimiter", "\t", &delimiter);
+  if (delimiter == "\\t") {
+    delimiter = "\t";
+  }
+  RETURN_ERROR_IF_FALSE(
+      delimiter.size() == 1, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("payload_field_delimiter must be a single character"));
+  payload_decoding_.delimiter = delimiter[0];
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::BoolParameter(
+    const std::string& key, const bool default_value, bool* value) const
+{
+  auto it = adsbrain_model_configurations_.find(key);
+  if (it == adsbrain_model_configurations_.end()) {
+    *value = default_value;
+    return nullptr;  // success
+  }
+
+  if ((it->second == "true") || (it->second == "1")) {
+    *value = true;
+  } else if ((it->second == "false") || (it->second == "0")) {
+    *value = false;
+  } else {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        (std::string("expected a boolean for parameter '") + key + "', got '" +
+         it->second + "'")
+            .c_str());
+  }
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::Create(TRITONBACKEND_Model* triton_model, ModelState** state)
+{
+  try {
+    *state = new ModelState(triton_model);
+  }
+  catch (const BackendModelException& ex) {
+    RETURN_ERROR_IF_TRUE(
+        ex.err_ == nullptr, TRITONSERVER_ERROR_INTERNAL,
+        std::string("unexpected nullptr in BackendModelException"));
+    RETURN_IF_ERROR(ex.err_);
+  }
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::ParseTensorConfig(
+    common::TritonJson::Value& io, const std::string& kind,
+    TensorConfig* config)
+{
+  RETURN_IF_ERROR(io.MemberAsString("name", &config->name));
+
+  std::string dtype;
+  RETURN_IF_ERROR(io.MemberAsString("data_type", &dtype));
+  config->datatype = ModelConfigDataTypeToTritonServerDataType(dtype);
+  RETURN_ERROR_IF_FALSE(
+      ToAdsbrainDataType(config->datatype, &config->adsbrain_datatype),
+      TRITONSERVER_ERROR_UNSUPPORTED,
+      std::string("unsupported datatype ") + dtype + " for " + kind + " '" +
+          config->name + "'");
+
+  // Reshape is not supported on either input or output so flag an
+  // error is the model configuration uses it.
+  triton::common::TritonJson::Value reshape;
+  RETURN_ERROR_IF_TRUE(
+      io.Find("reshape", &reshape), TRITONSERVER_ERROR_UNSUPPORTED,
+      std::string("reshape not supported for ") + kind + " '" + config->name +
+          "'");
+
+  RETURN_IF_ERROR(backend::ParseShape(io, "dims", &config->dims));
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::ValidateModelConfig()
+{
+  // If verbose logging is enabled, dump the model's configuration as
+  // JSON into the console output.
+  if (TRITONSERVER_LogIsEnabled(TRITONSERVER_LOG_VERBOSE)) {
+    common::TritonJson::WriteBuffer buffer;
+    RETURN_IF_ERROR(ModelConfig().PrettyWrite(&buffer));
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_VERBOSE,
+        (std::string("model configuration:\n") + buffer.Contents()).c_str());
+  }
+
+  // ModelConfig is the model configuration as a TritonJson
+  // object. Use the TritonJson utilities to parse the JSON and
+  // determine if the configuration is supported by this backend.
+  common::TritonJson::Value inputs, outputs;
+  RETURN_IF_ERROR(ModelConfig().MemberAsArray("input", &inputs));
+  RETURN_IF_ERROR(ModelConfig().MemberAsArray("output", &outputs));
+
+  // The model must have at least 1 input and 1 output. Each of them
+  // can be a BYTES or a numeric tensor.
+  RETURN_ERROR_IF_FALSE(
+      inputs.ArraySize() >= 1, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("model configuration must have at least 1 input"));
+  RETURN_ERROR_IF_FALSE(
+      outputs.ArraySize() >= 1, TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("model configuration must have at least 1 output"));
+
+  inputs_.clear();
+  for (size_t i = 0; i < inputs.ArraySize(); ++i) {
+    common::TritonJson::Value input;
+    RETURN_IF_ERROR(inputs.IndexAsObject(i, &input));
+    TensorConfig config;
+    RETURN_IF_ERROR(ParseTensorConfig(input, "input", &config));
+    inputs_.push_back(std::move(config));
+  }
+
+  outputs_.clear();
+  for (size_t i = 0; i < outputs.ArraySize(); ++i) {
+    common::TritonJson::Value output;
+    RETURN_IF_ERROR(outputs.IndexAsObject(i, &output));
+    TensorConfig config;
+    RETURN_IF_ERROR(ParseTensorConfig(output, "output", &config));
+    outputs_.push_back(std::move(config));
+  }
+
+  decoupled_ = false;
+  common::TritonJson::Value transaction_policy;
+  if (ModelConfig().Find("model_transaction_policy", &transaction_policy) &&
+      transaction_policy.Find("decoupled")) {
+    RETURN_IF_ERROR(transaction_policy.MemberAsBool("decoupled", &decoupled_));
+  }
+
+  RETURN_IF_ERROR(ParseSequenceBatchingConfig());
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::ParseSequenceBatchingConfig()
+{
+  sequence_batching_ = false;
+  states_.clear();
+  sequence_start_ = SequenceControlConfig();
+  sequence_end_ = SequenceControlConfig();
+
+  common::TritonJson::Value sequence_batching;
+  if (!ModelConfig().Find("sequence_batching", &sequence_batching)) {
+    return nullptr;  // success
+  }
+  sequence_batching_ = true;
+
+  // The state tensors are not listed among the inputs and outputs of
+  // the model, the sequence batcher adds the state input to every
+  // request and the backend stores the state output.
+  common::TritonJson::Value states;
+  if (sequence_batching.Find("state", &states)) {
+    for (size_t i = 0; i < states.ArraySize(); ++i) {
+      common::TritonJson::Value state;
+      RETURN_IF_ERROR(states.IndexAsObject(i, &state));
+      StateConfig config;
+      std::string dtype;
+      RETURN_IF_ERROR(state.MemberAsString("input_name", &config.input.name));
+      RETURN_IF_ERROR(
+          state.MemberAsString("output_name", &config.output.name));
+      RETURN_IF_ERROR(state.MemberAsString("data_type", &dtype));
+      config.input.datatype = ModelConfigDataTypeToTritonServerDataType(dtype);
+      RETURN_ERROR_IF_FALSE(
+          ToAdsbrainDataType(
+              config.input.datatype, &config.input.adsbrain_datatype),
+          TRITONSERVER_ERROR_UNSUPPORTED,
+          std::string("unsupported datatype ") + dtype + " for state '" +
+              config.input.name + "'");
+      RETURN_IF_ERROR(backend::ParseShape(state, "dims", &config.input.dims));
+      config.output.datatype = config.input.datatype;
+      config.output.adsbrain_datatype = config.input.adsbrain_datatype;
+      config.output.dims = config.input.dims;
+      states_.push_back(std::move(config));
+    }
+  }
+
+  common::TritonJson::Value control_inputs;
+  if (sequence_batching.Find("control_input", &control_inputs)) {
+    for (size_t i = 0; i < control_inputs.ArraySize(); ++i) {
+      common::TritonJson::Value control_input;
+      RETURN_IF_ERROR(control_inputs.IndexAsObject(i, &control_input));
+      std::string name;
+      RETURN_IF_ERROR(control_input.MemberAsString("name", &name));
+      RETURN_IF_ERROR(ParseSequenceControl(control_input, name));
+    }
+  }
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelState::ParseSequenceControl(
+    common::TritonJson::Value& control_input, const std::string& name)
+{
+  common::TritonJson::Value controls;
+  RETURN_IF_ERROR(control_input.MemberAsArray("control", &controls));
+  for (size_t i = 0; i < controls.ArraySize(); ++i) {
+    common::TritonJson::Value control;
+    RETURN_IF_ERROR(controls.IndexAsObject(i, &control));
+    std::string kind;
+    RETURN_IF_ERROR(control.MemberAsString("kind", &kind));
+
+    SequenceControlConfig* config = nullptr;
+    if (kind == "CONTROL_SEQUENCE_START") {
+      config = &sequence_start_;
+    } else if (kind == "CONTROL_SEQUENCE_END") {
+      config = &sequence_end_;
+    } else {
+      // The ready flag and the correlation ID are not needed by the
+      // model, the correlation ID is read from the request itself.
+      continue;
+    }
+
+    // Keep the bytes of the true value in the datatype of the control
+    // so it can be compared with the first element of the input.
+    common::TritonJson::Value false_true;
+    if (control.Find("int32_false_true", &false_true) &&
+        (false_true.ArraySize() == 2)) {
+      int64_t value;
+      RETURN_IF_ERROR(false_true.IndexAsInt(1, &value));
+      const int32_t true_value = value;
+      config->true_value.assign(
+          reinterpret_cast<const char*>(&true_value), sizeof(true_value));
+    } else if (
+        control.Find("fp32_false_true", &false_true) &&
+        (false_true.ArraySize() == 2)) {
+      double value;
+      RETURN_IF_ERROR(false_true.IndexAsDouble(1, &value));
+      const float true_value = value;
+      config->true_value.assign(
+          reinterpret_cast<const char*>(&true_value), sizeof(true_value));
+    } else if (
+        control.Find("bool_false_true", &false_true) &&
+        (false_true.ArraySize() == 2)) {
+      bool value;
+      RETURN_IF_ERROR(false_true.IndexAsBool(1, &value));
+      config->true_value.assign(1, value ? 1 : 0);
+    } else {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          (std::string("control input '") + name + "' of kind " + kind +
+           " must set its false and true values")
+              .c_str());
+    }
+    config->name = name;
+  }
+
+  return nullptr;  // success
+}
+
+
+extern "C" {
+
+// Triton calls TRITONBACKEND_ModelInitialize when a model is loaded
+// to allow the backend to create any state associated with the model,
+// and to also examine the model configuration to determine if the
+// configuration is suitable for the backend. Any errors reported by
+// this function will prevent the model from loading.
+//
+TRITONSERVER_Error*
+TRITONBACKEND_ModelInitialize(TRITONBACKEND_Model* model)
+{
+  // Create a ModelState object and associate it with the
+  // TRITONBACKEND_Model. If anything goes wrong with initialization
+  // of the model state then an error is returned and Triton will fail
+  // to load the model.
+  ModelState* model_state;
+  RETURN_IF_ERROR(ModelState::Create(model, &model_state));
+  RETURN_IF_ERROR(
+      TRITONBACKEND_ModelSetState(model, reinterpret_cast<void*>(model_state)));
+
+  return nullptr;  // success
+}
+
+// Triton calls TRITONBACKEND_ModelFinalize when a model is no longer
+// needed. The backend should cleanup any state associated with the
+// model. This function will not be called until all model instances
+// of the model have been finalized.
+//
+TRITONSERVER_Error*
+TRITONBACKEND_ModelFinalize(TRITONBACKEND_Model* model)
+{
+  void* vstate;
+  RETURN_IF_ERROR(TRITONBACKEND_ModelState(model, &vstate));
+  ModelState* model_state = reinterpret_cast<ModelState*>(vstate);
+  delete model_state;
+
+  return nullptr;  // success
+}
+
+}  // extern "C"
+
+/////////////
+
+//
+// PayloadDecoder
+//
+// Decodes the payloads of a BYTES input into the columns of a
+// DecodedPayloads batch, so the models receive field arrays instead of
+// re-parsing every payload themselves. A decoder is owned by a model
+// instance and reused across executions.
+//
+class PayloadDecoder {
+ public:
+  static std::unique_ptr<PayloadDecoder> Create(
+      const PayloadDecoderConfig& config);
+  virtual ~PayloadDecoder() = default;
+
+  // Prepare 'payloads' to hold the columns of 'payload_count' payloads.
+  virtual void Reset(
+      const std::string& input_name, const size_t payload_count,
+      DecodedPayloads* payloads);
+
+  // Decode 'payload' into row 'idx' of the columns.
+  virtual TRITONSERVER_Error* Decode(
+      const BytesElement& payload, const size_t idx,
+      DecodedPayloads* payloads) = 0;
+
+ protected:
+  PayloadDecoder(const PayloadDecoderConfig& config) : config_(config) {}
+
+  const PayloadDecoderConfig config_;
+};
+
+void
+PayloadDecoder::Reset(
+    const std::string& input_name, const size_t payload_count,
+    DecodedPayloads* payloads)
+{
+  payloads->input_name = input_name;
+  payloads->payload_count = payload_count;
+  payloads->columns.resize(config_.fields.size());
+  for (size_t f = 0; f < config_.fields.size(); ++f) {
+    payloads->columns[f].name = config_.fields[f];
+    payloads->columns[f].values.assign(
+        payload_count, BytesElement{nullptr, 0});
+  }
+}
+
+//
+// DelimitedPayloadDecoder
+//
+// Decodes payloads made of the configured fields separated by a
+// delimiter character, e.g. TSV. The fields are located with memchr,
+// which is vectorized by the C library, and the column values point
+// into the payloads without copying them.
+//
+class DelimitedPayloadDecoder : public PayloadDecoder {
+ public:
+  DelimitedPayloadDecoder(const PayloadDecoderConfig& config)
+      : PayloadDecoder(config)
+  {
+  }
+
+  TRITONSERVER_Error* Decode(
+      const BytesElement& payload, const size_t idx,
+      DecodedPayloads* payloads) override;
+};
+
+TRITONSERVER_Error*
+DelimitedPayloadDecoder::Decode(
+    const BytesElement& payload, const size_t idx, DecodedPayloads* payloads)
+{
+  const char* cur = payload.data;
+  const char* end = payload.data + payload.size;
+  for (size_t f = 0; f < payloads->columns.size(); ++f) {
+    const char* next = static_cast<const char*>(
+        memchr(cur, config_.delimiter, end - cur));
+    if (next == nullptr) {
+      next = end;
+    }
+    payloads->columns[f].values[idx] =
+        BytesElement{cur, static_cast<size_t>(next - cur)};
+    if (next == end) {
+      break;
+    }
+    cur = next + 1;
+  }
+
+  return nullptr;  // success
+}
+
+//
+// JsonPayloadDecoder
+//
+// Decodes payloads that are flat JSON objects in a single pass over
+// their bytes, without building a document. The column values point
+// into the payloads: the contents of string values, and the JSON text
+// of the other values, nested objects and arrays included. Only string
+// values with escape sequences are unescaped, into a per-execution
+// arena. Values are checked for their structure only, e.g. numbers are
+// not validated.
+//
+class JsonPayloadDecoder : public PayloadDecoder {
+ public:
+  JsonPayloadDecoder(const PayloadDecoderConfig& config)
+      : PayloadDecoder(config)
+  {
+  }
+
+  void Reset(
+      const std::string& input_name, const size_t payload_count,
+      DecodedPayloads* payloads) override;
+
+  TRITONSERVER_Error* Decode(
+      const BytesElement& payload, const size_t idx,
+      DecodedPayloads* payloads) override;
+
+ private:
+  // Decode the object in [cur, end) into row 'idx' of the columns.
+  // Return false if it is not a well formed object.
+  bool DecodeObject(
+      const char* cur, const char* end, const size_t idx,
+      DecodedPayloads* payloads);
+
+  // Return the position after the JSON whitespace at 'cur'.
+  static const char* SkipSpace(const char* cur, const char* end);
+
+  // Find the end of the string whose opening quote is at 'cur' and
+  // return the position after its closing quote in 'next'. 'escaped'
+  // tells whether the string holds escape sequences.
+  static bool ScanString(
+      const char* cur, const char* end, const char** next, bool* escaped);
+
+  // Find the end of the value starting at 'cur' and return the position
+  // after it in 'next'.
+  static bool ScanValue(const char* cur, const char* end, const char** next);
+
+  // Unescape the contents of a string, without its quotes, into 'str'.
+  static bool Unescape(const char* cur, const char* end, std::string* str);
+
+  // The unescaped string values of the execution, which must outlive
+  // the inference call.
+  std::deque<std::string> arena_;
+};
+
+void
+JsonPayloadDecoder::Reset(
+    const std::string& input_name, const size_t payload_count,
+    DecodedPayloads* payloads)
+{
+  PayloadDecoder::Reset(input_name, payload_count, payloads);
+  arena_.clear();
+}
+
+TRITONSERVER_Error*
+JsonPayloadDecoder::Decode(
+    const BytesElement& payload, const size_t idx, DecodedPayloads* payloads)
+{
+  // Only objects can be decoded into fields.
+  const char* end = payload.data + payload.size;
+  const char* begin = SkipSpace(payload.data, end);
+  RETURN_ERROR_IF_FALSE(
+      (begin < end) && (*begin == '{'), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("expected a JSON object payload for input '") +
+          payloads->input_name + "'");
+  RETURN_ERROR_IF_FALSE(
+      DecodeObject(begin, end, idx, payloads), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("malformed JSON object payload for input '") +
+          payloads->input_name + "'");
+
+  return nullptr;  // success
+}
+
+bool
+JsonPayloadDecoder::DecodeObject(
+    const char* cur, const char* end, const size_t idx,
+    DecodedPayloads* payloads)
+{
+  cur = SkipSpace(cur + 1, end);
+  if ((cur < end) && (*cur == '}')) {
+    return SkipSpace(cur + 1, end) == end;
+  }
+
+  std::string key_str;
+  while (true) {
+    const char* key_end;
+    bool key_escaped;
+    if ((cur == end) || (*cur != '"') ||
+        !ScanString(cur, end, &key_end, &key_escaped)) {
+      return false;
+    }
+    const char* key = cur + 1;
+    size_t key_size = key_end - key - 1;
+    if (key_escaped) {
+      key_str.clear();
+      if (!Unescape(key, key_end - 1, &key_str)) {
+        return false;
+      }
+      key = key_str.data();
+      key_size = key_str.size();
+    }
+
+    cur = SkipSpace(key_end, end);
+    if ((cur == end) || (*cur != ':')) {
+      return false;
+    }
+    cur = SkipSpace(cur + 1, end);
+    const char* value_end;
+    bool escaped = false;
+    const bool is_string = (cur < end) && (*cur == '"');
+    if (is_string ? !ScanString(cur, end, &value_end, &escaped)
+                  : !ScanValue(cur, end, &value_end)) {
+      return false;
+    }
+
+    // The first occurrence of a duplicated key is kept.
+    for (auto& column : payloads->columns) {
+      BytesElement& value = column.values[idx];
+      if ((column.name.size() != key_size) ||
+          (memcmp(column.name.data(), key, key_size) != 0) ||
+          (value.data != nullptr)) {
+        continue;
+      }
+      if (!is_string) {
+        value = BytesElement{cur, static_cast<size_t>(value_end - cur)};
+      } else if (!escaped) {
+        value = BytesElement{cur + 1, static_cast<size_t>(value_end - cur - 2)};
+      } else {
+        arena_.emplace_back();
+        if (!Unescape(cur + 1, value_end - 1, &arena_.back())) {
+          return false;
+        }
+        value = BytesElement{arena_.back().data(), arena_.back().size()};
+      }
+      break;
+    }
+
+    cur = SkipSpace(value_end, end);
+    if ((cur < end) && (*cur == ',')) {
+      cur = SkipSpace(cur + 1, end);
+    } else if ((cur < end) && (*cur == '}')) {
+      return SkipSpace(cur + 1, end) == end;
+    } else {
+      return false;
+    }
+  }
+}
+
+const char*
+JsonPayloadDecoder::SkipSpace(const char* cur, const char* end)
+{
+  while ((cur < end) &&
+         ((*cur == ' ') || (*cur == '\n') || (*cur == '\r') ||
+          (*cur == '\t'))) {
+    ++cur;
+  }
+  return cur;
+}
+
+bool
+JsonPayloadDecoder::ScanString(
+    const char* cur, const char* end, const char** next, bool* escaped)
+{
+  // A quote ends the string unless it is preceded by an odd number of
+  // backslashes. The quotes are located with memchr, which is
+  // vectorized by the C library.
+  const char* begin = cur + 1;
+  const char* pos = begin;
+  while (true) {
+    const char* quote = static_cast<const char*>(memchr(pos, '"', end - pos));
+    if (quote == nullptr) {
+      return false;
+    }
+    const char* backslash = quote;
+    while ((backslash > begin) && (*(backslash - 1) == '\\')) {
+      --backslash;
+    }
+    if (((quote - backslash) % 2) == 0) {
+      *next = quote + 1;
+      *escaped = (memchr(begin, '\\', quote - begin) != nullptr);
+      return true;
+    }
+    pos = quote + 1;
+  }
+}
+
+bool
+JsonPayloadDecoder::ScanValue(
+    const char* cur, const char* end, const char** next)
+{
+  if ((cur < end) && ((*cur == '{') || (*cur == '['))) {
+    // Nested objects and arrays are skipped as a whole, the brackets in
+    // their strings aside.
+    size_t depth = 0;
+    while (cur < end) {
+      if (*cur == '"') {
+        bool escaped;
+        if (!ScanString(cur, end, &cur, &escaped)) {
+          return false;
+        }
+        continue;
+      }
+      if ((*cur == '{') || (*cur == '[')) {
+        ++depth;
+      } else if (((*cur == '}') || (*cur == ']')) && (--depth == 0)) {
+        *next = cur + 1;
+        return true;
+      }
+      ++cur;
+    }
+    return false;
+  }
+
+  // Numbers, booleans and null run up to the next separator.
+  const char* pos = cur;
+  while ((pos < end) && (*pos != ',') && (*pos != '}') && (*pos != ']') &&
+         (SkipSpace(pos, end) == pos)) {
+    ++pos;
+  }
+  *next = pos;
+  return pos != cur;
+}
+
+bool
+JsonPayloadDecoder::Unescape(const char* cur, const char* end, std::string* str)
+{
+  str->reserve(end - cur);
+  while (cur < end) {
+    if (*cur != '\\') {
+      str->push_back(*cur++);
+      continue;
+    }
+    if (++cur == end) {
+      return false;
+    }
+    const char escape = *cur++;
+    switch (escape) {
+      case '"':
+      case '\\':
+      case '/':
+        str->push_back(escape);
+        continue;
+      case 'b':
+        str->push_back('\b');
+        continue;
+      case 'f':
+        str->push_back('\f');
+        continue;
+      case 'n':
+        str->push_back('\n');
+        continue;
+      case 'r':
+        str->push_back('\r');
+        continue;
+      case 't':
+        str->push_back('\t');
+        continue;
+      case 'u':
+        break;
+      default:
+        return false;
+    }
+
+    // A \u escape is a UTF-16 code unit, characters outside of the
+    // basic plane being written as a surrogate pair.
+    uint32_t code = 0;
+    for (int unit = 0; unit < 2; ++unit) {
+      if (end - cur < 4) {
+        return false;
+      }
+      uint32_t value = 0;
+      for (int i = 0; i < 4; ++i) {
+        const char c = *cur++;
+        value <<= 4;
+        if ((c >= '0') && (c <= '9')) {
+          value |= c - '0';
+        } else if ((c >= 'a') && (c <= 'f')) {
+          value |= c - 'a' + 10;
+        } else if ((c >= 'A') && (c <= 'F')) {
+          value |= c - 'A' + 10;
+        } else {
+          return false;
+        }
+      }
+      if (unit == 1) {
+        if ((value < 0xDC00) || (value > 0xDFFF)) {
+          return false;
+        }
+        code = 0x10000 + ((code - 0xD800) << 10) + (value - 0xDC00);
+        break;
+      }
+      code = value;
+      if ((code >= 0xDC00) && (code <= 0xDFFF)) {
+        return false;
+      }
+      if ((code < 0xD800) || (code > 0xDBFF)) {
+        break;
+      }
+      if ((end - cur < 2) || (cur[0] != '\\') || (cur[1] != 'u')) {
+        return false;
+      }
+      cur += 2;
+    }
+
+    if (code < 0x80) {
+      str->push_back(static_cast<char>(code));
+    } else if (code < 0x800) {
+      str->push_back(static_cast<char>(0xC0 | (code >> 6)));
+      str->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else if (code < 0x10000) {
+      str->push_back(static_cast<char>(0xE0 | (code >> 12)));
+      str->push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      str->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else {
+      str->push_back(static_cast<char>(0xF0 | (code >> 18)));
+      str->push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+      str->push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      str->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+  }
+  return true;
+}
+
+std::unique_ptr<PayloadDecoder>
+PayloadDecoder::Create(const PayloadDecoderConfig& config)
+{
+  std::unique_ptr<PayloadDecoder> decoder;
+  if (config.kind == "delimited") {
+    decoder.reset(new DelimitedPayloadDecoder(config));
+  } else if (config.kind == "json") {
+    decoder.reset(new JsonPayloadDecoder(config));
+  }
+  return decoder;
+}
+
+//
+// PayloadCompressor
+//
+// Compresses and decompresses the payloads and response strings of a
+// model instance, laid out as described in adsbrain_payload_header.h.
+//
+class PayloadCompressor {
+ public:
+  PayloadCompressor(const int zstd_level);
+  ~PayloadCompressor();
+
+  // Parse the header of 'record' and return its codec, the size of
+  // its data once uncompressed and the view of the (compressed) data.
+  // Fails if the codec is not built in, or if the uncompressed size is
+  // above 'max_uncompressed_size' or cannot be produced by the
+  // compressed data.
+  static TRITONSERVER_Error* ParseHeader(
+      const BytesElement& record, const size_t max_uncompressed_size,
+      PayloadCodec* codec, size_t* uncompressed_size, BytesElement* data);
+
+  // Decompress 'data' into the 'byte_size' bytes of 'dst'.
+  TRITONSERVER_Error* Decompress(
+      const PayloadCodec codec, const BytesElement& data, char* dst,
+      const size_t byte_size);
+
+  // Upper bound of the size of the record compressing 'byte_size'
+  // bytes with 'codec'.
+  static size_t RecordBound(const PayloadCodec codec, const size_t byte_size);
+
+  // Write the record of 'src' into 'dst', which holds at least
+  // RecordBound() bytes, and return its size in 'record_size'. The data
+  // is stored as is if compression does not make it smaller.
+  TRITONSERVER_Error* Compress(
+      const PayloadCodec codec, const BytesElement& src, char* dst,
+      size_t* record_size);
+
+ private:
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+  // Contexts are reused across calls to avoid their allocation.
+  ZSTD_CCtx* zstd_cctx_;
+  ZSTD_DCtx* zstd_dctx_;
+  const int zstd_level_;
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+};
+
+PayloadCompressor::PayloadCompressor(const int zstd_level)
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+    : zstd_cctx_(ZSTD_createCCtx()), zstd_dctx_(ZSTD_createDCtx()),
+      zstd_level_(zstd_level)
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+{
+}
+
+PayloadCompressor::~PayloadCompressor()
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+  ZSTD_freeCCtx(zstd_cctx_);
+  ZSTD_freeDCtx(zstd_dctx_);
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+}
+
+TRITONSERVER_Error*
+PayloadCompressor::ParseHeader(
+    const BytesElement& record, const size_t max_uncompressed_size,
+    PayloadCodec* codec, size_t* uncompressed_size, BytesElement* data)
+{
+  PayloadHeader header;
+  const PayloadHeaderStatus status = ParsePayloadHeader(
+      record.data, record.size, max_uncompressed_size, &header);
+  switch (status) {
+    case PayloadHeaderStatus::OK:
+      *codec = header.codec;
+      *uncompressed_size = header.uncompressed_size;
+      *data = BytesElement{header.data, header.data_size};
+      return nullptr;  // success
+    case PayloadHeaderStatus::TRUNCATED:
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          "compressed payload is missing its header");
+    case PayloadHeaderStatus::UNSUPPORTED_CODEC:
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_UNSUPPORTED,
+          (std::string("unsupported payload codec ") +
+           std::to_string(static_cast<int>(header.codec)))
+              .c_str());
+    case PayloadHeaderStatus::TOO_LARGE:
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          (std::string("compressed payload of ") +
+           std::to_string(header.uncompressed_size) +
+           " bytes exceeds payload_max_uncompressed_bytes (" +
+           std::to_string(max_uncompressed_size) + ")")
+              .c_str());
+    case PayloadHeaderStatus::SIZE_MISMATCH:
+      break;
+  }
+  return TRITONSERVER_ErrorNew(
+      TRITONSERVER_ERROR_INVALID_ARG,
+      (std::string("compressed payload of ") +
+       std::to_string(header.data_size) + " bytes cannot hold " +
+       std::to_string(header.uncompressed_size) + " bytes")
+          .c_str());
+}
+
+TRITONSERVER_Error*
+PayloadCompressor::Decompress(
+    const PayloadCodec codec, const BytesElement& data, char* dst,
+    const size_t byte_size)
+{
+  switch (codec) {
+    case PayloadCodec::NONE:
+      RETURN_ERROR_IF_FALSE(
+          data.size == byte_size, TRITONSERVER_ERROR_INVALID_ARG,
+          std::string("unexpected uncompressed payload size"));
+      memcpy(dst, data.data, byte_size);
+      return nullptr;  // success
+#ifdef TRITON_ADSBRAIN_ENABLE_LZ4
+    case PayloadCodec::LZ4: {
+      const int size =
+          LZ4_decompress_safe(data.data, dst, data.size, byte_size);
+      RETURN_ERROR_IF_FALSE(
+          (size >= 0) && (static_cast<size_t>(size) == byte_size),
+          TRITONSERVER_ERROR_INVALID_ARG,
+          std::string("failed to decompress lz4 payload"));
+      return nullptr;  // success
+    }
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+    case PayloadCodec::ZSTD: {
+      const size_t size = ZSTD_decompressDCtx(
+          zstd_dctx_, dst, byte_size, data.data, data.size);
+      RETURN_ERROR_IF_TRUE(
+          ZSTD_isError(size), TRITONSERVER_ERROR_INVALID_ARG,
+          std::string("failed to decompress zstd payload: ") +
+              ZSTD_getErrorName(size));
+      RETURN_ERROR_IF_FALSE(
+          size == byte_size, TRITONSERVER_ERROR_INVALID_ARG,
+          std::string("unexpected uncompressed payload size"));
+      return nullptr;  // success
+    }
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+    default:
+      break;
+  }
+
+  return TRITONSERVER_ErrorNew(
+      TRITONSERVER_ERROR_UNSUPPORTED,
+      (std::string("unsupported payload codec ") +
+       std::to_string(static_cast<int>(codec)))
+          .c_str());
+}
+
+size_t
+PayloadCompressor::RecordBound(const PayloadCodec codec, const size_t byte_size)
+{
+  size_t bound = byte_size;
+#ifdef TRITON_ADSBRAIN_ENABLE_LZ4
+  if (codec == PayloadCodec::LZ4) {
+    bound = std::max<size_t>(bound, LZ4_compressBound(byte_size));
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+  if (codec == PayloadCodec::ZSTD) {
+    bound = std::max<size_t>(bound, ZSTD_compressBound(byte_size));
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+  return kPayloadHeaderSize + bound;
+}
+
+TRITONSERVER_Error*
+PayloadCompressor::Compress(
+    const PayloadCodec codec, const BytesElement& src, char* dst,
+    size_t* record_size)
+{
+  size_t compressed_size = 0;
+#ifdef TRITON_ADSBRAIN_ENABLE_LZ4
+  if (codec == PayloadCodec::LZ4) {
+    const int bound = LZ4_compressBound(src.size);
+    const int size = LZ4_compress_default(
+        src.data, dst + kPayloadHeaderSize, src.size, bound);
+    RETURN_ERROR_IF_TRUE(
+        size <= 0, TRITONSERVER_ERROR_INTERNAL,
+        std::string("failed to compress lz4 response"));
+    compressed_size = size;
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+  if (codec == PayloadCodec::ZSTD) {
+    const size_t size = ZSTD_compressCCtx(
+        zstd_cctx_, dst + kPayloadHeaderSize, ZSTD_compressBound(src.size),
+        src.data, src.size, zstd_level_);
+    RETURN_ERROR_IF_TRUE(
+        ZSTD_isError(size), TRITONSERVER_ERROR_INTERNAL,
+        std::string("failed to compress zstd response: ") +
+            ZSTD_getErrorName(size));
+    compressed_size = size;
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+
+  if ((codec == PayloadCodec::NONE) || (compressed_size == 0) ||
+      (compressed_size + kPayloadHeaderSize >= src.size + 1)) {
+    dst[0] = static_cast<char>(PayloadCodec::NONE);
+    memcpy(dst + 1, src.data, src.size);
+    *record_size = src.size + 1;
+    return nullptr;  // success
+  }
+
+  const uint32_t size = src.size;
+  dst[0] = static_cast<char>(codec);
+  memcpy(dst + 1, &size, sizeof(uint32_t));
+  *record_size = kPayloadHeaderSize + compressed_size;
+
+  return nullptr;  // success
+}
+
+// The labels of a metric, as name and value pairs.
+typedef std::vector<std::pair<std::string, std::string>> MetricLabels;
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+// Create the metric of 'family' with 'labels'.
+TRITONSERVER_Error* NewTritonMetric(
+    TRITONSERVER_MetricFamily* family, const MetricLabels& labels,
+    TRITONSERVER_Metric** metric);
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+
+//
+// InstanceMetrics
+//
+// The metrics of a model instance, reported under its model, version
+// and instance labels. The batches are counted in power of two batch
+// size buckets. Updates are no-ops if the backend is built without
+// TRITON_ADSBRAIN_ENABLE_METRICS or the metrics could not be created.
+//
+class InstanceMetrics {
+ public:
+  InstanceMetrics() = default;
+  ~InstanceMetrics();
+
+  TRITONSERVER_Error* Init(
+      TRITONBACKEND_Model* triton_model, const std::string& model_name,
+      const uint64_t model_version, const std::string& instance_name,
+      const int max_batch_size);
+
+  void Increment(const InstanceMetric metric, const double value);
+  void Set(const InstanceMetric metric, const double value);
+
+  // Count a batch of 'rows' in its batch size bucket.
+  void AddBatch(const size_t rows);
+
+ private:
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  std::vector<TRITONSERVER_Metric*> metrics_;
+  std::vector<TRITONSERVER_Metric*> batch_buckets_;
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+};
+
+InstanceMetrics::~InstanceMetrics()
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  for (auto metric : metrics_) {
+    if (metric != nullptr) {
+      LOG_IF_ERROR(
+          TRITONSERVER_MetricDelete(metric), "failed to delete metric");
+    }
+  }
+  for (auto metric : batch_buckets_) {
+    LOG_IF_ERROR(TRITONSERVER_MetricDelete(metric), "failed to delete metric");
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+}
+
+TRITONSERVER_Error*
+InstanceMetrics::Init(
+    TRITONBACKEND_Model* triton_model, const std::string& model_name,
+    const uint64_t model_version, const std::string& instance_name,
+    const int max_batch_size)
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  BackendState* backend_state;
+  RETURN_IF_ERROR(BackendState::ForModel(triton_model, &backend_state));
+
+  MetricLabels labels{
+      {"model", model_name},
+      {"version", std::to_string(model_version)},
+      {"instance", instance_name}};
+  metrics_.assign(static_cast<size_t>(InstanceMetric::COUNT), nullptr);
+  for (size_t m = 0; m < metrics_.size(); ++m) {
+    const auto metric = static_cast<InstanceMetric>(m);
+    if (metric != InstanceMetric::BATCHES) {
+      RETURN_IF_ERROR(NewTritonMetric(
+          backend_state->MetricFamily(metric), labels, &metrics_[m]));
+    }
+  }
+
+  // One bucket per power of two up to the max batch size, a bucket
+  // counting the batches of more than half its size.
+  labels.emplace_back("batch_size", "");
+  for (size_t size = 1;; size *= 2) {
+    labels.back().second = std::to_string(size);
+    TRITONSERVER_Metric* bucket;
+    RETURN_IF_ERROR(NewTritonMetric(
+        backend_state->MetricFamily(InstanceMetric::BATCHES), labels,
+        &bucket));
+    batch_buckets_.push_back(bucket);
+    if (size >= static_cast<size_t>(std::max(max_batch_size, 1))) {
+      break;
+    }
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+
+  return nullptr;  // success
+}
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+TRITONSERVER_Error*
+NewTritonMetric(
+    TRITONSERVER_MetricFamily* family, const MetricLabels& labels,
+    TRITONSERVER_Metric** metric)
+{
+  std::vector<const TRITONSERVER_Parameter*> parameters;
+  for (const auto& label : labels) {
+    parameters.push_back(TRITONSERVER_ParameterNew(
+        label.first.c_str(), TRITONSERVER_PARAMETER_STRING,
+        label.second.c_str()));
+  }
+  TRITONSERVER_Error* err = TRITONSERVER_MetricNew(
+      metric, family, parameters.data(), parameters.size());
+  for (auto parameter : parameters) {
+    TRITONSERVER_ParameterDelete(
+        const_cast<TRITONSERVER_Parameter*>(parameter));
+  }
+
+  return err;
+}
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+
+void
+InstanceMetrics::Increment(const InstanceMetric metric, const double value)
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  const size_t m = static_cast<size_t>(metric);
+  if ((m < metrics_.size()) && (metrics_[m] != nullptr)) {
+    LOG_IF_ERROR(
+        TRITONSERVER_MetricIncrement(metrics_[m], value),
+        "failed to increment metric");
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+}
+
+void
+InstanceMetrics::Set(const InstanceMetric metric, const double value)
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  const size_t m = static_cast<size_t>(metric);
+  if ((m < metrics_.size()) && (metrics_[m] != nullptr)) {
+    LOG_IF_ERROR(
+        TRITONSERVER_MetricSet(metrics_[m], value), "failed to set metric");
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+}
+
+void
+InstanceMetrics::AddBatch(const size_t rows)
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  if (batch_buckets_.empty() || (rows == 0)) {
+    return;
+  }
+  size_t bucket = 0;
+  while (((static_cast<size_t>(1) << bucket) < rows) &&
+         (bucket + 1 < batch_buckets_.size())) {
+    ++bucket;
+  }
+  LOG_IF_ERROR(
+      TRITONSERVER_MetricIncrement(batch_buckets_[bucket], 1),
+      "failed to increment metric");
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+}
+
+// Add 'value' to 'target', std::atomic<double> has no fetch_add in
+// C++11.
+inline void
+AtomicAdd(std::atomic<double>* target, const double value)
+{
+  double current = target->load(std::memory_order_relaxed);
+  while (!target->compare_exchange_weak(
+      current, current + value, std::memory_order_relaxed)) {
+  }
+}
+
+//
+// ForwardedMetric
+//
+// A metric of the model. Its updates accumulate in atomics and Flush
+// forwards them to the Triton metrics of the instance, if any.
+//
+class ForwardedMetric {
+ public:
+  enum class Kind { COUNTER, GAUGE, HISTOGRAM };
+
+  virtual ~ForwardedMetric();
+  virtual Kind MetricKind() const = 0;
+  virtual void Flush() = 0;
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  // The metrics the updates are forwarded to, owned by the metric and
+  // empty if it is not reported.
+  std::vector<TRITONSERVER_Metric*> triton_metrics_;
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+};
+
+ForwardedMetric::~ForwardedMetric()
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  for (auto metric : triton_metrics_) {
+    LOG_IF_ERROR(TRITONSERVER_MetricDelete(metric), "failed to delete metric");
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+}
+
+class ForwardedCounter : public Counter, public ForwardedMetric {
+ public:
+  void Increment(double value) override { AtomicAdd(&pending_, value); }
+  Kind MetricKind() const override { return Kind::COUNTER; }
+  void Flush() override;
+
+ private:
+  std::atomic<double> pending_{0};
+};
+
+void
+ForwardedCounter::Flush()
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  const double value = pending_.exchange(0);
+  if ((value != 0) && !triton_metrics_.empty()) {
+    LOG_IF_ERROR(
+        TRITONSERVER_MetricIncrement(triton_metrics_[0], value),
+        "failed to increment metric");
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+}
+
+class ForwardedGauge : public Gauge, public ForwardedMetric {
+ public:
+  void Set(double value) override
+  {
+    value_.store(value, std::memory_order_relaxed);
+    changed_.store(true, std::memory_order_release);
+  }
+  void Increment(double value) override
+  {
+    AtomicAdd(&value_, value);
+    changed_.store(true, std::memory_order_release);
+  }
+  Kind MetricKind() const override { return Kind::GAUGE; }
+  void Flush() override;
+
+ private:
+  std::atomic<double> value_{0};
+  std::atomic<bool> changed_{false};
+};
+
+void
+ForwardedGauge::Flush()
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  if (changed_.exchange(false, std::memory_order_acquire) &&
+      !triton_metrics_.empty()) {
+    LOG_IF_ERROR(
+        TRITONSERVER_MetricSet(triton_metrics_[0], value_.load()),
+        "failed to set metric");
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+}
+
+// The Triton metrics of a histogram are the cumulative buckets,
+// including the last unbounded bucket, followed by the sum and the
+// count of the observations.
+class ForwardedHistogram : public Histogram, public ForwardedMetric {
+ public:
+  explicit ForwardedHistogram(const std::vector<double>& bounds)
+      : bounds_(bounds), counts_(new std::atomic<uint64_t>[bounds.size() + 1])
+  {
+    for (size_t b = 0; b <= bounds_.size(); ++b) {
+      counts_[b].store(0);
+    }
+  }
+
+  void Observe(double value) override
+  {
+    const size_t b =
+        std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+        bounds_.begin();
+    counts_[b].fetch_add(1, std::memory_order_relaxed);
+    AtomicAdd(&sum_, value);
+  }
+  Kind MetricKind() const override { return Kind::HISTOGRAM; }
+  void Flush() override;
+
+  const std::vector<double>& Bounds() const { return bounds_; }
+
+ private:
+  const std::vector<double> bounds_;
+  std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+  std::atomic<double> sum_{0};
+};
+
+void
+ForwardedHistogram::Flush()
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  if (triton_metrics_.empty()) {
+    return;
+  }
+  uint64_t count = 0;
+  for (size_t b = 0; b <= bounds_.size(); ++b) {
+    count += counts_[b].exchange(0, std::memory_order_relaxed);
+    if (count > 0) {
+      LOG_IF_ERROR(
+          TRITONSERVER_MetricIncrement(triton_metrics_[b], count),
+          "failed to increment metric");
+    }
+  }
+  if (count > 0) {
+    LOG_IF_ERROR(
+        TRITONSERVER_MetricIncrement(
+            triton_metrics_[bounds_.size() + 1], sum_.exchange(0)),
+        "failed to increment metric");
+    LOG_IF_ERROR(
+        TRITONSERVER_MetricIncrement(
+            triton_metrics_[bounds_.size() + 2], count),
+        "failed to increment metric");
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+}
+
+//
+// ModelMetricsRegistry
+//
+// The metrics registered by the model of an instance, reported under
+// the labels of the instance. The model updates them without waiting
+// on Triton, and the instance calls Flush after each batch.
+//
+class ModelMetricsRegistry : public MetricsRegistry {
+ public:
+  ModelMetricsRegistry() : backend_state_(nullptr) {}
+
+  TRITONSERVER_Error* Init(
+      TRITONBACKEND_Model* triton_model, const std::string& model_name,
+      const uint64_t model_version, const std::string& instance_name);
+
+  Counter* RegisterCounter(
+      const std::string& name, const std::string& description) override;
+  Gauge* RegisterGauge(
+      const std::string& name, const std::string& description) override;
+  Histogram* RegisterHistogram(
+      const std::string& name, const std::string& description,
+      const std::vector<double>& bounds) override;
+
+  // Forward the updates made since the last call.
+  void Flush();
+
+ private:
+  // Register 'metric' as 'name', or return the metric already
+  // registered as 'name' if it has the same kind.
+  ForwardedMetric* Register(
+      const std::string& name, const std::string& description,
+      std::unique_ptr<ForwardedMetric>&& metric);
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  // Create the Triton metrics 'metric' forwards its updates to.
+  TRITONSERVER_Error* CreateTritonMetrics(
+      const std::string& name, const std::string& description,
+      ForwardedMetric* metric);
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+
+  BackendState* backend_state_;
+  MetricLabels labels_;
+
+  std::mutex mu_;
+  std::unordered_map<std::string, std::unique_ptr<ForwardedMetric>> metrics_;
+  // Metrics whose name is registered with another kind, never
+  // reported.
+  std::vector<std::unique_ptr<ForwardedMetric>> unreported_;
+};
+
+TRITONSERVER_Error*
+ModelMetricsRegistry::Init(
+    TRITONBACKEND_Model* triton_model, const std::string& model_name,
+    const uint64_t model_version, const std::string& instance_name)
+{
+  labels_ = MetricLabels{
+      {"model", model_name},
+      {"version", std::to_string(model_version)},
+      {"instance", instance_name}};
+  return BackendState::ForModel(triton_model, &backend_state_);
+}
+
+Counter*
+ModelMetricsRegistry::RegisterCounter(
+    const std::string& name, const std::string& description)
+{
+  return static_cast<ForwardedCounter*>(Register(
+      name, description,
+      std::unique_ptr<ForwardedMetric>(new ForwardedCounter())));
+}
+
+Gauge*
+ModelMetricsRegistry::RegisterGauge(
+    const std::string& name, const std::string& description)
+{
+  return static_cast<ForwardedGauge*>(Register(
+      name, description,
+      std::unique_ptr<ForwardedMetric>(new ForwardedGauge())));
+}
+
+Histogram*
+ModelMetricsRegistry::RegisterHistogram(
+    const std::string& name, const std::string& description,
+    const std::vector<double>& bounds)
+{
+  // Invalid bounds are reported like a kind conflict, the histogram
+  // still works but is not reported.
+  std::unique_ptr<ForwardedMetric> histogram(new ForwardedHistogram(bounds));
+  if (!std::is_sorted(bounds.begin(), bounds.end()) ||
+      (std::adjacent_find(bounds.begin(), bounds.end()) != bounds.end())) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_ERROR,
+        (std::string("bounds of histogram '") + name +
+         "' are not increasing, it is not reported")
+            .c_str());
+    std::lock_guard<std::mutex> lock(mu_);
+    unreported_.push_back(std::move(histogram));
+    return static_cast<ForwardedHistogram*>(unreported_.back().get());
+  }
+
+  return static_cast<ForwardedHistogram*>(
+      Register(name, description, std::move(histogram)));
+}
+
+ForwardedMetric*
+ModelMetricsRegistry::Register(
+    const std::string& name, const std::string& description,
+    std::unique_ptr<ForwardedMetric>&& metric)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = metrics_.find(name);
+  if ((it != metrics_.end()) &&
+      (it->second->MetricKind() == metric->MetricKind())) {
+    return it->second.get();
+  }
+  if (it != metrics_.end()) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_ERROR,
+        (std::string("model metric '") + name +
+         "' is already registered with another kind, it is not reported")
+            .c_str());
+    unreported_.push_back(std::move(metric));
+    return unreported_.back().get();
+  }
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+  if (backend_state_ != nullptr) {
+    TRITONSERVER_Error* err =
+        CreateTritonMetrics(name, description, metric.get());
+    if (err != nullptr) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_ERROR,
+          (std::string("failed to create model metric '") + name +
+           "': " + TRITONSERVER_ErrorMessage(err))
+              .c_str());
+      TRITONSERVER_ErrorDelete(err);
+    }
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+
+  ForwardedMetric* registered = metric.get();
+  metrics_.emplace(name, std::move(metric));
+  return registered;
+}
+
+#ifdef TRITON_ADSBRAIN_ENABLE_METRICS
+TRITONSERVER_Error*
+ModelMetricsRegistry::CreateTritonMetrics(
+    const std::string& name, const std::string& description,
+    ForwardedMetric* metric)
+{
+  // The metrics are only kept once they are all created, a metric
+  // partially created is not reported.
+  std::vector<TRITONSERVER_Metric*> triton_metrics;
+  TRITONSERVER_Error* err = nullptr;
+  const auto create = [&](const std::string& family_name,
+                          const TRITONSERVER_MetricKind kind,
+                          const MetricLabels& labels) {
+    TRITONSERVER_MetricFamily* family;
+    TRITONSERVER_Metric* triton_metric;
+    if (err == nullptr) {
+      err = backend_state_->ModelMetricFamily(
+          family_name, kind, description, &family);
+    }
+    if (err == nullptr) {
+      err = NewTritonMetric(family, labels, &triton_metric);
+    }
+    if (err == nullptr) {
+      triton_metrics.push_back(triton_metric);
+    }
+  };
+
+  switch (metric->MetricKind()) {
+    case ForwardedMetric::Kind::COUNTER:
+      create(name, TRITONSERVER_METRIC_KIND_COUNTER, labels_);
+      break;
+    case ForwardedMetric::Kind::GAUGE:
+      create(name, TRITONSERVER_METRIC_KIND_GAUGE, labels_);
+      break;
+    case ForwardedMetric::Kind::HISTOGRAM: {
+      const auto& bounds =
+          static_cast<ForwardedHistogram*>(metric)->Bounds();
+      MetricLabels labels = labels_;
+      labels.emplace_back("le", "");
+      for (size_t b = 0; b <= bounds.size(); ++b) {
+        char bound[32] = "+Inf";
+        if (b < bounds.size()) {
+          snprintf(bound, sizeof(bound), "%g", bounds[b]);
+        }
+        labels.back().second = bound;
+        create(name + "_bucket", TRITONSERVER_METRIC_KIND_COUNTER, labels);
+      }
+      create(name + "_sum", TRITONSERVER_METRIC_KIND_COUNTER, labels_);
+      create(name + "_count", TRITONSERVER_METRIC_KIND_COUNTER, labels_);
+      break;
+    }
+  }
+
+  if (err != nullptr) {
+    for (auto triton_metric : triton_metrics) {
+      LOG_IF_ERROR(
+          TRITONSERVER_MetricDelete(triton_metric), "failed to delete metric");
+    }
+    return err;
+  }
+  metric->triton_metrics_ = std::move(triton_metrics);
+
+  return nullptr;  // success
+}
+#endif  // TRITON_ADSBRAIN_ENABLE_METRICS
+
+void
+ModelMetricsRegistry::Flush()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  for (const auto& metric : metrics_) {
+    metric.second->Flush();
+  }
+}
+
+//
+// BatchSizeController
+//
+// Adapts the largest batch, in rows, run through the model so that the
+// compute time of a batch stays under a target while the batches stay
+// as large as possible. The compute time is modelled as 'overhead +
+// rows * row_cost', fitted by least squares over the recent batches
+// with exponential decay, and the cap is the largest batch predicted to
+// meet the target. While the batches are too similar in size for a fit
+// the cap is scaled down after a batch that missed the target, and
+// grown by one row after a full batch that met it.
+//
+class BatchSizeController {
+ public:
+  BatchSizeController(const uint64_t target_ns, const size_t max_batch_size)
+      : target_ns_(target_ns), max_batch_size_(max_batch_size),
+        cap_(max_batch_size), overhead_ns_(0), row_cost_ns_(0), weight_(0),
+        sum_rows_(0), sum_rows2_(0), sum_ns_(0), sum_rows_ns_(0)
+  {
+  }
+
+  uint64_t TargetNs() const { return target_ns_; }
+  size_t Cap() const { return cap_; }
+
+  // The fitted overhead and cost per row of a batch, 0 until batches of
+  // different sizes were observed.
+  double OverheadNs() const { return overhead_ns_; }
+  double RowCostNs() const { return row_cost_ns_; }
+
+  // Record that a batch of 'rows' took 'compute_ns' and update the cap.
+  // Return true if the cap changed.
+  bool Observe(const size_t rows, const uint64_t compute_ns);
+
+ private:
+  // Weight of the previous batches each time a batch is observed.
+  static constexpr double kDecay = 0.95;
+  // Smallest variance of the batch sizes for which the curve is fitted.
+  static constexpr double kMinRowsVariance = 0.25;
+
+  const uint64_t target_ns_;
+  const size_t max_batch_size_;
+  size_t cap_;
+  double overhead_ns_;
+  double row_cost_ns_;
+
+  // Decayed sums of the observations.
+  double weight_;
+  double sum_rows_;
+  double sum_rows2_;
+  double sum_ns_;
+  double sum_rows_ns_;
+};
+
+constexpr double BatchSizeController::kDecay;
+constexpr double BatchSizeController::kMinRowsVariance;
+
+bool
+BatchSizeController::Observe(const size_t rows, const uint64_t compute_ns)
+{
+  if (rows == 0) {
+    return false;
+  }
+
+  const double x = rows;
+  const double y = compute_ns;
+  weight_ = weight_ * kDecay + 1;
+  sum_rows_ = sum_rows_ * kDecay + x;
+  sum_rows2_ = sum_rows2_ * kDecay + x * x;
+  sum_ns_ = sum_ns_ * kDecay + y;
+  sum_rows_ns_ = sum_rows_ns_ * kDecay + x * y;
+
+  const size_t previous_cap = cap_;
+  const double mean_rows = sum_rows_ / weight_;
+  const double mean_ns = sum_ns_ / weight_;
+  const double variance = sum_rows2_ / weight_ - mean_rows * mean_rows;
+  if (variance >= kMinRowsVariance) {
+    row_cost_ns_ =
+        (sum_rows_ns_ / weight_ - mean_rows * mean_ns) / variance;
+    overhead_ns_ = mean_ns - row_cost_ns_ * mean_rows;
+    if (row_cost_ns_ <= 0) {
+      cap_ = max_batch_size_;
+    } else {
+      const double rows_in_target = (target_ns_ - overhead_ns_) / row_cost_ns_;
+      cap_ = std::max<double>(
+          1, std::min<double>(max_batch_size_, floor(rows_in_target)));
+    }
+  } else if (compute_ns > target_ns_) {
+    cap_ = std::max<size_t>(1, floor(x * target_ns_ / y));
+  } else if ((rows >= cap_) && (cap_ < max_batch_size_)) {
+    ++cap_;
+  }
+
+  return cap_ != previous_cap;
+}
+
+//
+// ExecutionProfiler
+//
+// Samples a fraction of the executions of an instance and times the
+// phases of their batches: gathering the inputs, parsing them, running
+// the model, serializing the outputs and sending the responses. With
+// CPU counters enabled, the cycles, instructions and cache misses of
+// the batches are also read through perf_event_open. The batches are
+// summarized per power of two batch size bucket. At the end of every
+// window the summary is handed to a writer thread, which appends it to
+// the output file, one line per bucket, so the executions never wait
+// for the file.
+//
+class ExecutionProfiler {
+ public:
+  enum Phase { GATHER, PARSE, INFER, SERIALIZE, SEND, PHASE_COUNT };
+
+  ExecutionProfiler(
+      const ProfilerConfig& config, const std::string& instance_name);
+  ~ExecutionProfiler();
+
+  // Whether the next execution is profiled.
+  bool SampleExecution();
+
+  // Read the CPU counters at the start of a profiled batch.
+  void StartBatch();
+
+  // Record a profiled batch of 'rows' that spent 'phase_ns' in each
+  // phase.
+  void EndBatch(const size_t rows, const uint64_t (&phase_ns)[PHASE_COUNT]);
+
+ private:
+  enum Counter { CYCLES, INSTRUCTIONS, CACHE_MISSES, COUNTER_COUNT };
+
+  struct BucketSummary {
+    uint64_t batches = 0;
+    uint64_t rows = 0;
+    uint64_t phase_total_ns[PHASE_COUNT] = {};
+    uint64_t phase_max_ns[PHASE_COUNT] = {};
+    uint64_t counters[COUNTER_COUNT] = {};
+    std::vector<uint64_t> batch_ns;
+  };
+
+  // The summary of a window, as handed to the writer thread.
+  struct Window {
+    time_t end_time;
+    uint64_t window_s;
+    uint64_t executions;
+    uint64_t sampled_executions;
+    std::vector<BucketSummary> buckets;
+  };
+
+  // Open the CPU counters of the calling thread, false if they are not
+  // available.
+  bool OpenCounters();
+  void CloseCounters();
+  bool ReadCounters(uint64_t (&values)[COUNTER_COUNT]);
+
+  // Queue the summary of the current window to be written and start a
+  // new window.
+  void EndWindow(const uint64_t now_ns);
+
+  // Append the summaries of the windows to the output file until the
+  // profiler is destroyed.
+  void RunWriter();
+  void WriteWindow(Window* window);
+
+  static constexpr uint64_t kControlCheckIntervalNs = 1000000000;
+
+  const ProfilerConfig config_;
+  const std::string instance_name_;
+
+  uint64_t random_state_;
+  uint64_t control_checked_ns_;
+  bool control_enabled_;
+
+  uint64_t window_start_ns_;
+  uint64_t executions_;
+  uint64_t sampled_executions_;
+  std::vector<BucketSummary> buckets_;
+
+  // The counters of the thread 'counters_tid_' as a perf event group
+  // led by 'counter_fds_[CYCLES]'.
+  bool counters_enabled_;
+  int counter_fds_[COUNTER_COUNT];
+  long counters_tid_;
+  uint64_t batch_start_counters_[COUNTER_COUNT];
+  bool batch_counters_valid_;
+
+  // The windows to write, shared with the writer thread.
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stopping_;
+  std::deque<std::unique_ptr<Window>> windows_;
+  std::thread writer_;
+};
+
+constexpr uint64_t ExecutionProfiler::kControlCheckIntervalNs;
+
+ExecutionProfiler::ExecutionProfiler(
+    const ProfilerConfig& config, const std::string& instance_name)
+    : config_(config), instance_name_(instance_name),
+      random_state_(NowNs() | 1), control_checked_ns_(0),
+      control_enabled_(false), window_start_ns_(NowNs()), executions_(0),
+      sampled_executions_(0), counters_enabled_(config.cpu_counters),
+      counters_tid_(0), batch_counters_valid_(false), stopping_(false),
+      writer_(&ExecutionProfiler::RunWriter, this)
+{
+  for (auto& fd : counter_fds_) {
+    fd = -1;
+  }
+}
+
+ExecutionProfiler::~ExecutionProfiler()
+{
+  if (sampled_executions_ > 0) {
+    EndWindow(NowNs());
+  }
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  cv_.notify_one();
+  writer_.join();
+  CloseCounters();
+}
+
+bool
+ExecutionProfiler::SampleExecution()
+{
+  ++executions_;
+  if (!config_.control_file.empty()) {
+    const uint64_t now_ns = NowNs();
+    if (now_ns - control_checked_ns_ >= kControlCheckIntervalNs) {
+      struct stat control_stat;
+      control_enabled_ =
+          (stat(config_.control_file.c_str(), &control_stat) == 0);
+      control_checked_ns_ = now_ns;
+    }
+    if (!control_enabled_) {
+      return false;
+    }
+  }
+
+  if (RandomFraction(&random_state_) >= config_.sample_rate) {
+    return false;
+  }
+  ++sampled_executions_;
+  return true;
+}
+
+void
+ExecutionProfiler::StartBatch()
+{
+  batch_counters_valid_ = false;
+  if (!counters_enabled_) {
+    return;
+  }
+
+#ifdef __linux__
+  // The counters only count the thread that opened them.
+  const long tid = syscall(SYS_gettid);
+  if ((tid != counters_tid_) || (counter_fds_[CYCLES] < 0)) {
+    CloseCounters();
+    counters_tid_ = tid;
+    if (!OpenCounters()) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_WARN,
+          (std::string("model instance ") + instance_name_ +
+           ": CPU counters are not available, profiling without them: " +
+           strerror(errno))
+              .c_str());
+      CloseCounters();
+      counters_enabled_ = false;
+      return;
+    }
+  }
+#endif  // __linux__
+  batch_counters_valid_ = ReadCounters(batch_start_counters_);
+}
+
+void
+ExecutionProfiler::EndBatch(
+    const size_t rows, const uint64_t (&phase_ns)[PHASE_COUNT])
+{
+  uint64_t counters[COUNTER_COUNT] = {};
+  const bool counters_valid = batch_counters_valid_ && ReadCounters(counters);
+
+  size_t bucket = 0;
+  while ((static_cast<size_t>(1) << bucket) < rows) {
+    ++bucket;
+  }
+  if (bucket >= buckets_.size()) {
+    buckets_.resize(bucket + 1);
+  }
+  BucketSummary& summary = buckets_[bucket];
+  ++summary.batches;
+  summary.rows += rows;
+  uint64_t batch_ns = 0;
+  for (size_t p = 0; p < PHASE_COUNT; ++p) {
+    summary.phase_total_ns[p] += phase_ns[p];
+    summary.phase_max_ns[p] = std::max(summary.phase_max_ns[p], phase_ns[p]);
+    batch_ns += phase_ns[p];
+  }
+  summary.batch_ns.push_back(batch_ns);
+  if (counters_valid) {
+    for (size_t c = 0; c < COUNTER_COUNT; ++c) {
+      summary.counters[c] += counters[c] - batch_start_counters_[c];
+    }
+  }
+
+  const uint64_t now_ns = NowNs();
+  if (now_ns - window_start_ns_ >= config_.interval_ns) {
+    EndWindow(now_ns);
+  }
+}
+
+bool
+ExecutionProfiler::OpenCounters()
+{
+#ifdef __linux__
+  static const uint64_t kCounterConfigs[COUNTER_COUNT] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES};
+  for (size_t c = 0; c < COUNTER_COUNT; ++c) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = kCounterConfigs[c];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counter_fds_[c] = syscall(
+        SYS_perf_event_open, &attr, 0 /* calling thread */, -1 /* any cpu */,
+        counter_fds_[CYCLES] /* group leader */, 0);
+    if (counter_fds_[c] < 0) {
+      return false;
+    }
+  }
+  return true;
+#else
+  errno = ENOSYS;
+  return false;
+#endif  // __linux__
+}
+
+void
+ExecutionProfiler::CloseCounters()
+{
+  for (auto& fd : counter_fds_) {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+}
+
+bool
+ExecutionProfiler::ReadCounters(uint64_t (&values)[COUNTER_COUNT])
+{
+  if (counter_fds_[CYCLES] < 0) {
+    return false;
+  }
+
+  // A group read returns the number of counters followed by their
+  // values.
+  uint64_t group[1 + COUNTER_COUNT];
+  if ((read(counter_fds_[CYCLES], group, sizeof(group)) !=
+       static_cast<ssize_t>(sizeof(group))) ||
+      (group[0] != COUNTER_COUNT)) {
+    return false;
+  }
+  for (size_t c = 0; c < COUNTER_COUNT; ++c) {
+    values[c] = group[1 + c];
+  }
+  return true;
+}
+
+void
+ExecutionProfiler::EndWindow(const uint64_t now_ns)
+{
+  std::unique_ptr<Window> window(new Window());
+  window->end_time = time(nullptr);
+  window->window_s = (now_ns - window_start_ns_) / 1000000000;
+  window->executions = executions_;
+  window->sampled_executions = sampled_executions_;
+  window->buckets.swap(buckets_);
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    windows_.push_back(std::move(window));
+  }
+  cv_.notify_one();
+
+  executions_ = 0;
+  sampled_executions_ = 0;
+  window_start_ns_ = now_ns;
+}
+
+void
+ExecutionProfiler::RunWriter()
+{
+  // The windows still queued are written before the profiler is
+  // destroyed.
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    cv_.wait(lock, [this]() { return stopping_ || !windows_.empty(); });
+    if (windows_.empty()) {
+      return;
+    }
+    std::unique_ptr<Window> window = std::move(windows_.front());
+    windows_.pop_front();
+    lock.unlock();
+    WriteWindow(window.get());
+    lock.lock();
+  }
+}
+
+void
+ExecutionProfiler::WriteWindow(Window* window)
+{
+  static const char* kPhaseNames[PHASE_COUNT] = {
+      "gather", "parse", "infer", "serialize", "send"};
+
+  std::string summary;
+  for (size_t b = 0; b < window->buckets.size(); ++b) {
+    BucketSummary& bucket = window->buckets[b];
+    if (bucket.batches == 0) {
+      continue;
+    }
+
+    std::sort(bucket.batch_ns.begin(), bucket.batch_ns.end());
+    const auto percentile_us = [&bucket](const double p) {
+      const size_t idx = std::min<size_t>(
+          bucket.batch_ns.size() - 1, floor(p * bucket.batch_ns.size()));
+      return bucket.batch_ns[idx] / 1000;
+    };
+    std::string line =
+        std::to_string(window->end_time) + " instance=" + instance_name_ +
+        " window_s=" + std::to_string(window->window_s) +
+        " executions=" + std::to_string(window->executions) +
+        " sampled=" + std::to_string(window->sampled_executions) +
+        " batch_size<=" + std::to_string(static_cast<size_t>(1) << b) +
+        " batches=" + std::to_string(bucket.batches) +
+        " rows=" + std::to_string(bucket.rows) +
+        " batch_us_p50=" + std::to_string(percentile_us(0.5)) +
+        " batch_us_p99=" + std::to_string(percentile_us(0.99)) +
+        " batch_us_max=" + std::to_string(bucket.batch_ns.back() / 1000);
+    for (size_t p = 0; p < PHASE_COUNT; ++p) {
+      line += std::string(" ") + kPhaseNames[p] + "_us_avg=" +
+              std::to_string(bucket.phase_total_ns[p] / bucket.batches / 1000) +
+              " " + kPhaseNames[p] +
+              "_us_max=" + std::to_string(bucket.phase_max_ns[p] / 1000);
+    }
+    if (bucket.counters[CYCLES] > 0) {
+      char ipc[32];
+      snprintf(
+          ipc, sizeof(ipc), "%.2f",
+          static_cast<double>(bucket.counters[INSTRUCTIONS]) /
+              bucket.counters[CYCLES]);
+      line += " cycles_per_row=" +
+              std::to_string(bucket.counters[CYCLES] / bucket.rows) +
+              " ipc=" + ipc + " cache_misses_per_row=" +
+              std::to_string(bucket.counters[CACHE_MISSES] / bucket.rows);
+    }
+    summary.append(line);
+    summary.push_back('\n');
+  }
+
+  // The instances of a model share the output file, the summary is
+  // appended with a single write.
+  FILE* file = fopen(config_.output_path.c_str(), "a");
+  if ((file == nullptr) ||
+      (fwrite(summary.data(), 1, summary.size(), file) != summary.size())) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_WARN,
+        (std::string("model instance ") + instance_name_ +
+         ": failed to write the profile to '" + config_.output_path +
+         "': " + strerror(errno))
+            .c_str());
+  }
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+/////////////
+
+// Create in 'input' the views of the output 'output' of a pipeline
+// stage, so it is passed to the next stage without being copied. An
+// output without shapes holds one element per request, in the shape of
+// [1]. Throws if the output does not hold the elements of all the
+// 'request_count' requests.
+void
+PipelineTensorView(
+    const OutputTensor& output, const size_t request_count,
+    const bool batching, InputTensor* input)
+{
+  input->name = output.name;
+  input->datatype = output.datatype;
+  if (output.shapes.empty()) {
+    input->request_shapes.assign(request_count, std::vector<int64_t>{1});
+  } else {
+    input->request_shapes = output.shapes;
+  }
+  if (input->request_shapes.size() != request_count) {
+    throw std::runtime_error(
+        "pipeline stage output '" + output.name + "' has " +
+        std::to_string(input->request_shapes.size()) + " shapes for " +
+        std::to_string(request_count) + " requests");
+  }
+
+  input->request_offsets.assign(1, 0);
+  for (const auto& shape : input->request_shapes) {
+    input->request_offsets.push_back(
+        input->request_offsets.back() + GetElementCount(shape));
+  }
+  const size_t element_cnt = input->request_offsets.back();
+
+  input->elements.clear();
+  input->shape.clear();
+  input->data = nullptr;
+  input->byte_size = 0;
+  input->row_stride = 0;
+  if (output.datatype == DataType::BYTES) {
+    if (output.strings.size() != element_cnt) {
+      throw std::runtime_error(
+          "pipeline stage output '" + output.name + "' has " +
+          std::to_string(output.strings.size()) + " strings, expected " +
+          std::to_string(element_cnt));
+    }
+    input->elements.reserve(element_cnt);
+    for (const auto& str : output.strings) {
+      input->elements.push_back(BytesElement{str.data(), str.size()});
+      input->byte_size += str.size();
+    }
+    return;
+  }
+
+  const size_t element_byte_size = DataTypeByteSize(output.datatype);
+  if (output.data.size() != element_cnt * element_byte_size) {
+    throw std::runtime_error(
+        "pipeline stage output '" + output.name + "' has " +
+        std::to_string(output.data.size()) + " bytes, expected " +
+        std::to_string(element_cnt * element_byte_size));
+  }
+  input->data = output.data.data();
+  input->byte_size = output.data.size();
+
+  // The output is viewed as one dense batch matrix if all the requests
+  // share the same non-batch dimensions, like a gathered input.
+  std::vector<int64_t> row_dims;
+  int64_t total_rows = 0;
+  for (const auto& shape : input->request_shapes) {
+    if (shape.empty()) {
+      return;
+    }
+    std::vector<int64_t> dims(
+        shape.begin() + (batching ? 1 : 0), shape.end());
+    if ((total_rows > 0) && (dims != row_dims)) {
+      return;
+    }
+    row_dims = dims;
+    total_rows += batching ? shape[0] : 1;
+  }
+  size_t row_byte_size = element_byte_size;
+  for (const auto dim : row_dims) {
+    row_byte_size *= dim;
+  }
+  input->shape.push_back(total_rows);
+  input->shape.insert(input->shape.end(), row_dims.begin(), row_dims.end());
+  input->row_stride = row_byte_size;
+}
+
+// Allocate 'size' bytes with AllocateHugePages for 'usage' and log how
+// much of the memory got huge pages. Reading the huge pages scans the
+// mappings of the process, so it is only done for the allocations made
+// while a model is loaded.
+void*
+AllocateLoggedHugePages(
+    const size_t size, const HugePages huge_pages, const std::string& usage)
+{
+  HugePages used;
+  void* ptr = AllocateHugePages(size, huge_pages, &used);
+  if (ptr == nullptr) {
+    return nullptr;
+  }
+
+  if (used != huge_pages) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_WARN,
+        (usage + ": " + HugePagesName(huge_pages) +
+         " huge pages are not available, falling back to " +
+         ((used == HugePages::NONE) ? "normal pages"
+                                    : "transparent huge pages"))
+            .c_str());
+  }
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      (usage + ": mapped " + std::to_string(HugePageMappingSize(size)) +
+       " bytes, " + std::to_string(HugePageBytes(ptr, size, used)) +
+       " bytes in huge pages")
+          .c_str());
+
+  return ptr;
+}
+
+//
+// StagingHugePages
+//
+// The huge pages backing the staging buffers of an instance. The
+// buffers grow while the batches are executed, so a fallback to other
+// pages is only reported once per instance.
+//
+struct StagingHugePages {
+  StagingHugePages(const HugePages mode, const std::string& instance_name)
+      : mode(mode), instance_name(instance_name), fallback_logged(false)
+  {
+  }
+
+  const HugePages mode;
+  const std::string instance_name;
+  std::atomic<bool> fallback_logged;
+};
+
+//
+// StagingAllocator
+//
+// Allocator of the staging buffers of an instance. The buffers of at
+// least a huge page are backed by the huge pages of 'huge_pages', if
+// any, the others are aligned like with AlignedAllocator.
+//
+template <typename T>
+struct StagingAllocator {
+  typedef T value_type;
+
+  explicit StagingAllocator(StagingHugePages* huge_pages = nullptr)
+      : huge_pages(huge_pages)
+  {
+  }
+  template <typename U>
+  StagingAllocator(const StagingAllocator<U>& other)
+      : huge_pages(other.huge_pages)
+  {
+  }
+
+  T* allocate(size_t n)
+  {
+    if (!UsesHugePages(n)) {
+      return AlignedAllocator<T>().allocate(n);
+    }
+    HugePages used;
+    void* ptr = AllocateHugePages(n * sizeof(T), huge_pages->mode, &used);
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    if ((used != huge_pages->mode) &&
+        !huge_pages->fallback_logged.exchange(true)) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_WARN,
+          (std::string("model instance ") + huge_pages->instance_name +
+           ": staging buffers: " + HugePagesName(huge_pages->mode) +
+           " huge pages are not available, falling back to " +
+           ((used == HugePages::NONE) ? "normal pages"
+                                      : "transparent huge pages"))
+              .c_str());
+    }
+    return static_cast<T*>(ptr);
+  }
+  void deallocate(T* ptr, size_t n)
+  {
+    if (UsesHugePages(n)) {
+      FreeHugePages(ptr, n * sizeof(T));
+    } else {
+      AlignedAllocator<T>().deallocate(ptr, n);
+    }
+  }
+
+  bool UsesHugePages(size_t n) const
+  {
+    return (huge_pages != nullptr) && (huge_pages->mode != HugePages::NONE) &&
+           (n * sizeof(T) >= HugePageSize());
+  }
+
+  StagingHugePages* huge_pages;
+};
+
+template <typename T, typename U>
+bool
+operator==(const StagingAllocator<T>& lhs, const StagingAllocator<U>& rhs)
+{
+  return lhs.huge_pages == rhs.huge_pages;
+}
+
+template <typename T, typename U>
+bool
+operator!=(const StagingAllocator<T>& lhs, const StagingAllocator<U>& rhs)
+{
+  return !(lhs == rhs);
+}
+
+// A staging buffer aligned to kTensorAlignment bytes.
+typedef std::vector<char, StagingAllocator<char>> StagingBytes;
+
+//
+// ModelSharedAssets
+//
+// The shared assets of the backend as seen by a model, which they keep
+// the library of open. The names of the assets are prefixed with
+// 'scope', so models given different scopes never share their assets.
+//
+class ModelSharedAssets : public SharedAssets {
+ public:
+  ModelSharedAssets(
+      BackendState* backend_state, const std::shared_ptr<ModelLibrary>& library,
+      const HugePages huge_pages, const std::string& scope = "")
+      : backend_state_(backend_state), library_(library),
+        huge_pages_(huge_pages), scope_(scope)
+  {
+  }
+
+  std::shared_ptr<void> AllocateMemory(size_t size) override
+  {
+    void* ptr = AllocateLoggedHugePages(size, huge_pages_, "shared asset");
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    return std::shared_ptr<void>(
+        ptr, [size](void* ptr) { FreeHugePages(ptr, size); });
+  }
+
+ protected:
+  std::shared_ptr<void> GetAsset(
+      const std::string& name, const std::string& type,
+      const std::function<std::shared_ptr<void>()>& load) override
+  {
+    return backend_state_->SharedAsset(scope_ + name, type, library_, load);
+  }
+
+ private:
+  BackendState* backend_state_;
+  std::shared_ptr<ModelLibrary> library_;
+  HugePages huge_pages_;
+  std::string scope_;
+};
+
+//
+// ModelSnapshot
+//
+// The snapshot of an initialized model, mapped read-only in memory
+// until the model it initialized is destroyed.
+//
+class ModelSnapshot {
+ public:
+  // Map the snapshot at 'path', or set 'snapshot' to null if there is
+  // none.
+  static TRITONSERVER_Error* Map(
+      const std::string& path, std::unique_ptr<ModelSnapshot>* snapshot);
+  ~ModelSnapshot() { munmap(data_, size_); }
+
+  const void* Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+ private:
+  ModelSnapshot(void* data, const size_t size) : data_(data), size_(size) {}
+
+  void* data_;
+  size_t size_;
+};
+
+TRITONSERVER_Error*
+ModelSnapshot::Map(
+    const std::string& path, std::unique_ptr<ModelSnapshot>* snapshot)
+{
+  snapshot->reset();
+  const int fd = open(path.c_str(), O_RDONLY);
+  if ((fd < 0) && (errno == ENOENT)) {
+    return nullptr;  // success
+  }
+  RETURN_ERROR_IF_TRUE(
+      fd < 0, TRITONSERVER_ERROR_INTERNAL,
+      std::string("cannot open model snapshot ") + path + ": " +
+          strerror(errno));
+
+  struct stat snapshot_stat;
+  void* data = MAP_FAILED;
+  if ((fstat(fd, &snapshot_stat) == 0) && (snapshot_stat.st_size > 0)) {
+    // The pages are read now rather than while serving the first
+    // requests.
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif  // MAP_POPULATE
+    data = mmap(nullptr, snapshot_stat.st_size, PROT_READ, flags, fd, 0);
+  }
+  const int map_errno = errno;
+  close(fd);
+  RETURN_ERROR_IF_TRUE(
+      data == MAP_FAILED, TRITONSERVER_ERROR_INTERNAL,
+      std::string("cannot map model snapshot ") + path + ": " +
+          strerror(map_errno));
+
+  snapshot->reset(new ModelSnapshot(data, snapshot_stat.st_size));
+  return nullptr;  // success
+}
+
+// The path in 'directory' of the snapshot of a model of 'model_name'
+// initialized with 'configs'. The name holds a fingerprint of the
+// parameters and of the model library file, so a snapshot is no longer
+// used once either changes.
+std::string
+SnapshotPath(
+    const std::string& directory, const std::string& model_name,
+    const std::unordered_map<std::string, std::string>& configs)
+{
+  // 64-bit FNV-1a, stable across processes unlike std::hash.
+  uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash](const std::string& value) {
+    for (const char c : value) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    // Terminate the value so moving a character across two values
+    // changes the hash.
+    hash = (hash ^ 0xff) * 1099511628211ULL;
+  };
+
+  std::vector<std::pair<std::string, std::string>> sorted_configs(
+      configs.begin(), configs.end());
+  std::sort(sorted_configs.begin(), sorted_configs.end());
+  for (const auto& config : sorted_configs) {
+    mix(config.first);
+    mix(config.second);
+  }
+
+  auto lib_path = configs.find("model_lib_path");
+  struct stat lib_stat;
+  if ((lib_path != configs.end()) &&
+      (stat(lib_path->second.c_str(), &lib_stat) == 0)) {
+    mix(std::to_string(lib_stat.st_size));
+    mix(std::to_string(lib_stat.st_mtime));
+  }
+
+  char fingerprint[17];
+  snprintf(
+      fingerprint, sizeof(fingerprint), "%016llx",
+      static_cast<unsigned long long>(hash));
+  return directory + "/" + model_name + "-" + fingerprint + ".snapshot";
+}
+
+//
+// ShadowRunner
+//
+// Runs a sample of the batches of an instance through the shadow model,
+// a candidate build of the model loaded from another library, to
+// compare their cost on live traffic. Once the responses of a batch
+// are sent, its requests are handed to the copy thread of the runner,
+// which copies their inputs and releases them; the next batch of the
+// instance only waits for the copy if it is not done by then. The
+// batches are then run one at a time by a thread of the lowest
+// scheduling priority. At most
+// 'max_pending_batches' batches are queued or running, the batches
+// sampled beyond are dropped, so the shadow model never holds back the
+// executions. Its outputs are discarded, after being compared with the
+// outputs of the model if 'diff_outputs' is set. At the end of every
+// report interval the latency, CPU time and throughput of the two
+// models on the mirrored batches are logged side by side.
+//
+class ShadowRunner {
+ public:
+  ShadowRunner(
+      const ShadowConfig& config, AdsbrainInferenceModel* model,
+      const std::vector<TensorConfig>& outputs, const bool decoupled,
+      ModelMetricsRegistry* model_metrics, InstanceMetrics* metrics,
+      const std::string& instance_name);
+  ~ShadowRunner() { Stop(); }
+
+  // Whether the next batch is mirrored, reserving its place among the
+  // pending batches. A sampled batch must be passed to Mirror or
+  // Cancel.
+  bool Sample();
+
+  // Queue the sampled batch 'inputs' to be copied, 'sources' keeping
+  // the data it views valid until then, e.g. by releasing the requests
+  // of the batch when they are destroyed. The model returned 'outputs'
+  // for the 'rows' rows of the batch in 'infer_ns', using 'infer_cpu_ns'
+  // of CPU time. 'inputs' and 'outputs' are moved into the queue.
+  void Mirror(
+      InferenceInputs* inputs, InferenceOutputs* outputs,
+      const uint64_t infer_ns, const uint64_t infer_cpu_ns,
+      const size_t rows, std::vector<std::shared_ptr<void>>&& sources);
+
+  // Release the place of a sampled batch that is not mirrored.
+  void Cancel();
+
+  // Wait until the batches mirrored so far are copied. The buffers of
+  // the instance viewed by a mirrored batch are only reused after.
+  void WaitCopied();
+
+  // Drop the batches still queued and log the last report once the
+  // running batch completes.
+  void Stop();
+
+ private:
+  struct Batch {
+    InferenceInputs inputs;
+    // Keep the data viewed by 'inputs' valid until it is copied.
+    std::vector<std::shared_ptr<void>> sources;
+    // The copies of the data viewed by 'inputs'.
+    std::deque<AlignedBytes> buffers;
+    // The outputs of the model, empty unless they are compared.
+    InferenceOutputs outputs;
+    uint64_t infer_ns;
+    uint64_t infer_cpu_ns;
+    size_t rows;
+  };
+
+  // The cost of one of the models on the batches of a report.
+  struct ModelSummary {
+    uint64_t total_ns = 0;
+    uint64_t cpu_ns = 0;
+    std::vector<uint64_t> batch_ns;
+  };
+
+  // Discards the partial responses of a decoupled shadow model.
+  class DiscardingResponseSender : public ResponseSender {
+   public:
+    explicit DiscardingResponseSender(const size_t request_count)
+        : request_count_(request_count)
+    {
+    }
+
+    void Send(const InferenceOutputs&) override {}
+    void Send(size_t request_idx, const InferenceOutputs&) override
+    {
+      if (request_idx >= request_count_) {
+        throw std::out_of_range(
+            "cannot send a response to request " +
+            std::to_string(request_idx) + " in a batch of " +
+            std::to_string(request_count_));
+      }
+    }
+
+   private:
+    size_t request_count_;
+  };
+
+  void Run();
+  void RunBatch(Batch* batch);
+
+  // Copy the batches handed to the runner, then queue them to be run.
+  void RunCopies();
+
+  // Copy the data viewed by the inputs of 'batch' into its buffers.
+  static void CopyInputs(Batch* batch);
+
+  // The first difference between the outputs of the shadow model and
+  // 'expected', empty if they are the same.
+  static std::string DiffOutputs(
+      const InferenceOutputs& expected, const InferenceOutputs& outputs);
+
+  // Log the summary of the current report and start a new one.
+  void Report(const uint64_t now_ns);
+
+  const ShadowConfig config_;
+  AdsbrainInferenceModel* model_;
+  const std::vector<TensorConfig> outputs_;
+  const bool decoupled_;
+  ModelMetricsRegistry* model_metrics_;
+  InstanceMetrics* metrics_;
+  const std::string instance_name_;
+
+  // The sampling and the queues, shared with the executions.
+  // 'copies_' holds the batches to copy and 'batches_' the batches to
+  // run. 'copying_' is set while a batch is copied.
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::condition_variable copy_cv_;
+  std::condition_variable copied_cv_;
+  bool stopping_;
+  uint64_t random_state_;
+  size_t pending_;
+  uint64_t dropped_;
+  bool copying_;
+  std::deque<std::unique_ptr<Batch>> copies_;
+  std::deque<std::unique_ptr<Batch>> batches_;
+
+  // The summary of the current report, only used by the thread.
+  uint64_t report_start_ns_;
+  uint64_t mirrored_;
+  uint64_t failed_;
+  uint64_t rows_;
+  uint64_t diffs_;
+  std::string first_error_;
+  std::string first_diff_;
+  ModelSummary primary_;
+  ModelSummary shadow_;
+
+  std::thread thread_;
+  std::thread copy_thread_;
+};
+
+ShadowRunner::ShadowRunner(
+    const ShadowConfig& config, AdsbrainInferenceModel* model,
+    const std::vector<TensorConfig>& outputs, const bool decoupled,
+    ModelMetricsRegistry* model_metrics, InstanceMetrics* metrics,
+    const std::string& instance_name)
+    : config_(config), model_(model), outputs_(outputs),
+      decoupled_(decoupled), model_metrics_(model_metrics), metrics_(metrics),
+      instance_name_(instance_name), stopping_(false),
+      random_state_(NowNs() | 1), pending_(0), dropped_(0), copying_(false),
+      report_start_ns_(NowNs()), mirrored_(0), failed_(0), rows_(0),
+      diffs_(0), thread_(&ShadowRunner::Run, this),
+      copy_thread_(&ShadowRunner::RunCopies, this)
+{
+}
+
+bool
+ShadowRunner::Sample()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (stopping_ || (RandomFraction(&random_state_) >= config_.sample_rate)) {
+    return false;
+  }
+  if (pending_ >= config_.max_pending_batches) {
+    ++dropped_;
+    metrics_->Increment(InstanceMetric::SHADOW_DROPPED_BATCHES, 1);
+    return false;
+  }
+  ++pending_;
+  return true;
+}
+
+void
+ShadowRunner::Mirror(
+    InferenceInputs* inputs, InferenceOutputs* outputs,
+    const uint64_t infer_ns, const uint64_t infer_cpu_ns, const size_t rows,
+    std::vector<std::shared_ptr<void>>&& sources)
+{
+  std::unique_ptr<Batch> batch(new Batch());
+  batch->inputs = std::move(*inputs);
+  batch->sources = std::move(sources);
+  batch->infer_ns = infer_ns;
+  batch->infer_cpu_ns = infer_cpu_ns;
+  batch->rows = rows;
+  if (config_.diff_outputs) {
+    batch->outputs = std::move(*outputs);
+    batch->outputs.response_sender = nullptr;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (stopping_) {
+      return;
+    }
+    copies_.push_back(std::move(batch));
+  }
+  copy_cv_.notify_one();
+}
+
+void
+ShadowRunner::CopyInputs(Batch* batch)
+{
+  // Copy the elements of a view into a new buffer and repoint them to
+  // it. The buffer is never empty so that an empty element is not
+  // taken for a missing payload field.
+  const auto copy_elements = [batch](std::vector<BytesElement>* elements) {
+    size_t byte_size = 1;
+    for (const auto& element : *elements) {
+      byte_size += element.size;
+    }
+    batch->buffers.emplace_back(byte_size);
+    char* dst = batch->buffers.back().data();
+    for (auto& element : *elements) {
+      if (element.data != nullptr) {
+        memcpy(dst, element.data, element.size);
+        element.data = dst;
+        dst += element.size;
+      }
+    }
+  };
+  for (auto& tensor : batch->inputs.tensors) {
+    if (tensor.datatype == DataType::BYTES) {
+      copy_elements(&tensor.elements);
+      tensor.data = nullptr;
+    } else {
+      batch->buffers.emplace_back(
+          static_cast<const char*>(tensor.data),
+          static_cast<const char*>(tensor.data) + tensor.byte_size);
+      tensor.data = batch->buffers.back().data();
+    }
+  }
+  for (auto& column : batch->inputs.payloads.columns) {
+    copy_elements(&column.values);
+  }
+}
+
+void
+ShadowRunner::Cancel()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  --pending_;
+}
+
+void
+ShadowRunner::WaitCopied()
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  copied_cv_.wait(lock, [this]() { return copies_.empty() && !copying_; });
+}
+
+void
+ShadowRunner::Stop()
+{
+  // The batches not copied yet release their requests once dropped.
+  std::deque<std::unique_ptr<Batch>> copies;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (stopping_) {
+      return;
+    }
+    stopping_ = true;
+    copies.swap(copies_);
+    batches_.clear();
+  }
+  cv_.notify_one();
+  copy_cv_.notify_one();
+  copied_cv_.notify_all();
+  copy_thread_.join();
+  thread_.join();
+  copies.clear();
+  if ((mirrored_ > 0) || (dropped_ > 0)) {
+    Report(NowNs());
+  }
+}
+
+void
+ShadowRunner::Run()
+{
+#ifdef SCHED_IDLE
+  // The shadow model only gets the CPU time the executions leave idle.
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  if (sched_setscheduler(0 /* calling thread */, SCHED_IDLE, &param) != 0) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_WARN,
+        (std::string("model instance ") + instance_name_ +
+         ": failed to lower the priority of the shadow model: " +
+         strerror(errno))
+            .c_str());
+  }
+#endif  // SCHED_IDLE
+
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    cv_.wait(lock, [this]() { return stopping_ || !batches_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    std::unique_ptr<Batch> batch = std::move(batches_.front());
+    batches_.pop_front();
+    lock.unlock();
+    RunBatch(batch.get());
+    batch.reset();
+    lock.lock();
+    --pending_;
+  }
+}
+
+void
+ShadowRunner::RunCopies()
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    copy_cv_.wait(lock, [this]() { return stopping_ || !copies_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    std::unique_ptr<Batch> batch = std::move(copies_.front());
+    copies_.pop_front();
+    copying_ = true;
+    lock.unlock();
+    CopyInputs(batch.get());
+    batch->sources.clear();
+    lock.lock();
+    copying_ = false;
+    if (!stopping_) {
+      batches_.push_back(std::move(batch));
+    }
+    cv_.notify_one();
+    copied_cv_.notify_all();
+  }
+}
+
+void
+ShadowRunner::RunBatch(Batch* batch)
+{
+  InferenceOutputs outputs;
+  outputs.tensors.resize(outputs_.size());
+  for (size_t o = 0; o < outputs_.size(); ++o) {
+    outputs.tensors[o].name = outputs_[o].name;
+    outputs.tensors[o].datatype = outputs_[o].adsbrain_datatype;
+  }
+  DiscardingResponseSender response_sender(batch->inputs.request_count);
+  if (decoupled_) {
+    outputs.response_sender = &response_sender;
+  }
+
+  const uint64_t start_ns = NowNs();
+  const uint64_t start_cpu_ns = ThreadCpuNs();
+  std::string error;
+  try {
+    model_->RunTensorInference(batch->inputs, &outputs);
+  }
+  catch (const std::exception& ex) {
+    error = ex.what();
+  }
+  const uint64_t infer_ns = NowNs() - start_ns;
+  const uint64_t infer_cpu_ns = ThreadCpuNs() - start_cpu_ns;
+  model_metrics_->Flush();
+
+  ++mirrored_;
+  metrics_->Increment(InstanceMetric::SHADOW_BATCHES, 1);
+  if (!error.empty()) {
+    ++failed_;
+    if (first_error_.empty()) {
+      first_error_ = error;
+    }
+    metrics_->Increment(InstanceMetric::SHADOW_FAILED_BATCHES, 1);
+  } else {
+    // Only the batches run by both models are compared.
+    rows_ += batch->rows;
+    primary_.total_ns += batch->infer_ns;
+    primary_.cpu_ns += batch->infer_cpu_ns;
+    primary_.batch_ns.push_back(batch->infer_ns);
+    shadow_.total_ns += infer_ns;
+    shadow_.cpu_ns += infer_cpu_ns;
+    shadow_.batch_ns.push_back(infer_ns);
+    metrics_->Increment(
+        InstanceMetric::SHADOW_PRIMARY_INFER_DURATION_US,
+        batch->infer_ns / 1000.0);
+    metrics_->Increment(
+        InstanceMetric::SHADOW_INFER_DURATION_US, infer_ns / 1000.0);
+    metrics_->Increment(
+        InstanceMetric::SHADOW_PRIMARY_CPU_US, batch->infer_cpu_ns / 1000.0);
+    metrics_->Increment(InstanceMetric::SHADOW_CPU_US, infer_cpu_ns / 1000.0);
+
+    if (config_.diff_outputs) {
+      const std::string diff = DiffOutputs(batch->outputs, outputs);
+      if (!diff.empty()) {
+        ++diffs_;
+        if (first_diff_.empty()) {
+          first_diff_ = diff;
+        }
+        metrics_->Increment(InstanceMetric::SHADOW_OUTPUT_DIFFS, 1);
+      }
+    }
+  }
+
+  const uint64_t now_ns = NowNs();
+  if (now_ns - report_start_ns_ >= config_.report_interval_ns) {
+    Report(now_ns);
+  }
+}
+
+std::string
+ShadowRunner::DiffOutputs(
+    const InferenceOutputs& expected, const InferenceOutputs& outputs)
+{
+  for (size_t o = 0; o < expected.tensors.size(); ++o) {
+    const OutputTensor& want = expected.tensors[o];
+    const OutputTensor& got = outputs.tensors[o];
+    if (want.shapes != got.shapes) {
+      return "output '" + want.name + "' has different shapes";
+    }
+    if (want.strings.size() != got.strings.size()) {
+      return "output '" + want.name + "' has " +
+             std::to_string(got.strings.size()) + " elements instead of " +
+             std::to_string(want.strings.size());
+    }
+    for (size_t e = 0; e < want.strings.size(); ++e) {
+      if (want.strings[e] != got.strings[e]) {
+        return "output '" + want.name + "' differs at element " +
+               std::to_string(e);
+      }
+    }
+    if (want.data.size() != got.data.size()) {
+      return "output '" + want.name + "' has " +
+             std::to_string(got.data.size()) + " bytes instead of " +
+             std::to_string(want.data.size());
+    }
+    if ((want.data.size() > 0) &&
+        (memcmp(want.data.data(), got.data.data(), want.data.size()) != 0)) {
+      return "output '" + want.name + "' has different data";
+    }
+  }
+  return std::string();
+}
+
+void
+ShadowRunner::Report(const uint64_t now_ns)
+{
+  uint64_t dropped;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    dropped = dropped_;
+    dropped_ = 0;
+  }
+
+  const uint64_t compared = mirrored_ - failed_;
+  const auto summarize = [this, compared](
+                             const char* name,
+                             ModelSummary* summary) -> std::string {
+    if (compared == 0) {
+      return std::string();
+    }
+    std::sort(summary->batch_ns.begin(), summary->batch_ns.end());
+    const auto percentile_us = [summary](const double p) {
+      const size_t idx = std::min<size_t>(
+          summary->batch_ns.size() - 1, floor(p * summary->batch_ns.size()));
+      return summary->batch_ns[idx] / 1000;
+    };
+    const uint64_t rows_per_s =
+        (summary->total_ns > 0)
+            ? static_cast<uint64_t>(rows_ * 1000000000.0 / summary->total_ns)
+            : 0;
+    return std::string(" ") + name +
+           "_us_avg=" + std::to_string(summary->total_ns / compared / 1000) +
+           " " + name + "_us_p50=" + std::to_string(percentile_us(0.5)) +
+           " " + name + "_us_p99=" + std::to_string(percentile_us(0.99)) +
+           " " + name +
+           "_cpu_us_avg=" + std::to_string(summary->cpu_ns / compared / 1000) +
+           " " + name + "_rows_per_s=" + std::to_string(rows_per_s);
+  };
+
+  std::string report =
+      "model instance " + instance_name_ +
+      ": shadow window_s=" +
+      std::to_string((now_ns - report_start_ns_) / 1000000000) +
+      " mirrored=" + std::to_string(mirrored_) +
+      " dropped=" + std::to_string(dropped) +
+      " failed=" + std::to_string(failed_) + " rows=" + std::to_string(rows_) +
+      summarize("primary", &primary_) + summarize("shadow", &shadow_);
+  if (config_.diff_outputs) {
+    report += " diffs=" + std::to_string(diffs_);
+  }
+  if (!first_diff_.empty()) {
+    report += " first_diff=\"" + first_diff_ + "\"";
+  }
+  if (!first_error_.empty()) {
+    report += " first_error=\"" + first_error_ + "\"";
+  }
+  LOG_MESSAGE(TRITONSERVER_LOG_INFO, report.c_str());
+
+  report_start_ns_ = now_ns;
+  mirrored_ = 0;
+  failed_ = 0;
+  rows_ = 0;
+  diffs_ = 0;
+  first_error_.clear();
+  first_diff_.clear();
+  primary_ = ModelSummary();
+  shadow_ = ModelSummary();
+}
+
+//
+// ModelInstanceState
+//
+// State associated with a model instance. An object of this class is
+// created and associated with each
+// TRITONBACKEND_ModelInstance. ModelInstanceState is derived from
+// BackendModelInstance class provided in the backend utilities that
+// provides many common functions.
+//
+class ModelInstanceState : public BackendModelInstance {
+ public:
+  static TRITONSERVER_Error* Create(
+      ModelState* model_state,
+      TRITONBACKEND_ModelInstance* triton_model_instance,
+      ModelInstanceState** state);
+  virtual ~ModelInstanceState()
+  {
+    // The shard stops running the batches of the other instances
+    // before its model is destroyed.
+    if (model_state_->Shards() != nullptr) {
+      model_state_->Shards()->Leave(shard_idx_);
+      if (shard_executor_ != nullptr) {
+        shard_executor_->Stop();
+      }
+    }
+    // The shadow model stops before the metrics it updates.
+    if (shadow_runner_ != nullptr) {
+      shadow_runner_->Stop();
+    }
+  }
+
+  // Get the state of the model that corresponds to this instance.
+  ModelState* StateForModel() const { return model_state_; }
+
+  // The backend metrics of the instance.
+  InstanceMetrics* Metrics() { return &metrics_; }
+
+  // Forward the updates of the metrics of the model.
+  void FlushModelMetrics() { model_metrics_.Flush(); }
+
+  // The sampling profiler of the executions, null if the model is not
+  // profiled.
+  ExecutionProfiler* Profiler() { return profiler_.get(); }
+
+  // The runner of the shadow model, null if the model has no shadow.
+  ShadowRunner* Shadow() { return shadow_runner_.get(); }
+
+  // Whether the next batch is captured.
+  bool SampleCapture()
+  {
+    RequestCapture* capture = model_state_->Capture();
+    return (capture != nullptr) && capture->SampleBatch(&capture_random_state_);
+  }
+
+  // Capture the batch of the execution started at 'exec_start_ns' whose
+  // captured input is 'tensor'.
+  void CaptureBatch(const InputTensor& tensor, const uint64_t exec_start_ns);
+
+  void RunInference(const InferenceInputs& inputs, InferenceOutputs* outputs)
+  {
+    if (model_state_->Shards() != nullptr) {
+      RunShards(inputs, outputs);
+    } else if (pipeline_models_.empty()) {
+      adsbrain_model_->RunTensorInference(inputs, outputs);
+    } else {
+      RunPipeline(inputs, outputs);
+    }
+  }
+
+  // Gather input 'input_idx' of all the requests with 'collector'. The
+  // gathered buffer is returned in 'buffer' and 'tensor' is prepared
+  // with the shape and the byte range of each request; the views into
+  // 'buffer' are created by ParseInputTensor once the collector is
+  // finalized. Numeric inputs are gathered into an aligned batch
+  // buffer owned by the instance. A BYTES input held in a single CPU
+  // buffer by every request is not gathered: the buffer of each request
+  // is returned in 'request_buffers' and parsed in place.
+  TRITONSERVER_Error* CollectInputTensor(
+      BackendInputCollector* collector, const size_t input_idx,
+      TRITONBACKEND_Request** requests, const uint32_t request_count,
+      std::vector<TRITONBACKEND_Response*>* responses, const char** buffer,
+      std::vector<size_t>* request_byte_offsets,
+      std::vector<const char*>* request_buffers, InputTensor* tensor);
+
+  // Gather the implicit state 'state_idx' of all the requests, like
+  // CollectInputTensor.
+  TRITONSERVER_Error* CollectStateTensor(
+      BackendInputCollector* collector, const size_t state_idx,
+      TRITONBACKEND_Request** requests, const uint32_t request_count,
+      std::vector<TRITONBACKEND_Response*>* responses, const char** buffer,
+      std::vector<size_t>* request_byte_offsets,
+      std::vector<const char*>* request_buffers, InputTensor* tensor);
+
+  // Split the requests of an execution into the batches that are run
+  // one after the other, as indices into 'requests'. High priority
+  // requests are run first, together with the share of low priority
+  // requests reserved by the model configuration. Batches larger than
+  // the cap of the batch size controller or the payload bytes limit are
+  // split, the requests with the smallest payloads being run first.
+  // 'rows' and 'priorities' are those read by ShedRequests.
+  void PartitionRequests(
+      TRITONBACKEND_Request** requests, const uint32_t request_count,
+      const std::vector<size_t>& rows, const std::vector<int64_t>& priorities,
+      std::vector<TRITONBACKEND_Response*>* responses,
+      std::vector<std::vector<uint32_t>>* batches);
+
+  // Shed the requests of an execution that the instance cannot serve
+  // within the latency budget of the model given its recent time per
+  // row, the lowest priority and then the latest requests first. The
+  // shed requests get a retryable UNAVAILABLE error and are flagged in
+  // 'shed'. The first request is always admitted so the time per row
+  // keeps being measured. The batch size and the priority of each
+  // request are returned in 'rows' and 'priorities' so they are read
+  // once per execution.
+  void ShedRequests(
+      TRITONBACKEND_Request** requests, const uint32_t request_count,
+      std::vector<TRITONBACKEND_Response*>* responses,
+      std::vector<size_t>* rows, std::vector<int64_t>* priorities,
+      std::vector<bool>* shed);
+
+  // The number of requests shed by the instance.
+  uint64_t ShedCount() const { return shed_count_; }
+
+  // Record the compute time and the total time of a batch of 'rows' for
+  // the batch size controller and the load shedding.
+  void ObserveBatch(
+      const size_t rows, const uint64_t compute_ns, const uint64_t batch_ns);
+
+  // Read the correlation ID and the start and end controls of the
+  // sequence of each request.
+  void ReadSequenceControls(
+      TRITONBACKEND_Request** requests, const uint32_t request_count,
+      std::vector<TRITONBACKEND_Response*>* responses,
+      std::vector<SequenceRequest>* sequences);
+
+  // Create the views of 'tensor' into the gathered 'buffer', or into the
+  // buffer of each request if 'request_buffers' is not empty.
+  void ParseInputTensor(
+      const char* buffer, const std::vector<size_t>& request_byte_offsets,
+      const std::vector<const char*>& request_buffers,
+      const uint32_t request_count,
+      std::vector<TRITONBACKEND_Response*>* responses, InputTensor* tensor);
+
+  // Replace the compressed elements of BYTES input 'input_idx' by their
+  // decompressed data, which is stored in a per-input scratch buffer
+  // reused across executions. Requests with invalid payloads fail, as
+  // do the requests that would take 'batch_byte_size', the bytes
+  // decompressed for the previous inputs of the batch, beyond
+  // PayloadMaxBatchUncompressedBytes().
+  void DecompressInputTensor(
+      const size_t input_idx, size_t* batch_byte_size,
+      std::vector<TRITONBACKEND_Response*>* responses, InputTensor* tensor);
+
+  // Decode the payloads of the configured input into the columns of
+  // 'inputs', failing the requests whose payloads cannot be decoded.
+  // Does nothing if no payload decoder is configured.
+  void DecodePayloads(
+      InferenceInputs* inputs, std::vector<TRITONBACKEND_Response*>* responses);
+
+  // Compress 'strings' with the response codec of the model into a
+  // scratch buffer reused across executions and return the views of the
+  // compressed records.
+  TRITONSERVER_Error* CompressStrings(
+      const std::vector<std::string>& strings,
+      std::vector<BytesElement>* records);
+
+  // Create the response output for 'tensor' in each response, or when
+  // 'state' is true store 'tensor' as the new implicit state of the
+  // sequence of each request. 'request_batch_sizes' is used to derive
+  // the shape of the output when the model did not set it.
+  TRITONSERVER_Error* SetOutputTensor(
+      const OutputTensor& tensor, const TensorConfig& config,
+      const std::vector<int64_t>& request_batch_sizes,
+      TRITONBACKEND_Request** requests,
+      std::vector<TRITONBACKEND_Response*>* responses, const bool state,
+      bool* cuda_copy);
+
+  // Serialize 'element_cnt' strings into 'buffer' as length-prefixed
+  // records, 'element(e)' returning the BytesElement of element 'e'.
+  // The records are written directly when 'buffer' is in CPU memory,
+  // otherwise they are serialized into a staging buffer and copied with
+  // a single CopyBuffer call. 'byte_size' must be the total serialized
+  // size of the elements.
+  template <typename ElementFn>
+  TRITONSERVER_Error* WriteStringElements(
+      const std::string& name, const size_t element_cnt,
+      const size_t byte_size, ElementFn element, void* buffer,
+      TRITONSERVER_MemoryType memory_type, int64_t memory_type_id,
+      bool* cuda_used);
+
+ private:
+  // Gather the tensor 'config' of all the requests, numeric tensors
+  // into 'batch_buffer'.
+  TRITONSERVER_Error* CollectTensor(
+      BackendInputCollector* collector, const TensorConfig& config,
+      StagingBytes* batch_buffer, TRITONBACKEND_Request** requests,
+      const uint32_t request_count,
+      std::vector<TRITONBACKEND_Response*>* responses, const char** buffer,
+      std::vector<size_t>* request_byte_offsets,
+      std::vector<const char*>* request_buffers, InputTensor* tensor);
+
+  // Whether the sequence control 'config' is set in 'request'.
+  TRITONSERVER_Error* SequenceControlSet(
+      TRITONBACKEND_Request* request, const SequenceControlConfig& config,
+      bool* set);
+
+  // The priority of 'request', 0 if the request has no priority input.
+  TRITONSERVER_Error* RequestPriority(
+      TRITONBACKEND_Request* request, int64_t* priority);
+
+  // The batch size of 'request', the first dimension of its first
+  // input.
+  TRITONSERVER_Error* RequestBatchSize(
+      TRITONBACKEND_Request* request, size_t* batch_size);
+
+  // The total byte size of the inputs of 'request'.
+  TRITONSERVER_Error* RequestPayloadBytes(
+      TRITONBACKEND_Request* request, size_t* byte_size);
+
+  // Split 'batch' into consecutive batches of at most 'row_cap' rows and
+  // 'byte_cap' payload bytes.
+  void SplitBatch(
+      const std::vector<uint32_t>& batch, const std::vector<size_t>& rows,
+      const size_t row_cap, const std::vector<size_t>& bytes,
+      const size_t byte_cap, std::vector<std::vector<uint32_t>>* batches);
+
+  // The only buffer of 'input', of 'byte_size' bytes, if it is in CPU
+  // memory.
+  bool ReadCpuBuffer(
+      TRITONBACKEND_Input* input, const uint64_t byte_size,
+      const char** buffer);
+
+  // Run the stages of the pipeline one after the other. Every stage
+  // after the first receives the outputs of the previous stage as
+  // views, followed by the inputs of the requests, and the last stage
+  // fills 'outputs'.
+  void RunPipeline(const InferenceInputs& inputs, InferenceOutputs* outputs);
+
+  // Create the model of 'library' into 'model', with 'metrics' and
+  // 'assets', and initialize it with 'configs': from its snapshot if
+  // the model has one in the snapshot directory, and with Initialize()
+  // otherwise, after which its snapshot is written. A model refusing
+  // its snapshot may be partially initialized, so it is replaced by a
+  // new model before Initialize() is called.
+  void LoadModel(
+      const ModelLibrary& library, MetricsRegistry* metrics,
+      SharedAssets* assets,
+      const std::unordered_map<std::string, std::string>& configs,
+      std::unique_ptr<AdsbrainInferenceModel>* model);
+
+  // Scatter the batch to all the shards of the model, which run it
+  // concurrently, and combine their outputs into 'outputs' with the
+  // model of this instance.
+  void RunShards(const InferenceInputs& inputs, InferenceOutputs* outputs);
+
+  // Read the first buffer of the small CPU input 'name' of 'request'
+  // directly, without the collector.
+  TRITONSERVER_Error* ReadControlInput(
+      TRITONBACKEND_Request* request, const std::string& name,
+      const void** buffer, uint64_t* byte_size);
+
+  ModelInstanceState(
+      ModelState* model_state,
+      TRITONBACKEND_ModelInstance* triton_model_instance)
+      : BackendModelInstance(model_state, triton_model_instance),
+        model_state_(model_state), shard_idx_(0),
+        staging_huge_pages_(model_state->HugePagesMode(), Name()),
+        input_batch_buffers_(
+            model_state->Inputs().size(),
+            StagingBytes(StagingAllocator<char>(&staging_huge_pages_))),
+        state_batch_buffers_(
+            model_state->States().size(),
+            StagingBytes(StagingAllocator<char>(&staging_huge_pages_))),
+        payload_decoder_(
+            PayloadDecoder::Create(model_state->PayloadDecoding())),
+        payload_compressor_(model_state->ResponseCompressionLevel()),
+        decompression_buffers_(
+            model_state->Inputs().size(),
+            StagingBytes(StagingAllocator<char>(&staging_huge_pages_))),
+        compression_buffer_(
+            StagingAllocator<char>(&staging_huge_pages_)),
+        output_staging_buffer_(
+            StagingAllocator<char>(&staging_huge_pages_)),
+        row_time_ns_(0), shedding_(false), shed_count_(0),
+        episode_shed_count_(0), capture_random_state_(NowNs() | 1)
+  {
+    if (model_state->BatchLatencyTargetNs() > 0) {
+      batch_size_controller_.reset(new BatchSizeController(
+          model_state->BatchLatencyTargetNs(), model_state->MaxBatchSize()));
+    }
+
+    if (model_state->Profiling().sample_rate > 0) {
+      profiler_.reset(new ExecutionProfiler(model_state->Profiling(), Name()));
+    }
+
+    // The instance runs without metrics if they cannot be created.
+    LOG_IF_ERROR(
+        metrics_.Init(
+            model_state->TritonModel(), model_state->Name(),
+            model_state->Version(), Name(), model_state->MaxBatchSize()),
+        "failed to create the metrics of the model instance");
+
+    auto adsbrain_model_configurations = model_state_->GetModelConfig();
+
+    // The model of a shard only loads its part of the model.
+    ShardGroup* shards = model_state->Shards();
+    if (shards != nullptr) {
+      THROW_IF_BACKEND_INSTANCE_ERROR(shards->Join(&shard_idx_));
+      adsbrain_model_configurations["shard_index"] = std::to_string(shard_idx_);
+      adsbrain_model_configurations["shard_count"] =
+          std::to_string(shards->ShardCount());
+    }
+
+    BackendState* backend_state;
+    THROW_IF_BACKEND_INSTANCE_ERROR(
+        BackendState::ForModel(model_state->TritonModel(), &backend_state));
+    std::shared_ptr<ModelLibrary> library;
+    THROW_IF_BACKEND_INSTANCE_ERROR(backend_state->AcquireModelLibrary(
+        adsbrain_model_configurations["model_lib_path"], &library));
+    model_assets_.reset(new ModelSharedAssets(
+        backend_state, library, model_state->HugePagesMode()));
+
+    LOG_IF_ERROR(
+        model_metrics_.Init(
+            model_state->TritonModel(), model_state->Name(),
+            model_state->Version(), Name()),
+        "failed to create the metrics of the model");
+
+    LoadModel(
+        *library, &model_metrics_, model_assets_.get(),
+        adsbrain_model_configurations, &adsbrain_model_);
+
+    // Every stage of a pipeline gets the parameters of the model, with
+    // 'model_lib_path' set to its own library.
+    for (const auto& stage : model_state->Pipeline()) {
+      THROW_IF_BACKEND_INSTANCE_ERROR(
+          backend_state->AcquireModelLibrary(stage.model_lib_path, &library));
+      pipeline_assets_.emplace_back(new ModelSharedAssets(
+          backend_state, library, model_state->HugePagesMode()));
+      pipeline_models_.emplace_back();
+
+      auto stage_configurations = adsbrain_model_configurations;
+      stage_configurations["model_lib_path"] = stage.model_lib_path;
+      LoadModel(
+          *library, &model_metrics_, pipeline_assets_.back().get(),
+          stage_configurations, &pipeline_models_.back());
+    }
+
+    // The shadow model also gets the parameters of the model, with
+    // 'model_lib_path' set to its own library. Its metrics are labelled
+    // as another instance, and its shared assets are kept apart from
+    // the ones of the model, whose types may have changed between the
+    // builds.
+    const ShadowConfig& shadow = model_state->Shadow();
+    if (!shadow.model_lib_path.empty()) {
+      THROW_IF_BACKEND_INSTANCE_ERROR(
+          backend_state->AcquireModelLibrary(shadow.model_lib_path, &library));
+      shadow_assets_.reset(new ModelSharedAssets(
+          backend_state, library, model_state->HugePagesMode(), "shadow:"));
+      LOG_IF_ERROR(
+          shadow_metrics_.Init(
+              model_state->TritonModel(), model_state->Name(),
+              model_state->Version(), Name() + "/shadow"),
+          "failed to create the metrics of the shadow model");
+
+      auto shadow_configurations = adsbrain_model_configurations;
+      shadow_configurations["model_lib_path"] = shadow.model_lib_path;
+      LoadModel(
+          *library, &shadow_metrics_, shadow_assets_.get(),
+          shadow_configurations, &shadow_model_);
+      shadow_runner_.reset(new ShadowRunner(
+          shadow, shadow_model_.get(), model_state->Outputs(),
+          model_state->Decoupled(), &shadow_metrics_, &metrics_, Name()));
+    }
+
+    if (shards != nullptr) {
+      shard_executor_.reset(new ShardExecutor(adsbrain_model_.get()));
+      shards->Start(shard_idx_, shard_executor_);
+    }
+  }
+
+  ModelState* model_state_;
+  // Declared before the models, which may use their metrics, shared
+  // assets and snapshots until they are destroyed. The shared assets of
+  // a model hold its library open.
+  ModelMetricsRegistry model_metrics_;
+  std::vector<std::unique_ptr<ModelSnapshot>> snapshots_;
+  std::unique_ptr<ModelSharedAssets> model_assets_;
+  std::unique_ptr<AdsbrainInferenceModel> adsbrain_model_;
+
+  // The stages of the pipeline after 'adsbrain_model_' and their
+  // shared assets, in the order of the model configuration.
+  std::vector<std::unique_ptr<ModelSharedAssets>> pipeline_assets_;
+  std::vector<std::unique_ptr<AdsbrainInferenceModel>> pipeline_models_;
+
+  // The shadow model with its metrics and shared assets, and the runner
+  // mirroring the sampled batches to it, null if the model has no
+  // shadow.
+  ModelMetricsRegistry shadow_metrics_;
+  std::unique_ptr<ModelSharedAssets> shadow_assets_;
+  std::unique_ptr<AdsbrainInferenceModel> shadow_model_;
+  std::unique_ptr<ShadowRunner> shadow_runner_;
+
+  // The shard of the model held by the instance and the executor
+  // running the batches scattered to it, if the model is sharded.
+  size_t shard_idx_;
+  std::shared_ptr<ShardExecutor> shard_executor_;
+
+  // The huge pages of the staging buffers below, declared before them.
+  StagingHugePages staging_huge_pages_;
+
+  // Aligned batch buffers of the numeric inputs and states, indexed
+  // like the model inputs and states and reused across executions.
+  std::vector<StagingBytes> input_batch_buffers_;
+  std::vector<StagingBytes> state_batch_buffers_;
+
+  // Decodes the payloads before they are passed to the model, null if
+  // the payloads are not decoded.
+  std::unique_ptr<PayloadDecoder> payload_decoder_;
+
+  // Compression of the payloads and responses, with the scratch
+  // buffers holding the decompressed payloads of each input and the
+  // compressed responses.
+  PayloadCompressor payload_compressor_;
+  std::vector<StagingBytes> decompression_buffers_;
+  StagingBytes compression_buffer_;
+
+  // Reused across executions to serialize string outputs that must be
+  // copied into non-CPU memory.
+  StagingBytes output_staging_buffer_;
+
+  // Caps the size of the batches run through the model, null if the
+  // batch size is not adapted to a latency target.
+  std::unique_ptr<BatchSizeController> batch_size_controller_;
+
+  // Decayed average of the time per row of the batches, 0 until the
+  // first batch completes, and the state of the load shedding.
+  double row_time_ns_;
+  bool shedding_;
+  uint64_t shed_count_;
+  uint64_t episode_shed_count_;
+
+  InstanceMetrics metrics_;
+
+  std::unique_ptr<ExecutionProfiler> profiler_;
+
+  // The random generator sampling the captured batches and the buffer
+  // their records are serialized into, reused across executions.
+  uint64_t capture_random_state_;
+  std::string capture_buffer_;
+};
+
+TRITONSERVER_Error*
+ModelInstanceState::Create(
+    ModelState* model_state, TRITONBACKEND_ModelInstance* triton_model_instance,
+    ModelInstanceState** state)
+{
+  try {
+    *state = new ModelInstanceState(model_state, triton_model_instance);
+  }
+  catch (const BackendModelInstanceException& ex) {
+    RETURN_ERROR_IF_TRUE(
+        ex.err_ == nullptr, TRITONSERVER_ERROR_INTERNAL,
+        std::string("unexpected nullptr in BackendModelInstanceException"));
+    RETURN_IF_ERROR(ex.err_);
+  }
+  catch (const std::exception& ex) {
+    // Thrown by the model while it is initialized.
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        (std::string("failed to initialize the model: ") + ex.what())
+            .c_str());
+  }
+
+  return nullptr;  // success
+}
+
+template <typename ElementFn>
+TRITONSERVER_Error*
+ModelInstanceState::WriteStringElements(
+    const std::string& name, const size_t element_cnt, const size_t byte_size,
+    ElementFn element, void* buffer, TRITONSERVER_MemoryType memory_type,
+    int64_t memory_type_id, bool* cuda_used)
+{
+  *cuda_used = false;
+
+  char* dst = static_cast<char*>(buffer);
+  const bool cpu_buffer = (memory_type == TRITONSERVER_MEMORY_CPU) ||
+                          (memory_type == TRITONSERVER_MEMORY_CPU_PINNED);
+  if (!cpu_buffer) {
+    output_staging_buffer_.resize(byte_size);
+    dst = output_staging_buffer_.data();
+  }
+
+  // Gather the length prefixes and the payloads into the destination
+  // with one pass over the elements.
+  char* cur = dst;
+  for (size_t e = 0; e < element_cnt; ++e) {
+    const BytesElement str = element(e);
+    const uint32_t len = str.size;
+    memcpy(cur, &len, sizeof(uint32_t));
+    cur += sizeof(uint32_t);
+    memcpy(cur, str.data, len);
+    cur += len;
+  }
+
+  if (!cpu_buffer) {
+    RETURN_IF_ERROR(CopyBuffer(
+        name, TRITONSERVER_MEMORY_CPU /* src_memory_type */,
+        0 /* src_memory_type_id */, memory_type, memory_type_id, byte_size,
+        dst, buffer, stream_, cuda_used));
+  }
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelInstanceState::CollectInputTensor(
+    BackendInputCollector* collector, const size_t input_idx,
+    TRITONBACKEND_Request** requests, const uint32_t request_count,
+    std::vector<TRITONBACKEND_Response*>* responses, const char** buffer,
+    std::vector<size_t>* request_byte_offsets,
+    std::vector<const char*>* request_buffers, InputTensor* tensor)
+{
+  return CollectTensor(
+      collector, model_state_->Inputs()[input_idx],
+      &input_batch_buffers_[input_idx], requests, request_count, responses,
+      buffer, request_byte_offsets, request_buffers, tensor);
+}
+
+TRITONSERVER_Error*
+ModelInstanceState::CollectStateTensor(
+    BackendInputCollector* collector, const size_t state_idx,
+    TRITONBACKEND_Request** requests, const uint32_t request_count,
+    std::vector<TRITONBACKEND_Response*>* responses, const char** buffer,
+    std::vector<size_t>* request_byte_offsets,
+    std::vector<const char*>* request_buffers, InputTensor* tensor)
+{
+  return CollectTensor(
+      collector, model_state_->States()[state_idx].input,
+      &state_batch_buffers_[state_idx], requests, request_count, responses,
+      buffer, request_byte_offsets, request_buffers, tensor);
+}
+
+TRITONSERVER_Error*
+ModelInstanceState::CollectTensor(
+    BackendInputCollector* collector, const TensorConfig& config,
+    StagingBytes* batch_buffer, TRITONBACKEND_Request** requests,
+    const uint32_t request_count,
+    std::vector<TRITONBACKEND_Response*>* responses, const char** buffer,
+    std::vector<size_t>* request_byte_offsets,
+    std::vector<const char*>* request_buffers, InputTensor* tensor)
+{
+  tensor->name = config.name;
+  tensor->datatype = config.adsbrain_datatype;
+  tensor->request_shapes.resize(request_count);
+  tensor->shape.clear();
+  tensor->row_stride = 0;
+  request_byte_offsets->assign(1, 0);
+  request_buffers->clear();
+
+  // Record the shape and the byte range of the input in each request.
+  // The collector reserves the byte range of a request even if its
+  // response has already failed, so do the same here. BYTES inputs are
+  // parsed in place if every request holds its input in one CPU buffer.
+  const bool bytes = (config.adsbrain_datatype == DataType::BYTES);
+  bool in_place = bytes;
+  if (in_place) {
+    request_buffers->assign(request_count, nullptr);
+  }
+  for (uint32_t r = 0; r < request_count; ++r) {
+    auto& response = (*responses)[r];
+    TRITONBACKEND_Input* input = nullptr;
+    const int64_t* shape = nullptr;
+    uint32_t dims_count = 0;
+    uint64_t byte_size = 0;
+    uint32_t buffer_count = 0;
+    RESPOND_AND_SET_NULL_IF_ERROR(
+        &response,
+        TRITONBACKEND_RequestInput(requests[r], config.name.c_str(), &input));
+    if (input != nullptr) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response, TRITONBACKEND_InputProperties(
+                         input, nullptr, nullptr, &shape, &dims_count,
+                         &byte_size, &buffer_count));
+    }
+    if (shape != nullptr) {
+      tensor->request_shapes[r].assign(shape, shape + dims_count);
+    } else {
+      tensor->request_shapes[r].clear();
+      byte_size = 0;
+    }
+    request_byte_offsets->push_back(request_byte_offsets->back() + byte_size);
+
+    if (in_place && (response != nullptr) && (byte_size > 0)) {
+      in_place = (buffer_count == 1) &&
+                 ReadCpuBuffer(input, byte_size, &(*request_buffers)[r]);
+    }
+  }
+  if (in_place) {
+    *buffer = nullptr;
+    return nullptr;  // success
+  }
+  request_buffers->clear();
+
+  // To instruct ProcessTensor to "gather" the entire batch of input
+  // tensors into a single contiguous buffer in CPU memory, set the
+  // "allowed input types" to be the CPU ones (see tritonserver.h in
+  // the triton-inference-server/core repo for allowed memory types).
+  std::vector<std::pair<TRITONSERVER_MemoryType, int64_t>> allowed_input_types =
+      {{TRITONSERVER_MEMORY_CPU_PINNED, 0}, {TRITONSERVER_MEMORY_CPU, 0}};
+
+  size_t buffer_byte_size;
+  TRITONSERVER_MemoryType buffer_memory_type;
+  int64_t buffer_memory_type_id;
+
+  // BYTES inputs are decoded in place, let the collector manage their
+  // buffer.
+  if (bytes) {
+    RETURN_IF_ERROR(collector->ProcessTensor(
+        config.name.c_str(), nullptr /* existing_buffer */,
+        0 /* existing_buffer_byte_size */, allowed_input_types, buffer,
+        &buffer_byte_size, &buffer_memory_type, &buffer_memory_type_id));
+    return nullptr;  // success
+  }
+
+  // Numeric inputs form one batch matrix if all the requests share the
+  // same non-batch dimensions. A request contributes one row per batch
+  // element, or a single row if the model does not batch.
+  const bool batching = (model_state_->MaxBatchSize() > 0);
+  bool uniform = true;
+  bool has_rows = false;
+  std::vector<int64_t> row_dims;
+  int64_t total_rows = 0;
+  for (uint32_t r = 0; (r < request_count) && uniform; ++r) {
+    const auto& shape = tensor->request_shapes[r];
+    if (shape.empty()) {
+      continue;
+    }
+    std::vector<int64_t> dims(
+        shape.begin() + (batching ? 1 : 0), shape.end());
+    if (!has_rows) {
+      row_dims = dims;
+      has_rows = true;
+    }
+    uniform = (dims == row_dims);
+    total_rows += batching ? shape[0] : 1;
+  }
+
+  const size_t element_byte_size = DataTypeByteSize(config.adsbrain_datatype);
+  size_t capacity = request_byte_offsets->back();
+  if (uniform && has_rows) {
+    size_t row_byte_size = element_byte_size;
+    for (const auto dim : row_dims) {
+      row_byte_size *= dim;
+    }
+    size_t row_stride = row_byte_size;
+    if (model_state_->AlignNumericRows()) {
+      row_stride = ((row_byte_size + kTensorAlignment - 1) / kTensorAlignment) *
+                   kTensorAlignment;
+    }
+    tensor->shape.push_back(total_rows);
+    tensor->shape.insert(tensor->shape.end(), row_dims.begin(), row_dims.end());
+    tensor->row_stride = row_stride;
+    capacity = total_rows * row_stride;
+  }
+
+  // The collector writes the requests densely at the start of the
+  // buffer, the rows are spread to their stride in ParseInputTensor.
+  if (batch_buffer->size() < std::max<size_t>(capacity, 1)) {
+    batch_buffer->resize(std::max<size_t>(capacity, 1));
+  }
+  RETURN_IF_ERROR(collector->ProcessTensor(
+      config.name.c_str(), batch_buffer->data(), batch_buffer->size(),
+      allowed_input_types, buffer, &buffer_byte_size, &buffer_memory_type,
+      &buffer_memory_type_id));
+
+  return nullptr;  // success
+}
+
+void
+ModelInstanceState::RunPipeline(
+    const InferenceInputs& inputs, InferenceOutputs* outputs)
+{
+  const auto& stages = model_state_->Pipeline();
+  const bool batching = (model_state_->MaxBatchSize() > 0);
+
+  // The outputs of the previous stage stay alive while the next stage
+  // reads them through 'chained_inputs'.
+  InferenceInputs chained_inputs;
+  chained_inputs.request_count = inputs.request_count;
+  chained_inputs.payloads = inputs.payloads;
+  InferenceOutputs previous_outputs;
+  InferenceOutputs stage_outputs;
+
+  AdsbrainInferenceModel* model = adsbrain_model_.get();
+  const InferenceInputs* stage_inputs = &inputs;
+  for (size_t s = 0; s < stages.size(); ++s) {
+    stage_outputs = InferenceOutputs();
+    for (const auto& config : stages[s].inputs) {
+      stage_outputs.tensors.emplace_back();
+      stage_outputs.tensors.back().name = config.name;
+      stage_outputs.tensors.back().datatype = config.adsbrain_datatype;
+    }
+    model->RunTensorInference(*stage_inputs, &stage_outputs);
+
+    std::swap(previous_outputs, stage_outputs);
+    chained_inputs.tensors.resize(previous_outputs.tensors.size());
+    for (size_t t = 0; t < previous_outputs.tensors.size(); ++t) {
+      PipelineTensorView(
+          previous_outputs.tensors[t], inputs.request_count, batching,
+          &chained_inputs.tensors[t]);
+    }
+    chained_inputs.tensors.insert(
+        chained_inputs.tensors.end(), inputs.tensors.begin(),
+        inputs.tensors.end());
+
+    model = pipeline_models_[s].get();
+    stage_inputs = &chained_inputs;
+  }
+
+  model->RunTensorInference(*stage_inputs, outputs);
+}
+
+void
+ModelInstanceState::LoadModel(
+    const ModelLibrary& library, MetricsRegistry* metrics,
+    SharedAssets* assets,
+    const std::unordered_map<std::string, std::string>& configs,
+    std::unique_ptr<AdsbrainInferenceModel>* model)
+{
+  *model = library.CreateModel();
+  (*model)->InitializeMetrics(metrics);
+  (*model)->InitializeSharedAssets(assets);
+
+  const std::string& directory = model_state_->SnapshotDirectory();
+  if (directory.empty()) {
+    (*model)->Initialize(configs);
+    return;
+  }
+
+  const std::string path =
+      SnapshotPath(directory, model_state_->Name(), configs);
+  std::unique_ptr<ModelSnapshot> snapshot;
+  LOG_IF_ERROR(
+      ModelSnapshot::Map(path, &snapshot), "failed to map the model snapshot");
+  if (snapshot != nullptr) {
+    const uint64_t start_ns = NowNs();
+    bool initialized = false;
+    try {
+      initialized = (*model)->InitializeFromSnapshot(
+          configs, snapshot->Data(), snapshot->Size());
+    }
+    catch (const std::exception& ex) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_WARN,
+          (std::string("model snapshot ") + path + " is ignored: " + ex.what())
+              .c_str());
+    }
+    if (initialized) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_INFO,
+          (std::string("initialized the model from snapshot ") + path +
+           " in " + std::to_string((NowNs() - start_ns) / 1000000) + " ms")
+              .c_str());
+      snapshots_.push_back(std::move(snapshot));
+      return;
+    }
+
+    // The refused model is destroyed while the snapshot it may point
+    // into is still mapped.
+    model->reset();
+    *model = library.CreateModel();
+    (*model)->InitializeMetrics(metrics);
+    (*model)->InitializeSharedAssets(assets);
+  }
+
+  const uint64_t start_ns = NowNs();
+  (*model)->Initialize(configs);
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      (std::string("initialized the model in ") +
+       std::to_string((NowNs() - start_ns) / 1000000) + " ms")
+          .c_str());
+
+  // The snapshot is written aside and renamed once complete, so the
+  // instances loading concurrently never map a partial snapshot.
+  mkdir(directory.c_str(), 0755);
+  const std::string written_path =
+      path + ".tmp." + std::to_string(getpid()) + "." + Name();
+  bool written = false;
+  try {
+    written = (*model)->WriteSnapshot(written_path);
+  }
+  catch (const std::exception& ex) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_WARN,
+        (std::string("failed to write model snapshot ") + path + ": " +
+         ex.what())
+            .c_str());
+  }
+  if (written && (rename(written_path.c_str(), path.c_str()) == 0)) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_INFO,
+        (std::string("wrote model snapshot ") + path).c_str());
+  } else {
+    if (written) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_WARN,
+          (std::string("failed to write model snapshot ") + path + ": " +
+           strerror(errno))
+              .c_str());
+    }
+    unlink(written_path.c_str());
+  }
+}
+
+void
+ModelInstanceState::RunShards(
+    const InferenceInputs& inputs, InferenceOutputs* outputs)
+{
+  const std::vector<std::shared_ptr<ShardExecutor>> executors =
+      model_state_->Shards()->Executors();
+
+  // Every shard fills outputs laid out like 'outputs'.
+  std::vector<InferenceOutputs> shard_outputs(executors.size());
+  for (auto& shard_output : shard_outputs) {
+    for (const auto& tensor : outputs->tensors) {
+      shard_output.tensors.emplace_back();
+      shard_output.tensors.back().name = tensor.name;
+      shard_output.tensors.back().datatype = tensor.datatype;
+    }
+  }
+
+  std::vector<std::future<void>> done(executors.size());
+  std::exception_ptr error;
+  for (size_t s = 0; s < executors.size(); ++s) {
+    if (!executors[s]->Enqueue(&inputs, &shard_outputs[s], &done[s])) {
+      error = std::make_exception_ptr(std::runtime_error(
+          "shard " + std::to_string(s) + " of the model is unloading"));
+    }
+  }
+
+  // The inputs must outlive all the shards running them, even if one
+  // fails.
+  for (auto& shard_done : done) {
+    if (!shard_done.valid()) {
+      continue;
+    }
+    try {
+      shard_done.get();
+    }
+    catch (...) {
+      if (error == nullptr) {
+        error = std::current_exception();
+      }
+    }
+  }
+  if (error != nullptr) {
+    std::rethrow_exception(error);
+  }
+
+  adsbrain_model_->CombineShardOutputs(inputs, &shard_outputs, outputs);
+}
+
+bool
+ModelInstanceState::ReadCpuBuffer(
+    TRITONBACKEND_Input* input, const uint64_t byte_size, const char** buffer)
+{
+  const void* base = nullptr;
+  uint64_t buffer_byte_size = 0;
+  TRITONSERVER_MemoryType memory_type = TRITONSERVER_MEMORY_CPU;
+  int64_t memory_type_id = 0;
+  TRITONSERVER_Error* err = TRITONBACKEND_InputBuffer(
+      input, 0, &base, &buffer_byte_size, &memory_type, &memory_type_id);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+    return false;
+  }
+  if ((memory_type == TRITONSERVER_MEMORY_GPU) ||
+      (buffer_byte_size != byte_size)) {
+    return false;
+  }
+  *buffer = static_cast<const char*>(base);
+  return true;
+}
+
+void
+ModelInstanceState::ReadSequenceControls(
+    TRITONBACKEND_Request** requests, const uint32_t request_count,
+    std::vector<TRITONBACKEND_Response*>* responses,
+    std::vector<SequenceRequest>* sequences)
+{
+  sequences->assign(request_count, SequenceRequest());
+  for (uint32_t r = 0; r < request_count; ++r) {
+    auto& response = (*responses)[r];
+    SequenceRequest& sequence = (*sequences)[r];
+    RESPOND_AND_SET_NULL_IF_ERROR(
+        &response, TRITONBACKEND_RequestCorrelationId(
+                       requests[r], &sequence.correlation_id));
+    if (response != nullptr) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response, SequenceControlSet(
+                         requests[r], model_state_->SequenceStart(),
+                         &sequence.start));
+    }
+    if (response != nullptr) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response,
+          SequenceControlSet(
+              requests[r], model_state_->SequenceEnd(), &sequence.end));
+    }
+  }
+}
+
+TRITONSERVER_Error*
+ModelInstanceState::SequenceControlSet(
+    TRITONBACKEND_Request* request, const SequenceControlConfig& config,
+    bool* set)
+{
+  *set = false;
+  if (config.name.empty()) {
+    return nullptr;  // success
+  }
+
+  const void* buffer;
+  uint64_t byte_size;
+  RETURN_IF_ERROR(ReadControlInput(request, config.name, &buffer, &byte_size));
+  *set = (byte_size >= config.true_value.size()) &&
+         (memcmp(
+              buffer, config.true_value.data(), config.true_value.size()) ==
+          0);
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelInstanceState::ReadControlInput(
+    TRITONBACKEND_Request* request, const std::string& name,
+    const void** buffer, uint64_t* byte_size)
+{
+  // The control inputs are small CPU tensors, read them directly
+  // instead of through the collector.
+  TRITONBACKEND_Input* input;
+  RETURN_IF_ERROR(TRITONBACKEND_RequestInput(request, name.c_str(), &input));
+  TRITONSERVER_MemoryType memory_type = TRITONSERVER_MEMORY_CPU;
+  int64_t memory_type_id = 0;
+  RETURN_IF_ERROR(TRITONBACKEND_InputBuffer(
+      input, 0 /* idx */, buffer, byte_size, &memory_type, &memory_type_id));
+  RETURN_ERROR_IF_TRUE(
+      memory_type == TRITONSERVER_MEMORY_GPU, TRITONSERVER_ERROR_INTERNAL,
+      std::string("control input '") + name + "' is expected in CPU memory");
+
+  return nullptr;  // success
+}
+
+TRITONSERVER_Error*
+ModelInstanceState::RequestPriority(
+    TRITONBACKEND_Request* request, int64_t* priority)
+{
+  *priority = 0;
+
+  // The priority input is optional, requests without it keep the
+  // default priority.
+  uint32_t input_count;
+  RETURN_IF_ERROR(TRITONBACKEND_RequestInputCount(request, &input_count));
+  bool found = false;
+  for (uint32_t i = 0; (i < input_count) && !found; ++i) {
+    const char* name;
+    RETURN_IF_ERROR(TRITONBACKEND_RequestInputName(request, i, &name));
+    found = (model_state_->PriorityInput() == name);
+  }
+  if (!found) {
+    return nullptr;  // success
+  }
+
+  const void* buffer;
+  uint64_t byte_size;
+  RETURN_IF_ERROR(ReadControlInput(
+      request, model_state_->PriorityInput(), &buffer, &byte_size));
+  RETURN_ERROR_IF_FALSE(
+      byte_size >= sizeof(int64_t), TRITONSERVER_ERROR_INVALID_ARG,
+      std::string("priority input '") + model_state_->PriorityInput() +
+          "' must hold one value");
+  memcpy(priority, buffer, sizeof(int64_t));
+
+  return nullptr;  // success
+}
+
+void
+ModelInstanceState::PartitionRequests(
+    TRITONBACKEND_Request** requests, const uint32_t request_count,
+    const std::vector<size_t>& rows, const std::vector<int64_t>& priorities,
+    std::vector<TRITONBACKEND_Response*>* responses,
+    std::vector<std::vector<uint32_t>>* batches)
+{
+  batches->clear();
+  std::vector<uint32_t> high, low;
+  if (model_state_->PriorityInput().empty()) {
+    for (uint32_t r = 0; r < request_count; ++r) {
+      high.push_back(r);
+    }
+  } else {
+    // Priority 0 is the default priority of Triton, and lower levels
+    // are served first. Failed requests have the default priority and
+    // go with the high priority ones so they are released early.
+    for (uint32_t r = 0; r < request_count; ++r) {
+      if (priorities[r] <= model_state_->PriorityHighLevel()) {
+        high.push_back(r);
+      } else {
+        low.push_back(r);
+      }
+    }
+
+    // The reserved share of low priority requests joins the high
+    // priority batch so bulk traffic keeps moving under online load.
+    const size_t reserved = std::min<size_t>(
+        low.size(), ceil(model_state_->PriorityLowShare() * request_count));
+    high.insert(high.end(), low.begin(), low.begin() + reserved);
+    low.erase(low.begin(), low.begin() + reserved);
+  }
+
+  const bool split_rows = (batch_size_controller_ != nullptr);
+  const bool split_bytes = (model_state_->BatchMaxPayloadBytes() > 0);
+  if (!split_rows && !split_bytes) {
+    if (!high.empty()) {
+      batches->push_back(std::move(high));
+    }
+    if (!low.empty()) {
+      batches->push_back(std::move(low));
+    }
+    return;
+  }
+
+  std::vector<size_t> bytes(request_count, 0);
+  for (uint32_t r = 0; (r < request_count) && split_bytes; ++r) {
+    auto& response = (*responses)[r];
+    if (response != nullptr) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response, RequestPayloadBytes(requests[r], &bytes[r]));
+    }
+  }
+
+  // Running the small payloads first keeps a few large requests from
+  // delaying the responses of all the others in their execution.
+  if (split_bytes) {
+    const auto smaller = [&bytes](const uint32_t a, const uint32_t b) {
+      return bytes[a] < bytes[b];
+    };
+    std::stable_sort(high.begin(), high.end(), smaller);
+    std::stable_sort(low.begin(), low.end(), smaller);
+  }
+
+  const size_t row_cap = split_rows ? batch_size_controller_->Cap()
+                                    : std::numeric_limits<size_t>::max();
+  const size_t byte_cap = split_bytes ? model_state_->BatchMaxPayloadBytes()
+                                      : std::numeric_limits<size_t>::max();
+  SplitBatch(high, rows, row_cap, bytes, byte_cap, batches);
+  SplitBatch(low, rows, row_cap, bytes, byte_cap, batches);
+}
+
+void
+ModelInstanceState::SplitBatch(
+    const std::vector<uint32_t>& batch, const std::vector<size_t>& rows,
+    const size_t row_cap, const std::vector<size_t>& bytes,
+    const size_t byte_cap, std::vector<std::vector<uint32_t>>* batches)
+{
+  // A request larger than a cap is run alone.
+  size_t batch_rows = 0;
+  size_t batch_bytes = 0;
+  bool open = false;
+  for (const auto r : batch) {
+    if (!open || (batch_rows + rows[r] > row_cap) ||
+        (batch_bytes + bytes[r] > byte_cap)) {
+      batches->emplace_back();
+      batch_rows = 0;
+      batch_bytes = 0;
+      open = true;
+    }
+    batches->back().push_back(r);
+    batch_rows += rows[r];
+    batch_bytes += bytes[r];
+  }
+}
+
+TRITONSERVER_Error*
+ModelInstanceState::RequestBatchSize(
+    TRITONBACKEND_Request* request, size_t* batch_size)
 {
-  // Create a ModelState object and associate it with the
-  // TRITONBACKEND_Model. If anything goes wrong with initialization
-  // of the model state then an error is returned and Triton will fail
-  // to load the model.
-  ModelState* model_state;
-  RETURN_IF_ERROR(ModelState::Create(model, &model_state));
-  RETURN_IF_ERROR(
-      TRITONBACKEND_ModelSetState(model, reinterpret_cast<void*>(model_state)));
+  const std::string& name = model_state_->Inputs().front().name;
+  TRITONBACKEND_Input* input;
+  RETURN_IF_ERROR(TRITONBACKEND_RequestInput(request, name.c_str(), &input));
+  const int64_t* shape;
+  uint32_t dims_count;
+  RETURN_IF_ERROR(TRITONBACKEND_InputProperties(
+      input, nullptr, nullptr, &shape, &dims_count, nullptr, nullptr));
+  *batch_size = (dims_count > 0) ? shape[0] : 1;
 
   return nullptr;  // success
 }
 
-// Triton calls TRITONBACKEND_ModelFinalize when a model is no longer
-// needed. The backend should cleanup any state associated with the
-// model. This function will not be called until all model instances
-// of the model have been finalized.
-//
 TRITONSERVER_Error*
-TRITONBACKEND_ModelFinalize(TRITONBACKEND_Model* model)
+ModelInstanceState::RequestPayloadBytes(
+    TRITONBACKEND_Request* request, size_t* byte_size)
 {
-  void* vstate;
-  RETURN_IF_ERROR(TRITONBACKEND_ModelState(model, &vstate));
-  ModelState* model_state = reinterpret_cast<ModelState*>(vstate);
-  delete model_state;
+  *byte_size = 0;
+  for (const auto& config : model_state_->Inputs()) {
+    TRITONBACKEND_Input* input;
+    RETURN_IF_ERROR(
+        TRITONBACKEND_RequestInput(request, config.name.c_str(), &input));
+    uint64_t input_byte_size;
+    RETURN_IF_ERROR(TRITONBACKEND_InputProperties(
+        input, nullptr, nullptr, nullptr, nullptr, &input_byte_size,
+        nullptr));
+    *byte_size += input_byte_size;
+  }
 
   return nullptr;  // success
 }
 
-}  // extern "C"
+void
+ModelInstanceState::ShedRequests(
+    TRITONBACKEND_Request** requests, const uint32_t request_count,
+    std::vector<TRITONBACKEND_Response*>* responses,
+    std::vector<size_t>* rows, std::vector<int64_t>* priorities,
+    std::vector<bool>* shed)
+{
+  shed->assign(request_count, false);
+  rows->assign(request_count, 0);
+  priorities->assign(request_count, 0);
+  const uint64_t budget_ns = model_state_->ShedLatencyBudgetNs();
+  const bool shed_enabled =
+      (budget_ns != 0) && (row_time_ns_ > 0) && (request_count >= 2);
+
+  // The batch sizes are only read when the shedding or the batch size
+  // controller needs them. Requests that already failed take no time
+  // and are never shed.
+  const bool read_rows = (model_state_->MaxBatchSize() > 0) &&
+                         (shed_enabled || (batch_size_controller_ != nullptr));
+  size_t total_rows = 0;
+  for (uint32_t r = 0; r < request_count; ++r) {
+    auto& response = (*responses)[r];
+    if (response == nullptr) {
+      continue;
+    }
+    (*rows)[r] = 1;
+    if (read_rows) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response, RequestBatchSize(requests[r], &(*rows)[r]));
+    }
+    if ((response != nullptr) && !model_state_->PriorityInput().empty()) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response, RequestPriority(requests[r], &(*priorities)[r]));
+    }
+    total_rows = (response != nullptr) ? total_rows + (*rows)[r] : total_rows;
+  }
+  if (!shed_enabled) {
+    return;
+  }
 
-/////////////
+  const size_t max_rows = std::max<size_t>(budget_ns / row_time_ns_, 1);
+  if (total_rows <= max_rows) {
+    if (shedding_) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_INFO,
+          (std::string("model instance ") + Name() + ": stopped shedding, " +
+           std::to_string(episode_shed_count_) + " requests shed, " +
+           std::to_string(shed_count_) + " in total")
+              .c_str());
+      shedding_ = false;
+    }
+    return;
+  }
 
-typedef std::unique_ptr<triton::backend::adsbrain::AdsbrainInferenceModel> (
-    *createAdsbrainInferenceModel)();
+  // Admit the requests in priority order, then in arrival order, until
+  // the budget is used.
+  std::vector<uint32_t> order;
+  for (uint32_t r = 0; r < request_count; ++r) {
+    if ((*responses)[r] != nullptr) {
+      order.push_back(r);
+    }
+  }
+  std::stable_sort(
+      order.begin(), order.end(),
+      [priorities](const uint32_t a, const uint32_t b) {
+        return (*priorities)[a] < (*priorities)[b];
+      });
 
-//
-// ModelInstanceState
-//
-// State associated with a model instance. An object of this class is
-// created and associated with each
-// TRITONBACKEND_ModelInstance. ModelInstanceState is derived from
-// BackendModelInstance class provided in the backend utilities that
-// provides many common functions.
-//
-class ModelInstanceState : public BackendModelInstance {
- public:
-  static TRITONSERVER_Error* Create(
-      ModelState* model_state,
-      TRITONBACKEND_ModelInstance* triton_model_instance,
-      ModelInstanceState** state);
-  virtual ~ModelInstanceState() { dlclose(model_lib_handle_); }
+  if (!shedding_) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_WARN,
+        (std::string("model instance ") + Name() +
+         ": overloaded, shedding requests beyond " + std::to_string(max_rows) +
+         " rows per execution")
+            .c_str());
+    shedding_ = true;
+    episode_shed_count_ = 0;
+  }
 
-  // Get the state of the model that corresponds to this instance.
-  ModelState* StateForModel() const { return model_state_; }
+  // Once a request does not fit, all the following ones are shed so
+  // lower priority requests never overtake it.
+  size_t admitted_rows = 0;
+  bool full = false;
+  for (size_t i = 0; i < order.size(); ++i) {
+    const uint32_t r = order[i];
+    admitted_rows += (*rows)[r];
+    full |= ((i > 0) && (admitted_rows > max_rows));
+    if (!full) {
+      continue;
+    }
+    (*shed)[r] = true;
+    ++shed_count_;
+    ++episode_shed_count_;
+    metrics_.Increment(InstanceMetric::SHED_REQUESTS, 1);
+    RESPOND_AND_SET_NULL_IF_ERROR(
+        &(*responses)[r],
+        TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_UNAVAILABLE,
+            (std::string("model instance ") + Name() +
+             " is overloaded, retry later")
+                .c_str()));
+  }
+}
 
-  std::vector<std::string> RunInference(
-      const std::vector<std::string>& requests)
-  {
-    return adsbrain_model_->RunInference(requests);
+void
+ModelInstanceState::ObserveBatch(
+    const size_t rows, const uint64_t compute_ns, const uint64_t batch_ns)
+{
+  static constexpr double kRowTimeDecay = 0.9;
+  if ((model_state_->ShedLatencyBudgetNs() > 0) && (rows > 0)) {
+    const double row_time_ns = static_cast<double>(batch_ns) / rows;
+    row_time_ns_ = (row_time_ns_ <= 0) ? row_time_ns
+                                       : kRowTimeDecay * row_time_ns_ +
+                                             (1 - kRowTimeDecay) * row_time_ns;
   }
 
-  bool SetStringOutputBuffer(
-      const std::string& name, const char* content, const size_t* offsets,
-      std::vector<int64_t>* batchn_shape, TRITONBACKEND_Request** requests,
-      const uint32_t request_count,
-      std::vector<TRITONBACKEND_Response*>* responses);
+  if (batch_size_controller_ == nullptr) {
+    return;
+  }
+  const bool cap_changed = batch_size_controller_->Observe(rows, compute_ns);
+  metrics_.Set(InstanceMetric::BATCH_SIZE_CAP, batch_size_controller_->Cap());
+  metrics_.Set(
+      InstanceMetric::BATCH_OVERHEAD_US,
+      batch_size_controller_->OverheadNs() / 1000.0);
+  metrics_.Set(
+      InstanceMetric::BATCH_ROW_COST_US,
+      batch_size_controller_->RowCostNs() / 1000.0);
+  if (!cap_changed) {
+    return;
+  }
 
-  bool SetStringStateBuffer(
-      const std::string& name, const char* content, const size_t* offsets,
-      std::vector<int64_t>* batchn_shape, TRITONBACKEND_Request** requests,
-      const uint32_t request_count,
-      std::vector<TRITONBACKEND_Response*>* responses);
+  if (TRITONSERVER_LogIsEnabled(TRITONSERVER_LOG_VERBOSE)) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_VERBOSE,
+        (std::string("model instance ") + Name() + ": batch size cap " +
+         std::to_string(batch_size_controller_->Cap()) + ", overhead " +
+         std::to_string(batch_size_controller_->OverheadNs() / 1000) +
+         " us, " + std::to_string(batch_size_controller_->RowCostNs() / 1000) +
+         " us per row, target " +
+         std::to_string(batch_size_controller_->TargetNs() / 1000) + " us")
+            .c_str());
+  }
+}
 
-  bool SetStringBuffer(
-      const std::string& name, const char* content, const size_t* offsets,
-      std::vector<int64_t>* batchn_shape, TRITONBACKEND_Request** requests,
-      const uint32_t request_count,
-      std::vector<TRITONBACKEND_Response*>* responses, bool state);
+void
+ModelInstanceState::CaptureBatch(
+    const InputTensor& tensor, const uint64_t exec_start_ns)
+{
+  RequestCapture* capture = model_state_->Capture();
+  const size_t request_count = tensor.request_shapes.size();
+  capture_buffer_.clear();
+  AppendCaptureValue<uint64_t>(
+      &capture_buffer_, capture->CaptureTimeNs(exec_start_ns));
+  AppendCaptureValue<uint32_t>(&capture_buffer_, request_count);
+  for (size_t r = 0; r < request_count; ++r) {
+    const auto& shape = tensor.request_shapes[r];
+    AppendCaptureValue<uint32_t>(&capture_buffer_, shape.size());
+    for (const auto dim : shape) {
+      AppendCaptureValue<int64_t>(&capture_buffer_, dim);
+    }
+    // Failed requests have no elements, they are captured with the
+    // elements of their shape left empty.
+    const size_t element_cnt = GetElementCount(shape);
+    const size_t begin = tensor.request_offsets[r];
+    const size_t end = tensor.request_offsets[r + 1];
+    for (size_t e = 0; e < element_cnt; ++e) {
+      if (begin + e < end) {
+        const BytesElement& element = tensor.elements[begin + e];
+        AppendCaptureString(&capture_buffer_, element.data, element.size);
+      } else {
+        AppendCaptureString(&capture_buffer_, "", 0);
+      }
+    }
+  }
+  capture->Write(capture_buffer_);
+}
 
-  TRITONSERVER_Error* SetResponses(
-      const std::vector<std::string>& response_data,
-      const std::vector<TRITONBACKEND_Response*>& responses,
-      const std::string& output_name, bool* cuda_copy);
+void
+ModelInstanceState::ParseInputTensor(
+    const char* buffer, const std::vector<size_t>& request_byte_offsets,
+    const std::vector<const char*>& request_buffers,
+    const uint32_t request_count,
+    std::vector<TRITONBACKEND_Response*>* responses, InputTensor* tensor)
+{
+  tensor->request_offsets.assign(1, 0);
+  tensor->elements.clear();
+  tensor->data = buffer;
+  tensor->byte_size = request_byte_offsets.back();
+
+  const size_t element_byte_size = DataTypeByteSize(tensor->datatype);
+  if ((tensor->datatype != DataType::BYTES) && !tensor->shape.empty()) {
+    const size_t rows = tensor->shape[0];
+    size_t row_byte_size = element_byte_size;
+    for (size_t d = 1; d < tensor->shape.size(); ++d) {
+      row_byte_size *= tensor->shape[d];
+    }
+    tensor->byte_size = rows * tensor->row_stride;
+
+    // Spread the dense rows to their padded stride, starting from the
+    // last row so that no row is overwritten before it is moved.
+    if (tensor->row_stride > row_byte_size) {
+      char* base = const_cast<char*>(buffer);
+      for (size_t row = rows; row-- > 0;) {
+        char* dst = base + row * tensor->row_stride;
+        memmove(dst, base + row * row_byte_size, row_byte_size);
+        memset(dst + row_byte_size, 0, tensor->row_stride - row_byte_size);
+      }
+    }
+  }
 
- private:
-  ModelInstanceState(
-      ModelState* model_state,
-      TRITONBACKEND_ModelInstance* triton_model_instance)
-      : BackendModelInstance(model_state, triton_model_instance),
-        model_state_(model_state)
-  {
-    auto adsbrain_model_configurations = model_state_->GetModelConfig();
+  for (uint32_t r = 0; r < request_count; ++r) {
+    auto& response = (*responses)[r];
+    const size_t element_cnt = GetElementCount(tensor->request_shapes[r]);
+    const size_t byte_size =
+        request_byte_offsets[r + 1] - request_byte_offsets[r];
+
+    TRITONSERVER_Error* err = nullptr;
+    if (tensor->datatype == DataType::BYTES) {
+      // Decode the length-prefixed elements of the request in place.
+      // Failed requests are skipped, requests that failed before their
+      // input was read have no buffer.
+      const char* cur = request_buffers.empty()
+                            ? (buffer + request_byte_offsets[r])
+                            : request_buffers[r];
+      const char* end = (cur != nullptr) ? (cur + byte_size) : cur;
+      size_t parsed_cnt = 0;
+      while ((response != nullptr) && (parsed_cnt < element_cnt) &&
+             (cur + sizeof(uint32_t) <= end)) {
+        uint32_t len;
+        memcpy(&len, cur, sizeof(uint32_t));
+        cur += sizeof(uint32_t);
+        if (len > static_cast<size_t>(end - cur)) {
+          break;
+        }
+        tensor->elements.push_back(BytesElement{cur, len});
+        cur += len;
+        ++parsed_cnt;
+      }
+      if ((response != nullptr) &&
+          ((parsed_cnt != element_cnt) || (cur != end))) {
+        tensor->elements.resize(tensor->request_offsets.back());
+        err = TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_INVALID_ARG,
+            (std::string("input '") + tensor->name + "' expected " +
+             std::to_string(element_cnt) + " strings in " +
+             std::to_string(byte_size) + " bytes")
+                .c_str());
+      }
+      tensor->request_offsets.push_back(tensor->elements.size());
+    } else {
+      if (element_cnt * element_byte_size != byte_size) {
+        err = TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_INVALID_ARG,
+            (std::string("input '") + tensor->name + "' expected " +
+             std::to_string(element_cnt * element_byte_size) +
+             " bytes, got " + std::to_string(byte_size))
+                .c_str());
+      }
+      // Every request keeps its place in the numeric data, failed ones
+      // included, so the offsets always follow the request shapes.
+      tensor->request_offsets.push_back(
+          tensor->request_offsets.back() + element_cnt);
+    }
 
-    model_lib_handle_ = dlopen(
-        adsbrain_model_configurations["model_lib_path"].c_str(), RTLD_NOW);
-    if (!model_lib_handle_) {
-      throw std::invalid_argument(
-          "Cannot open library: " + std::string(dlerror()));
+    RESPOND_AND_SET_NULL_IF_ERROR(&response, err);
+  }
+}
+
+void
+ModelInstanceState::DecompressInputTensor(
+    const size_t input_idx, size_t* batch_byte_size,
+    std::vector<TRITONBACKEND_Response*>* responses, InputTensor* tensor)
+{
+  // Size the scratch buffer for the whole batch first so the views of
+  // the decompressed elements stay valid.
+  std::vector<PayloadCodec> codecs(tensor->elements.size());
+  std::vector<size_t> sizes(tensor->elements.size(), 0);
+  const size_t max_batch_byte_size =
+      model_state_->PayloadMaxBatchUncompressedBytes();
+  size_t total_byte_size = 0;
+  for (size_t r = 0; r < tensor->request_offsets.size() - 1; ++r) {
+    auto& response = (*responses)[r];
+    size_t request_byte_size = 0;
+    for (size_t e = tensor->request_offsets[r];
+         e < tensor->request_offsets[r + 1]; ++e) {
+      BytesElement data{tensor->elements[e].data, 0};
+      if (response != nullptr) {
+        RESPOND_AND_SET_NULL_IF_ERROR(
+            &response,
+            PayloadCompressor::ParseHeader(
+                tensor->elements[e],
+                model_state_->PayloadMaxUncompressedBytes(), &codecs[e],
+                &sizes[e], &data));
+      }
+      if (response == nullptr) {
+        sizes[e] = 0;
+      }
+      tensor->elements[e] = data;
+      // Uncompressed data is used in place, without the scratch buffer.
+      if (codecs[e] != PayloadCodec::NONE) {
+        request_byte_size += sizes[e];
+      }
     }
 
-    const char* func_name = "CreateInferenceModel";
-    createAdsbrainInferenceModel create_model_func_ =
-        (createAdsbrainInferenceModel)dlsym(model_lib_handle_, func_name);
-    if (!create_model_func_) {
-      throw std::invalid_argument(
-          "Cannot load symbol CreateInferenceModel: " + std::string(dlerror()));
+    // Every element is bounded by PayloadMaxUncompressedBytes(), but a
+    // batch of many elements could still reserve any size.
+    if (response == nullptr) {
+      request_byte_size = 0;
+    } else if (
+        *batch_byte_size + total_byte_size + request_byte_size >
+        max_batch_byte_size) {
+      // A request that fits the limit alone can succeed in a smaller
+      // batch, so it is failed with a retryable error.
+      const bool fits_alone = (request_byte_size <= max_batch_byte_size);
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response,
+          TRITONSERVER_ErrorNew(
+              fits_alone ? TRITONSERVER_ERROR_UNAVAILABLE
+                         : TRITONSERVER_ERROR_INVALID_ARG,
+              (std::string("compressed payloads of ") +
+               std::to_string(request_byte_size) +
+               " bytes exceed what is left of "
+               "payload_max_batch_uncompressed_bytes (" +
+               std::to_string(max_batch_byte_size) + ") in the batch")
+                  .c_str()));
+      for (size_t e = tensor->request_offsets[r];
+           e < tensor->request_offsets[r + 1]; ++e) {
+        sizes[e] = 0;
+        tensor->elements[e].size = 0;
+      }
+      request_byte_size = 0;
     }
+    total_byte_size += request_byte_size;
+  }
+  *batch_byte_size += total_byte_size;
 
-    adsbrain_model_ = (*create_model_func_)();
-    adsbrain_model_->Initialize(adsbrain_model_configurations);
+  StagingBytes& scratch = decompression_buffers_[input_idx];
+  if (scratch.size() < total_byte_size) {
+    scratch.resize(total_byte_size);
   }
 
-  ModelState* model_state_;
-  std::unique_ptr<AdsbrainInferenceModel> adsbrain_model_;
-  void* model_lib_handle_;
-};
+  char* dst = scratch.data();
+  for (size_t r = 0; r < tensor->request_offsets.size() - 1; ++r) {
+    auto& response = (*responses)[r];
+    for (size_t e = tensor->request_offsets[r];
+         (e < tensor->request_offsets[r + 1]) && (response != nullptr); ++e) {
+      if (codecs[e] == PayloadCodec::NONE) {
+        // Uncompressed data is used in place.
+        continue;
+      }
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response, payload_compressor_.Decompress(
+                         codecs[e], tensor->elements[e], dst, sizes[e]));
+      if (response != nullptr) {
+        tensor->elements[e] = BytesElement{dst, sizes[e]};
+      }
+      dst += sizes[e];
+    }
+  }
+}
 
 TRITONSERVER_Error*
-ModelInstanceState::Create(
-    ModelState* model_state, TRITONBACKEND_ModelInstance* triton_model_instance,
-    ModelInstanceState** state)
+ModelInstanceState::CompressStrings(
+    const std::vector<std::string>& strings, std::vector<BytesElement>* records)
 {
-  try {
-    *state = new ModelInstanceState(model_state, triton_model_instance);
+  const PayloadCodec codec = model_state_->ResponseCodec();
+  const size_t min_bytes = model_state_->ResponseCompressionMinBytes();
+  size_t bound = 0;
+  for (const auto& str : strings) {
+    bound += PayloadCompressor::RecordBound(
+        (str.size() < min_bytes) ? PayloadCodec::NONE : codec, str.size());
   }
-  catch (const BackendModelInstanceException& ex) {
-    RETURN_ERROR_IF_TRUE(
-        ex.err_ == nullptr, TRITONSERVER_ERROR_INTERNAL,
-        std::string("unexpected nullptr in BackendModelInstanceException"));
-    RETURN_IF_ERROR(ex.err_);
+  if (compression_buffer_.size() < bound) {
+    compression_buffer_.resize(bound);
+  }
+
+  records->clear();
+  records->reserve(strings.size());
+  char* dst = compression_buffer_.data();
+  for (const auto& str : strings) {
+    size_t record_size;
+    RETURN_IF_ERROR(payload_compressor_.Compress(
+        (str.size() < min_bytes) ? PayloadCodec::NONE : codec,
+        BytesElement{str.data(), str.size()}, dst, &record_size));
+    records->push_back(BytesElement{dst, record_size});
+    dst += record_size;
   }
 
   return nullptr;  // success
 }
 
-bool
-ModelInstanceState::SetStringStateBuffer(
-    const std::string& name, const char* content, const size_t* offsets,
-    std::vector<int64_t>* batchn_shape, TRITONBACKEND_Request** requests,
-    const uint32_t request_count,
-    std::vector<TRITONBACKEND_Response*>* responses)
+void
+ModelInstanceState::DecodePayloads(
+    InferenceInputs* inputs, std::vector<TRITONBACKEND_Response*>* responses)
 {
-  return SetStringBuffer(
-      name, content, offsets, batchn_shape, requests, request_count, responses,
-      true /* state */);
-}
+  if (payload_decoder_ == nullptr) {
+    return;
+  }
 
-// TODO: we assume 1) the model only has one output; 2) the output is in the
-// shape of [1]
-TRITONSERVER_Error*
-ModelInstanceState::SetResponses(
-    const std::vector<std::string>& response_data,
-    const std::vector<TRITONBACKEND_Response*>& responses,
-    const std::string& output_name, bool* cuda_copy)
-{
-  *cuda_copy = false;
-  TRITONSERVER_Error* err;
-  std::vector<int64_t> shape = {1};
-  for (size_t i = 0; i < responses.size(); ++i) {
-    auto& response = responses[i];
-    const std::string& data_str = response_data[i];
-    TRITONBACKEND_Output* response_output;
-    err = TRITONBACKEND_ResponseOutput(
-        response, &response_output, output_name.c_str(),
-        TRITONSERVER_TYPE_BYTES, shape.data(), shape.size());
-    if (err != nullptr) {
-      return err;
-    }
-    TRITONSERVER_MemoryType actual_memory_type = TRITONSERVER_MEMORY_CPU_PINNED;
-    int64_t actual_memory_type_id = 0;
-    void* buffer;
-    err = TRITONBACKEND_OutputBuffer(
-        response_output, &buffer, data_str.size() + sizeof(uint32_t),
-        &actual_memory_type, &actual_memory_type_id);
-    if (err != nullptr) {
-      return err;
-    }
-    bool cuda_used = false;
-    size_t copied_byte_size = 0;
-    // Copy the data length
-    const uint32_t len = data_str.size();
-    err = CopyBuffer(
-        output_name, TRITONSERVER_MEMORY_CPU /* src_memory_type */,
-        0 /* src_memory_type_id */, actual_memory_type, actual_memory_type_id,
-        sizeof(uint32_t), static_cast<const void*>(&len),
-        static_cast<char*>(buffer) + copied_byte_size, stream_, &cuda_used);
-    if (err != nullptr) {
-      return err;
-    }
-    *cuda_copy |= cuda_used;
-    copied_byte_size += sizeof(uint32_t);
-    // Copy raw string content
-    err = CopyBuffer(
-        output_name, TRITONSERVER_MEMORY_CPU /* src_memory_type */,
-        0 /* src_memory_type_id */, actual_memory_type, actual_memory_type_id,
-        len, static_cast<const void*>(data_str.c_str()),
-        static_cast<char*>(buffer) + copied_byte_size, stream_, &cuda_used);
-    if (err != nullptr) {
-      return err;
+  const InputTensor& input =
+      inputs->tensors[model_state_->PayloadDecoding().input_idx];
+  payload_decoder_->Reset(
+      input.name, input.elements.size(), &inputs->payloads);
+
+  for (size_t r = 0; r < inputs->request_count; ++r) {
+    auto& response = (*responses)[r];
+    for (size_t e = input.request_offsets[r];
+         (e < input.request_offsets[r + 1]) && (response != nullptr); ++e) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response,
+          payload_decoder_->Decode(input.elements[e], e, &inputs->payloads));
     }
-
-    *cuda_copy |= cuda_used;
-    copied_byte_size += len;
   }
-
-  return nullptr;
 }
 
-bool
-ModelInstanceState::SetStringOutputBuffer(
-    const std::string& name, const char* content, const size_t* offsets,
-    std::vector<int64_t>* batchn_shape, TRITONBACKEND_Request** requests,
-    const uint32_t request_count,
-    std::vector<TRITONBACKEND_Response*>* responses)
+TRITONSERVER_Error*
+ModelInstanceState::SetOutputTensor(
+    const OutputTensor& tensor, const TensorConfig& config,
+    const std::vector<int64_t>& request_batch_sizes,
+    TRITONBACKEND_Request** requests,
+    std::vector<TRITONBACKEND_Response*>* responses, const bool state,
+    bool* cuda_copy)
 {
-  return SetStringBuffer(
-      name, content, offsets, batchn_shape, requests, request_count, responses,
-      false /* state */);
-}
+  const size_t request_count = responses->size();
+  if (!tensor.shapes.empty() && (tensor.shapes.size() != request_count)) {
+    metrics_.Increment(InstanceMetric::OUTPUT_MISMATCHES, 1);
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        (std::string("model set ") + std::to_string(tensor.shapes.size()) +
+         " shapes for output '" + tensor.name + "', expected " +
+         std::to_string(request_count))
+            .c_str());
+  }
 
-bool
-ModelInstanceState::SetStringBuffer(
-    const std::string& name, const char* content, const size_t* offsets,
-    std::vector<int64_t>* batchn_shape, TRITONBACKEND_Request** requests,
-    const uint32_t request_count,
-    std::vector<TRITONBACKEND_Response*>* responses, bool state)
-{
-  size_t element_idx = 0;
-  bool cuda_copy = false;
-  for (size_t ridx = 0; ridx < request_count; ++ridx) {
-    const auto& request = requests[ridx];
-    auto& response = (*responses)[ridx];
-
-    // batchn_shape holds the shape of the entire tensor batch. When
-    // batching is enabled override the first batch dimension with each
-    // requests batch size (reusing for efficiency).
-    if (model_state_->MaxBatchSize() > 0) {
-      TRITONBACKEND_Input* input;
-      TRITONBACKEND_RequestInputByIndex(request, 0 /* index */, &input);
-      const int64_t* shape;
-      TRITONBACKEND_InputProperties(
-          input, nullptr, nullptr, &shape, nullptr, nullptr, nullptr);
-      (*batchn_shape)[0] = shape[0];
-    }
-
-    const size_t expected_element_cnt = GetElementCount(*batchn_shape);
-
-    // If 'request' requested this output then copy it from
-    // 'content'. If it did not request this output then just skip it
-    // in the 'content'.
-    bool need_output = false;
-    if (!state) {
-      if (response != nullptr) {
-        uint32_t output_count;
-        RESPOND_AND_SET_NULL_IF_ERROR(
-            &response,
-            TRITONBACKEND_RequestOutputCount(request, &output_count));
-        if (response != nullptr) {
-          for (uint32_t output_idx = 0; output_idx < output_count;
-               output_idx++) {
-            const char* req_output_name;
-            RESPOND_AND_SET_NULL_IF_ERROR(
-                &response, TRITONBACKEND_RequestOutputName(
-                               request, output_idx, &req_output_name));
-            if ((response != nullptr) && (req_output_name == name)) {
-              need_output = true;
-              break;
-            }
-          }
-        }
+  // Resolve the shape of the output in each response and check that
+  // the model produced exactly the number of elements they hold.
+  std::vector<std::vector<int64_t>> shapes;
+  if (tensor.shapes.empty()) {
+    for (const auto dim : config.dims) {
+      RETURN_ERROR_IF_TRUE(
+          dim < 0, TRITONSERVER_ERROR_INTERNAL,
+          std::string("model must set the shapes of output '") + tensor.name +
+              "' which has variable-size dimensions");
+    }
+    shapes.reserve(request_count);
+    for (size_t r = 0; r < request_count; ++r) {
+      shapes.emplace_back();
+      if (model_state_->MaxBatchSize() > 0) {
+        shapes.back().push_back(request_batch_sizes[r]);
       }
-    } else {
-      // need_output must be always set to true for state tensors.
-      need_output = true;
+      shapes.back().insert(
+          shapes.back().end(), config.dims.begin(), config.dims.end());
     }
+  }
+  const std::vector<std::vector<int64_t>>& output_shapes =
+      tensor.shapes.empty() ? shapes : tensor.shapes;
+
+  size_t total_element_cnt = 0;
+  for (const auto& shape : output_shapes) {
+    total_element_cnt += GetElementCount(shape);
+  }
+  const size_t element_byte_size = DataTypeByteSize(tensor.datatype);
+  const size_t produced_element_cnt =
+      (tensor.datatype == DataType::BYTES)
+          ? tensor.strings.size()
+          : tensor.data.size() / element_byte_size;
+  if (total_element_cnt != produced_element_cnt) {
+    metrics_.Increment(InstanceMetric::OUTPUT_MISMATCHES, 1);
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        (std::string("Model inference expected ") +
+         std::to_string(total_element_cnt) + " elements for output '" +
+         tensor.name + "', but got " + std::to_string(produced_element_cnt))
+            .c_str());
+  }
+
+  // Compress the strings up front so the size of each response is
+  // known before its output is allocated. States are kept as produced
+  // by the model.
+  std::vector<BytesElement> records;
+  const bool compressed = !state && (tensor.datatype == DataType::BYTES) &&
+                          (model_state_->ResponseCodec() != PayloadCodec::NONE);
+  if (compressed) {
+    RETURN_IF_ERROR(CompressStrings(tensor.strings, &records));
+  }
 
-    if (need_output) {
+  size_t element_idx = 0;
+  size_t output_bytes = 0;
+  for (size_t r = 0; r < request_count; ++r) {
+    auto& response = (*responses)[r];
+    const auto& shape = output_shapes[r];
+    const size_t element_cnt = GetElementCount(shape);
+    if (response != nullptr) {
+      TRITONBACKEND_Output* response_output = nullptr;
+      TRITONBACKEND_State* response_state = nullptr;
       TRITONSERVER_Error* err;
-      TRITONBACKEND_Output* response_output;
-      TRITONBACKEND_State* response_state;
       if (!state) {
         err = TRITONBACKEND_ResponseOutput(
-            response, &response_output, name.c_str(), TRITONSERVER_TYPE_BYTES,
-            batchn_shape->data(), batchn_shape->size());
+            response, &response_output, tensor.name.c_str(), config.datatype,
+            shape.data(), shape.size());
       } else {
         err = TRITONBACKEND_StateNew(
-            &response_state, request, name.c_str(), TRITONSERVER_TYPE_BYTES,
-            batchn_shape->data(), batchn_shape->size());
+            &response_state, requests[r], tensor.name.c_str(),
+            config.datatype, shape.data(), shape.size());
+      }
+
+      // Compute the serialized size of the response up front so the
+      // whole output is allocated at once and filled in place.
+      size_t byte_size = element_cnt * element_byte_size;
+      if (tensor.datatype == DataType::BYTES) {
+        byte_size = sizeof(uint32_t) * element_cnt;
+        for (size_t e = 0; e < element_cnt; ++e) {
+          byte_size += compressed ? records[element_idx + e].size
+                                  : tensor.strings[element_idx + e].size();
+        }
+      }
+
+      TRITONSERVER_MemoryType actual_memory_type =
+          TRITONSERVER_MEMORY_CPU_PINNED;
+      int64_t actual_memory_type_id = 0;
+      void* buffer;
+      if ((err == nullptr) && !state) {
+        err = TRITONBACKEND_OutputBuffer(
+            response_output, &buffer, byte_size, &actual_memory_type,
+            &actual_memory_type_id);
+      } else if (err == nullptr) {
+        err = TRITONBACKEND_StateBuffer(
+            response_state, &buffer, byte_size, &actual_memory_type,
+            &actual_memory_type_id);
       }
       if (err == nullptr) {
-        // Calculate expected byte size in advance using string offsets
-        const size_t data_byte_size =
-            offsets[element_idx + expected_element_cnt] - offsets[element_idx];
-        const size_t expected_byte_size =
-            data_byte_size + sizeof(uint32_t) * expected_element_cnt;
-
-        TRITONSERVER_MemoryType actual_memory_type =
-            TRITONSERVER_MEMORY_CPU_PINNED;
-        int64_t actual_memory_type_id = 0;
-        void* buffer;
-        if (!state) {
-          err = TRITONBACKEND_OutputBuffer(
-              response_output, &buffer, expected_byte_size, &actual_memory_type,
-              &actual_memory_type_id);
+        bool cuda_used = false;
+        if (compressed) {
+          const BytesElement* request_records = records.data() + element_idx;
+          err = WriteStringElements(
+              tensor.name, element_cnt, byte_size,
+              [request_records](size_t e) { return request_records[e]; },
+              buffer, actual_memory_type, actual_memory_type_id, &cuda_used);
+        } else if (tensor.datatype == DataType::BYTES) {
+          const std::string* strings = tensor.strings.data() + element_idx;
+          err = WriteStringElements(
+              tensor.name, element_cnt, byte_size,
+              [strings](size_t e) {
+                return BytesElement{strings[e].data(), strings[e].size()};
+              },
+              buffer, actual_memory_type, actual_memory_type_id, &cuda_used);
         } else {
-          err = TRITONBACKEND_StateBuffer(
-              response_state, &buffer, expected_byte_size, &actual_memory_type,
-              &actual_memory_type_id);
-        }
-        if (err == nullptr) {
-          bool cuda_used = false;
-          size_t copied_byte_size = 0;
-          for (size_t e = 0; e < expected_element_cnt; ++e) {
-            const uint32_t len =
-                offsets[element_idx + e + 1] - offsets[element_idx + e];
-            // // Prepend size of the string
-            err = CopyBuffer(
-                name, TRITONSERVER_MEMORY_CPU /* src_memory_type */,
-                0 /* src_memory_type_id */, actual_memory_type,
-                actual_memory_type_id, sizeof(uint32_t),
-                static_cast<const void*>(&len),
-                static_cast<char*>(buffer) + copied_byte_size, stream_,
-                &cuda_used);
-            if (err != nullptr) {
-              break;
-            }
-
-            cuda_copy |= cuda_used;
-            copied_byte_size += sizeof(uint32_t);
-
-            // Copy raw string content
-            err = CopyBuffer(
-                name, TRITONSERVER_MEMORY_CPU /* src_memory_type */,
-                0 /* src_memory_type_id */, actual_memory_type,
-                actual_memory_type_id, len, content + offsets[element_idx + e],
-                static_cast<char*>(buffer) + copied_byte_size, stream_,
-                &cuda_used);
-            if (err != nullptr) {
-              break;
-            }
-
-            cuda_copy |= cuda_used;
-            copied_byte_size += len;
-          }
+          err = CopyBuffer(
+              tensor.name, TRITONSERVER_MEMORY_CPU /* src_memory_type */,
+              0 /* src_memory_type_id */, actual_memory_type,
+              actual_memory_type_id, byte_size,
+              tensor.data.data() + element_idx * element_byte_size, buffer,
+              stream_, &cuda_used);
         }
+        *cuda_copy |= cuda_used;
+      }
+      if ((err == nullptr) && state) {
+        err = TRITONBACKEND_StateUpdate(response_state);
+      }
+      if ((err == nullptr) && !state) {
+        output_bytes += byte_size;
       }
 
       RESPOND_AND_SET_NULL_IF_ERROR(&response, err);
-      if (state) {
-        RESPOND_AND_SET_NULL_IF_ERROR(
-            &response, TRITONBACKEND_StateUpdate(response_state));
-      }
     }
 
-    element_idx += expected_element_cnt;
+    element_idx += element_cnt;
   }
+  metrics_.Increment(InstanceMetric::OUTPUT_BYTES, output_bytes);
 
-  return cuda_copy;
+  return nullptr;  // success
 }
 
 extern "C" {
@@ -783,80 +6381,149 @@ TRITONBACKEND_ModelInstanceFinalize(TRITONBACKEND_ModelInstance* instance)
 
 /////////////
 
-extern "C" {
-
-// When Triton calls TRITONBACKEND_ModelInstanceExecute it is required
-// that a backend create a response for each request in the batch. A
-// response may be the output tensors required for that request or may
-// be an error that is returned in the response.
 //
-TRITONSERVER_Error*
-TRITONBACKEND_ModelInstanceExecute(
-    TRITONBACKEND_ModelInstance* instance, TRITONBACKEND_Request** requests,
-    const uint32_t request_count)
-{
-  // Collect various timestamps during the execution of this batch or
-  // requests. These values are reported below before returning from
-  // the function.
+// DecoupledResponseSender
+//
+// Sends the partial responses of a decoupled model. Each partial
+// response is created from the response factory of its request; the
+// final response of each request is kept in 'responses' and sent by
+// TRITONBACKEND_ModelInstanceExecute once the model returns.
+//
+class DecoupledResponseSender : public ResponseSender {
+ public:
+  DecoupledResponseSender(
+      ModelInstanceState* instance_state, TRITONBACKEND_Request** requests,
+      const std::vector<TRITONBACKEND_ResponseFactory*>& factories,
+      const std::vector<int64_t>& request_batch_sizes,
+      std::vector<TRITONBACKEND_Response*>* responses)
+      : instance_state_(instance_state), requests_(requests),
+        factories_(factories), request_batch_sizes_(request_batch_sizes),
+        responses_(responses)
+  {
+  }
 
-  uint64_t exec_start_ns = 0;
-  SET_TIMESTAMP(exec_start_ns);
+  void Send(const InferenceOutputs& outputs) override
+  {
+    SendResponses(0, responses_->size(), outputs);
+  }
 
-  // Triton will not call this function simultaneously for the same
-  // 'instance'. But since this backend could be used by multiple
-  // instances from multiple models the implementation needs to handle
-  // multiple calls to this function at the same time (with different
-  // 'instance' objects). Best practice for a high-performance
-  // implementation is to avoid introducing mutex/lock and instead use
-  // only function-local and model-instance-specific state.
-  ModelInstanceState* instance_state;
-  RETURN_IF_ERROR(TRITONBACKEND_ModelInstanceState(
-      instance, reinterpret_cast<void**>(&instance_state)));
-  ModelState* model_state = instance_state->StateForModel();
+  void Send(size_t request_idx, const InferenceOutputs& outputs) override
+  {
+    if (request_idx >= responses_->size()) {
+      throw std::out_of_range(
+          "cannot send a response to request " + std::to_string(request_idx) +
+          " in a batch of " + std::to_string(responses_->size()));
+    }
+    SendResponses(request_idx, 1, outputs);
+  }
 
-  // 'responses' is initialized as a parallel array to 'requests',
-  // with one TRITONBACKEND_Response object for each
-  // TRITONBACKEND_Request object. If something goes wrong while
-  // creating these response objects, the backend simply returns an
-  // error from TRITONBACKEND_ModelInstanceExecute, indicating to
-  // Triton that this backend did not create or send any responses and
-  // so it is up to Triton to create and send an appropriate error
-  // response for each request. RETURN_IF_ERROR is one of several
-  // useful macros for error handling that can be found in
-  // backend_common.h.
+ private:
+  // Send 'outputs' to the 'count' requests starting at 'first'.
+  void SendResponses(
+      const size_t first, const size_t count, const InferenceOutputs& outputs);
+
+  ModelInstanceState* instance_state_;
+  TRITONBACKEND_Request** requests_;
+  const std::vector<TRITONBACKEND_ResponseFactory*>& factories_;
+  const std::vector<int64_t>& request_batch_sizes_;
+  std::vector<TRITONBACKEND_Response*>* responses_;
+};
+
+void
+DecoupledResponseSender::SendResponses(
+    const size_t first, const size_t count, const InferenceOutputs& outputs)
+{
+  // Requests that already failed do not get any more responses.
+  std::vector<TRITONBACKEND_Response*> partial_responses(count, nullptr);
+  for (size_t i = 0; i < count; ++i) {
+    auto& response = (*responses_)[first + i];
+    if (response != nullptr) {
+      RESPOND_AND_SET_NULL_IF_ERROR(
+          &response, TRITONBACKEND_ResponseNewFromFactory(
+                         &partial_responses[i], factories_[first + i]));
+    }
+  }
+  std::vector<bool> created(count);
+  for (size_t i = 0; i < count; ++i) {
+    created[i] = (partial_responses[i] != nullptr);
+  }
+
+  const std::vector<TensorConfig>& output_configs =
+      instance_state_->StateForModel()->Outputs();
+  const std::vector<int64_t> request_batch_sizes(
+      request_batch_sizes_.begin() + first,
+      request_batch_sizes_.begin() + first + count);
+  bool cuda_copy = false;
+  TRITONSERVER_Error* err = nullptr;
+  for (size_t o = 0; (o < output_configs.size()) && (err == nullptr); ++o) {
+    const OutputTensor* tensor = outputs.Find(output_configs[o].name);
+    if (tensor != nullptr) {
+      err = instance_state_->SetOutputTensor(
+          *tensor, output_configs[o], request_batch_sizes, requests_ + first,
+          &partial_responses, false /* state */, &cuda_copy);
+    }
+  }
+  if (err != nullptr) {
+    LOG_MESSAGE(TRITONSERVER_LOG_ERROR, TRITONSERVER_ErrorMessage(err));
+  }
+  RESPOND_ALL_AND_SET_NULL_IF_ERROR(partial_responses, count, err);
+
+#ifdef TRITON_ENABLE_GPU
+  if (cuda_copy) {
+    cudaStreamSynchronize(instance_state_->CudaStream());
+  }
+#endif  // TRITON_ENABLE_GPU
 
-  std::vector<TRITONBACKEND_Response*> responses;
-  responses.reserve(request_count);
-  for (uint32_t r = 0; r < request_count; ++r) {
-    TRITONBACKEND_Request* request = requests[r];
-    TRITONBACKEND_Response* response;
-    RETURN_IF_ERROR(TRITONBACKEND_ResponseNew(&response, request));
-    responses.push_back(response);
+  for (size_t i = 0; i < count; ++i) {
+    auto& response = (*responses_)[first + i];
+    if (partial_responses[i] != nullptr) {
+      LOG_IF_ERROR(
+          TRITONBACKEND_ResponseSend(
+              partial_responses[i], 0 /* send_flags */, nullptr),
+          "failed to send partial response");
+    } else if (created[i]) {
+      // The partial response was sent with an error as the final
+      // response of the request, drop the pending final response.
+      LOG_IF_ERROR(
+          TRITONBACKEND_ResponseDelete(response), "failed to delete response");
+      response = nullptr;
+    }
   }
+}
 
-  // At this point, the backend takes ownership of 'requests', which
-  // means that it is responsible for sending a response for every
-  // request. From here, even if something goes wrong in processing,
-  // the backend must return 'nullptr' from this function to indicate
-  // success. Any errors and failures must be communicated via the
-  // response objects.
-  //
-  // To simplify error handling, the backend utilities manage
-  // 'responses' in a specific way and it is recommended that backends
-  // follow this same pattern. When an error is detected in the
-  // processing of a request, an appropriate error response is sent
-  // and the corresponding TRITONBACKEND_Response object within
-  // 'responses' is set to nullptr to indicate that the
-  // request/response has already been handled and no futher processing
-  // should be performed for that request. Even if all responses fail,
-  // the backend still allows execution to flow to the end of the
-  // function so that statistics are correctly reported by the calls
-  // to TRITONBACKEND_ModelInstanceReportStatistics and
-  // TRITONBACKEND_ModelInstanceReportBatchStatistics.
-  // RESPOND_AND_SET_NULL_IF_ERROR, and
-  // RESPOND_ALL_AND_SET_NULL_IF_ERROR are macros from
-  // backend_common.h that assist in this management of response
-  // objects.
+//
+// ExecuteBatch
+//
+// Run 'request_count' requests of an execution through the model as
+// one batch, send their responses, report their statistics and
+// release them. 'responses', and 'factories' for decoupled models, are
+// parallel to 'requests'; a null response means that the request has
+// already failed. 'exec_start_ns' is the start of the execution, and
+// 'profiled' whether the execution is sampled by the profiler. The
+// compute span of the batch is merged into 'exec_compute_start_ns' and
+// 'exec_compute_end_ns', the span of the whole execution.
+//
+void
+ExecuteBatch(
+    ModelInstanceState* instance_state, TRITONBACKEND_Request** requests,
+    const uint32_t request_count,
+    std::vector<TRITONBACKEND_Response*> responses,
+    const std::vector<TRITONBACKEND_ResponseFactory*>& factories,
+    const uint64_t exec_start_ns, const bool profiled,
+    uint64_t* exec_compute_start_ns, uint64_t* exec_compute_end_ns)
+{
+  ModelState* model_state = instance_state->StateForModel();
+  const uint64_t batch_start_ns = NowNs();
+  if (profiled) {
+    instance_state->Profiler()->StartBatch();
+  }
+
+  // The batch mirrored last may still view the buffers of the instance
+  // until the shadow runner has copied it.
+  ShadowRunner* shadow = instance_state->Shadow();
+  if (shadow != nullptr) {
+    shadow->WaitCopied();
+  }
 
   // The backend could iterate over the 'requests' and process each
   // one separately. But for performance reasons it is usually
@@ -872,49 +6539,70 @@ TRITONBACKEND_ModelInstanceExecute(
   // backend or 'collector' can create and manage it. In this backend,
   // there is not a specific buffer into which the batch should be
   // created, so use ProcessTensor arguments that cause collector to
-  // manage it.
+  // manage it. The collector is shared with the shadow runner, which
+  // copies a mirrored batch out of its buffers.
 
-  BackendInputCollector collector(
+  std::shared_ptr<BackendInputCollector> collector(new BackendInputCollector(
       requests, request_count, &responses, model_state->TritonMemoryManager(),
-      false /* pinned_enabled */, instance_state->CudaStream() /* stream*/);
-
-  // To instruct ProcessTensor to "gather" the entire batch of input
-  // tensors into a single contiguous buffer in CPU memory, set the
-  // "allowed input types" to be the CPU ones (see tritonserver.h in
-  // the triton-inference-server/core repo for allowed memory types).
-  std::vector<std::pair<TRITONSERVER_MemoryType, int64_t>> allowed_input_types =
-      {{TRITONSERVER_MEMORY_CPU_PINNED, 0}, {TRITONSERVER_MEMORY_CPU, 0}};
-
-  const char* input_buffer;
-  size_t input_buffer_byte_size;
-  TRITONSERVER_MemoryType input_buffer_memory_type;
-  int64_t input_buffer_memory_type_id;
+      false /* pinned_enabled */, instance_state->CudaStream() /* stream*/));
+
+  // Gather every input of the model. The typed views into the gathered
+  // buffers are created after the collector is finalized.
+  const std::vector<TensorConfig>& input_configs = model_state->Inputs();
+  InferenceInputs inputs;
+  inputs.request_count = request_count;
+  inputs.tensors.resize(input_configs.size());
+  std::vector<const char*> input_buffers(input_configs.size(), nullptr);
+  std::vector<std::vector<size_t>> input_byte_offsets(input_configs.size());
+  std::vector<std::vector<const char*>> input_request_buffers(
+      input_configs.size());
+
+  TRITONSERVER_Error* err = nullptr;
+  for (size_t i = 0; (i < input_configs.size()) && (err == nullptr); ++i) {
+    err = instance_state->CollectInputTensor(
+        collector.get(), i, requests, request_count, &responses,
+        &input_buffers[i], &input_byte_offsets[i], &input_request_buffers[i],
+        &inputs.tensors[i]);
+  }
 
-  TRITONSERVER_Error* err = collector.ProcessTensor(
-      model_state->InputTensorName().c_str(), nullptr /* existing_buffer */,
-      0 /* existing_buffer_byte_size */, allowed_input_types, &input_buffer,
-      &input_buffer_byte_size, &input_buffer_memory_type,
-      &input_buffer_memory_type_id);
+  // Models using the sequence batcher also get the sequence of each
+  // request and the implicit states left by the previous requests.
+  const size_t state_count = model_state->States().size();
+  inputs.states.resize(state_count);
+  std::vector<const char*> state_buffers(state_count, nullptr);
+  std::vector<std::vector<size_t>> state_byte_offsets(state_count);
+  std::vector<std::vector<const char*>> state_request_buffers(state_count);
+  for (size_t s = 0; (s < state_count) && (err == nullptr); ++s) {
+    err = instance_state->CollectStateTensor(
+        collector.get(), s, requests, request_count, &responses,
+        &state_buffers[s], &state_byte_offsets[s], &state_request_buffers[s],
+        &inputs.states[s]);
+  }
+  if ((err == nullptr) && model_state->SequenceBatching()) {
+    instance_state->ReadSequenceControls(
+        requests, request_count, &responses, &inputs.sequences);
+  }
   if (err != nullptr) {
     LOG_MESSAGE(TRITONSERVER_LOG_ERROR, TRITONSERVER_ErrorMessage(err));
   }
 
   RESPOND_ALL_AND_SET_NULL_IF_ERROR(responses, request_count, err);
 
-  // Finalize the collector. If 'true' is returned, 'input_buffer'
+  // Finalize the collector. If 'true' is returned, the input buffers
   // will not be valid until the backend synchronizes the CUDA
   // stream or event that was used when creating the collector. For
   // this backend, GPU is not supported and so no CUDA sync should
   // be needed; so if 'true' is returned simply log an error.
-  const bool need_cuda_input_sync = collector.Finalize();
+  const bool need_cuda_input_sync = collector->Finalize();
   if (need_cuda_input_sync) {
     LOG_MESSAGE(
         TRITONSERVER_LOG_ERROR,
         "Adsbrain backend: unexpected CUDA sync required by collector");
   }
 
-  uint64_t compute_start_ns = 0;
-  SET_TIMESTAMP(compute_start_ns);
+  // The compute timestamps also drive the batch size controller, so
+  // they are taken even if statistics are disabled.
+  const uint64_t compute_start_ns = NowNs();
 
   LOG_MESSAGE(
       TRITONSERVER_LOG_VERBOSE,
@@ -922,35 +6610,99 @@ TRITONBACKEND_ModelInstanceExecute(
        std::to_string(request_count))
           .c_str());
 
-  LOG_MESSAGE(
-      TRITONSERVER_LOG_VERBOSE,
-      (std::string(model_state->InputTensorName() + " value: ") +
-       std::string(input_buffer, input_buffer_byte_size))
-          .c_str());
-
   bool cuda_copy = false;
-  // If everything works correctly, extract the batched requests and run
-  // inference.
+  // Whether the final responses carry outputs. A decoupled model may
+  // have sent all its results as partial responses, in which case the
+  // requests are only completed.
+  bool final_outputs = true;
+  // The rows run through the model, 0 if the model did not run.
+  size_t batch_rows = 0;
+  // The model call within the compute time, 0 if the model was not
+  // called.
+  uint64_t infer_start_ns = 0;
+  uint64_t infer_end_ns = 0;
+  // Whether the batch is mirrored to the shadow model once the
+  // responses are sent, with the outputs and the CPU time of the model.
+  bool shadowed = false;
+  InferenceOutputs shadowed_outputs;
+  uint64_t infer_cpu_ns = 0;
+  // If everything works correctly, decode the batched inputs into
+  // per-request views and run inference.
   if (err == nullptr) {
-    // 'input_buffer' contains the batched requests. Decode them to seperate
-    // requests.
-    std::vector<std::string> request_strs;
-    request_strs.reserve(request_count);
+    size_t uncompressed_byte_size = 0;
+    for (size_t i = 0; i < input_configs.size(); ++i) {
+      instance_state->ParseInputTensor(
+          input_buffers[i], input_byte_offsets[i], input_request_buffers[i],
+          request_count, &responses, &inputs.tensors[i]);
+      if (model_state->CompressedPayloads() &&
+          (inputs.tensors[i].datatype == DataType::BYTES)) {
+        instance_state->DecompressInputTensor(
+            i, &uncompressed_byte_size, &responses, &inputs.tensors[i]);
+      }
+      if (TRITONSERVER_LogIsEnabled(TRITONSERVER_LOG_VERBOSE)) {
+        LOG_MESSAGE(
+            TRITONSERVER_LOG_VERBOSE,
+            (input_configs[i].name + " byte size: " +
+             std::to_string(inputs.tensors[i].byte_size))
+                .c_str());
+      }
+    }
+
+    for (size_t s = 0; s < state_count; ++s) {
+      instance_state->ParseInputTensor(
+          state_buffers[s], state_byte_offsets[s], state_request_buffers[s],
+          request_count, &responses, &inputs.states[s]);
+    }
+
+    instance_state->DecodePayloads(&inputs, &responses);
+
+    const std::vector<TensorConfig>& output_configs = model_state->Outputs();
+    InferenceOutputs outputs;
+    outputs.tensors.resize(output_configs.size());
+    for (size_t o = 0; o < output_configs.size(); ++o) {
+      outputs.tensors[o].name = output_configs[o].name;
+      outputs.tensors[o].datatype = output_configs[o].adsbrain_datatype;
+    }
+    outputs.states.resize(state_count);
+    for (size_t s = 0; s < state_count; ++s) {
+      const TensorConfig& config = model_state->States()[s].output;
+      outputs.states[s].name = config.name;
+      outputs.states[s].datatype = config.adsbrain_datatype;
+    }
+
+    // The batch size of each request is the first dimension of its
+    // first input when the model supports batching.
+    std::vector<int64_t> request_batch_sizes(request_count, 1);
+    for (uint32_t r = 0; r < request_count; ++r) {
+      const auto& shape = inputs.tensors.front().request_shapes[r];
+      if ((model_state->MaxBatchSize() > 0) && !shape.empty()) {
+        request_batch_sizes[r] = shape[0];
+      }
+    }
 
-    const char* cur_input_str_ptr = input_buffer;
-    for (uint32_t i = 0; i < request_count; ++i) {
-      uint32_t input_str_size = *((uint32_t*)cur_input_str_ptr);
-      cur_input_str_ptr += sizeof(uint32_t);
-      request_strs.push_back(std::string(cur_input_str_ptr, input_str_size));
-      cur_input_str_ptr += input_str_size;
+    std::unique_ptr<DecoupledResponseSender> response_sender;
+    if (model_state->Decoupled()) {
+      response_sender.reset(new DecoupledResponseSender(
+          instance_state, requests, factories, request_batch_sizes,
+          &responses));
+      outputs.response_sender = response_sender.get();
     }
 
-    std::vector<std::string> response_strs;
+    // The batch is captured as the model sees it, after the payloads
+    // are decompressed.
+    if (instance_state->SampleCapture()) {
+      instance_state->CaptureBatch(inputs.tensors.front(), exec_start_ns);
+    }
 
+    shadowed = (shadow != nullptr) && shadow->Sample();
+    const uint64_t infer_start_cpu_ns = shadowed ? ThreadCpuNs() : 0;
+    infer_start_ns = NowNs();
     try {
-      response_strs = instance_state->RunInference(request_strs);
+      instance_state->RunInference(inputs, &outputs);
     }
     catch (const std::exception& ex) {
+      instance_state->Metrics()->Increment(
+          InstanceMetric::MODEL_EXCEPTIONS, 1);
       std::string err_msg = "Model " + model_state->Name() +
                             ": failed to run inference: " + ex.what();
       LOG_MESSAGE(TRITONSERVER_LOG_ERROR, err_msg.c_str());
@@ -958,40 +6710,94 @@ TRITONBACKEND_ModelInstanceExecute(
       // `err` will be released by the below macro
       RESPOND_ALL_AND_SET_NULL_IF_ERROR(responses, request_count, err);
     }
+    infer_end_ns = NowNs();
+    if (err == nullptr) {
+      for (const auto batch_size : request_batch_sizes) {
+        batch_rows += batch_size;
+      }
+    }
+    if (shadowed && (err == nullptr)) {
+      infer_cpu_ns = ThreadCpuNs() - infer_start_cpu_ns;
+    } else if (shadowed) {
+      shadow->Cancel();
+      shadowed = false;
+    }
 
-    if (response_strs.size() != request_strs.size()) {
-      std::string err_msg =
-          "Molde inference expected " + std::to_string(request_strs.size()) +
-          " response strings, but got " + std::to_string(response_strs.size());
-      LOG_MESSAGE(TRITONSERVER_LOG_ERROR, err_msg.c_str());
-      err = TRITONSERVER_ErrorNew(TRITONSERVER_ERROR_INTERNAL, err_msg.c_str());
-      // `err` will be released by the below macro
-      RESPOND_ALL_AND_SET_NULL_IF_ERROR(responses, request_count, err);
-    } else {
-      err = instance_state->SetResponses(
-          response_strs, responses, model_state->OutputTensorName(),
-          &cuda_copy);
+    if (model_state->Decoupled()) {
+      final_outputs = false;
+      for (const auto& tensor : outputs.tensors) {
+        final_outputs |= !OutputTensorEmpty(tensor);
+      }
+    }
+
+    for (size_t o = 0; (o < output_configs.size()) && (err == nullptr); ++o) {
+      // The final response of a decoupled model only carries the
+      // outputs the model filled.
+      if (model_state->Decoupled() && OutputTensorEmpty(outputs.tensors[o])) {
+        continue;
+      }
+      err = instance_state->SetOutputTensor(
+          outputs.tensors[o], output_configs[o], request_batch_sizes,
+          requests, &responses, false /* state */, &cuda_copy);
+      if (err != nullptr) {
+        LOG_MESSAGE(TRITONSERVER_LOG_ERROR, TRITONSERVER_ErrorMessage(err));
+      }
+      RESPOND_ALL_AND_SET_NULL_IF_ERROR(responses, responses.size(), err);
+    }
+
+    // Persist the updated states before the responses are sent so the
+    // next request of each sequence sees them. A state the model did
+    // not fill keeps its previous value.
+    for (size_t s = 0; (s < state_count) && (err == nullptr); ++s) {
+      const OutputTensor& state = outputs.states[s];
+      if (OutputTensorEmpty(state)) {
+        continue;
+      }
+      err = instance_state->SetOutputTensor(
+          state, model_state->States()[s].output, request_batch_sizes,
+          requests, &responses, true /* state */, &cuda_copy);
       if (err != nullptr) {
         LOG_MESSAGE(TRITONSERVER_LOG_ERROR, TRITONSERVER_ErrorMessage(err));
       }
       RESPOND_ALL_AND_SET_NULL_IF_ERROR(responses, responses.size(), err);
     }
+
+    if (shadowed) {
+      shadowed_outputs = std::move(outputs);
+    }
   }
 
-  uint64_t compute_end_ns = 0;
-  SET_TIMESTAMP(compute_end_ns);
+  const uint64_t compute_end_ns = NowNs();
 
+  if (infer_start_ns != 0) {
+    size_t input_bytes = 0;
+    for (const auto& tensor : inputs.tensors) {
+      input_bytes += tensor.byte_size;
+    }
+    InstanceMetrics* metrics = instance_state->Metrics();
+    metrics->Increment(InstanceMetric::REQUESTS, request_count);
+    metrics->AddBatch(batch_rows);
+    metrics->Increment(InstanceMetric::INPUT_BYTES, input_bytes);
+    metrics->Increment(
+        InstanceMetric::PARSE_DURATION_US,
+        (infer_start_ns - compute_start_ns) / 1000.0);
+    metrics->Increment(
+        InstanceMetric::INFER_DURATION_US,
+        (infer_end_ns - infer_start_ns) / 1000.0);
+    metrics->Increment(
+        InstanceMetric::SERIALIZE_DURATION_US,
+        (compute_end_ns - infer_end_ns) / 1000.0);
+  }
 
-#ifdef TRITON_ENABLE_GPU
   if (cuda_copy) {
+#ifdef TRITON_ENABLE_GPU
     cudaStreamSynchronize(instance_state->CudaStream());
-  }
-#elif
-  LOG_MESSAGE(
-      TRITONSERVER_LOG_ERROR,
-      "'recommended' backend: unexpected CUDA sync required by responder");
-}
+#else
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_ERROR,
+        "Adsbrain backend: unexpected CUDA sync required by responder");
 #endif  // TRITON_ENABLE_GPU
+  }
 
   // Finalize the responder. If 'true' is returned, the output
   // tensors' data will not be valid until the backend synchronizes
@@ -1007,34 +6813,251 @@ TRITONBACKEND_ModelInstanceExecute(
   // }
 
   // Send all the responses that haven't already been sent because of
-  // an earlier error.
-  for (auto& response : responses) {
-    if (response != nullptr) {
+  // an earlier error. Decoupled requests without final outputs are
+  // completed with the final flag alone.
+  for (uint32_t r = 0; r < request_count; ++r) {
+    auto& response = responses[r];
+    if ((response != nullptr) && final_outputs) {
       LOG_IF_ERROR(
           TRITONBACKEND_ResponseSend(
               response, TRITONSERVER_RESPONSE_COMPLETE_FINAL, nullptr),
           "failed to send response");
+    } else if (response != nullptr) {
+      LOG_IF_ERROR(
+          TRITONBACKEND_ResponseDelete(response), "failed to delete response");
+      LOG_IF_ERROR(
+          TRITONBACKEND_ResponseFactorySendFlags(
+              factories[r], TRITONSERVER_RESPONSE_COMPLETE_FINAL),
+          "failed to complete request");
     }
   }
+  for (auto factory : factories) {
+    LOG_IF_ERROR(
+        TRITONBACKEND_ResponseFactoryDelete(factory),
+        "failed to delete response factory");
+  }
+
+  const uint64_t batch_end_ns = NowNs();
+  instance_state->ObserveBatch(
+      batch_rows, compute_end_ns - compute_start_ns,
+      batch_end_ns - batch_start_ns);
+  instance_state->FlushModelMetrics();
+  if (profiled && (batch_rows > 0)) {
+    const uint64_t phase_ns[ExecutionProfiler::PHASE_COUNT] = {
+        compute_start_ns - batch_start_ns, infer_start_ns - compute_start_ns,
+        infer_end_ns - infer_start_ns, compute_end_ns - infer_end_ns,
+        batch_end_ns - compute_end_ns};
+    instance_state->Profiler()->EndBatch(batch_rows, phase_ns);
+  }
 
   uint64_t exec_end_ns = 0;
   SET_TIMESTAMP(exec_end_ns);
 
+#ifndef TRITON_ENABLE_STATS
+  (void)exec_start_ns;
+  (void)exec_end_ns;
+#endif  // TRITON_ENABLE_STATS
+
+  // Report statistics for each request, and then release the request.
+  // The requests of a mirrored batch are released by the shadow runner
+  // once it has copied their inputs.
+  for (uint32_t r = 0; r < request_count; ++r) {
+    auto& request = requests[r];
+
+#ifdef TRITON_ENABLE_STATS
+    LOG_IF_ERROR(
+        TRITONBACKEND_ModelInstanceReportStatistics(
+            instance_state->TritonModelInstance(), request,
+            (responses[r] != nullptr) /* success */, exec_start_ns,
+            compute_start_ns, compute_end_ns, exec_end_ns),
+        "failed reporting request statistics");
+#endif  // TRITON_ENABLE_STATS
+
+    if (!shadowed) {
+      LOG_IF_ERROR(
+          TRITONBACKEND_RequestRelease(
+              request, TRITONSERVER_REQUEST_RELEASE_ALL),
+          "failed releasing request");
+    }
+  }
+  if (shadowed) {
+    const std::vector<TRITONBACKEND_Request*> held(
+        requests, requests + request_count);
+    std::vector<std::shared_ptr<void>> sources;
+    sources.emplace_back(nullptr, [held](void*) {
+      for (auto request : held) {
+        LOG_IF_ERROR(
+            TRITONBACKEND_RequestRelease(
+                request, TRITONSERVER_REQUEST_RELEASE_ALL),
+            "failed releasing request");
+      }
+    });
+    sources.push_back(std::move(collector));
+    shadow->Mirror(
+        &inputs, &shadowed_outputs, infer_end_ns - infer_start_ns,
+        infer_cpu_ns, batch_rows, std::move(sources));
+  }
+
+  if (*exec_compute_start_ns == 0) {
+    *exec_compute_start_ns = compute_start_ns;
+  }
+  *exec_compute_end_ns = compute_end_ns;
+}
+
+extern "C" {
+
+// When Triton calls TRITONBACKEND_ModelInstanceExecute it is required
+// that a backend create a response for each request in the batch. A
+// response may be the output tensors required for that request or may
+// be an error that is returned in the response.
+//
+TRITONSERVER_Error*
+TRITONBACKEND_ModelInstanceExecute(
+    TRITONBACKEND_ModelInstance* instance, TRITONBACKEND_Request** requests,
+    const uint32_t request_count)
+{
+  // Collect various timestamps during the execution of this batch or
+  // requests. These values are reported below before returning from
+  // the function.
+
+  uint64_t exec_start_ns = 0;
+  SET_TIMESTAMP(exec_start_ns);
+
+  // Triton will not call this function simultaneously for the same
+  // 'instance'. But since this backend could be used by multiple
+  // instances from multiple models the implementation needs to handle
+  // multiple calls to this function at the same time (with different
+  // 'instance' objects). Best practice for a high-performance
+  // implementation is to avoid introducing mutex/lock and instead use
+  // only function-local and model-instance-specific state.
+  ModelInstanceState* instance_state;
+  RETURN_IF_ERROR(TRITONBACKEND_ModelInstanceState(
+      instance, reinterpret_cast<void**>(&instance_state)));
+  ModelState* model_state = instance_state->StateForModel();
+
+  // 'responses' is initialized as a parallel array to 'requests',
+  // with one TRITONBACKEND_Response object for each
+  // TRITONBACKEND_Request object. If something goes wrong while
+  // creating these response objects, the backend simply returns an
+  // error from TRITONBACKEND_ModelInstanceExecute, indicating to
+  // Triton that this backend did not create or send any responses and
+  // so it is up to Triton to create and send an appropriate error
+  // response for each request. RETURN_IF_ERROR is one of several
+  // useful macros for error handling that can be found in
+  // backend_common.h.
+  //
+  // Decoupled models create their responses from a response factory so
+  // partial responses can be sent to the requests while the model runs.
+
+  std::vector<TRITONBACKEND_Response*> responses;
+  std::vector<TRITONBACKEND_ResponseFactory*> factories;
+  responses.reserve(request_count);
+  for (uint32_t r = 0; r < request_count; ++r) {
+    TRITONBACKEND_Request* request = requests[r];
+    TRITONBACKEND_Response* response;
+    if (model_state->Decoupled()) {
+      TRITONBACKEND_ResponseFactory* factory;
+      RETURN_IF_ERROR(TRITONBACKEND_ResponseFactoryNew(&factory, request));
+      factories.push_back(factory);
+      RETURN_IF_ERROR(TRITONBACKEND_ResponseNewFromFactory(&response, factory));
+    } else {
+      RETURN_IF_ERROR(TRITONBACKEND_ResponseNew(&response, request));
+    }
+    responses.push_back(response);
+  }
+
+  // At this point, the backend takes ownership of 'requests', which
+  // means that it is responsible for sending a response for every
+  // request. From here, even if something goes wrong in processing,
+  // the backend must return 'nullptr' from this function to indicate
+  // success. Any errors and failures must be communicated via the
+  // response objects.
+  //
+  // To simplify error handling, the backend utilities manage
+  // 'responses' in a specific way and it is recommended that backends
+  // follow this same pattern. When an error is detected in the
+  // processing of a request, an appropriate error response is sent
+  // and the corresponding TRITONBACKEND_Response object within
+  // 'responses' is set to nullptr to indicate that the
+  // request/response has already been handled and no futher processing
+  // should be performed for that request. Even if all responses fail,
+  // the backend still allows execution to flow to the end of the
+  // function so that statistics are correctly reported by the calls
+  // to TRITONBACKEND_ModelInstanceReportStatistics and
+  // TRITONBACKEND_ModelInstanceReportBatchStatistics.
+  // RESPOND_AND_SET_NULL_IF_ERROR, and
+  // RESPOND_ALL_AND_SET_NULL_IF_ERROR are macros from
+  // backend_common.h that assist in this management of response
+  // objects.
+
+  // Under overload, shed the requests the instance cannot serve within
+  // the latency budget before any work is done for them. They already
+  // got their error response and are released here.
+  std::vector<size_t> rows;
+  std::vector<int64_t> priorities;
+  std::vector<bool> shed;
+  instance_state->ShedRequests(
+      requests, request_count, &responses, &rows, &priorities, &shed);
+  std::vector<TRITONBACKEND_Request*> admitted;
+  for (uint32_t r = 0; r < request_count; ++r) {
+    if (!shed[r]) {
+      responses[admitted.size()] = responses[r];
+      rows[admitted.size()] = rows[r];
+      priorities[admitted.size()] = priorities[r];
+      if (model_state->Decoupled()) {
+        factories[admitted.size()] = factories[r];
+      }
+      admitted.push_back(requests[r]);
+      continue;
+    }
+    if (model_state->Decoupled()) {
+      LOG_IF_ERROR(
+          TRITONBACKEND_ResponseFactoryDelete(factories[r]),
+          "failed to delete response factory");
+    }
+#ifdef TRITON_ENABLE_STATS
+    uint64_t shed_ns = 0;
+    SET_TIMESTAMP(shed_ns);
+    LOG_IF_ERROR(
+        TRITONBACKEND_ModelInstanceReportStatistics(
+            instance_state->TritonModelInstance(), requests[r],
+            false /* success */, exec_start_ns, shed_ns, shed_ns, shed_ns),
+        "failed reporting request statistics");
+#endif  // TRITON_ENABLE_STATS
+    LOG_IF_ERROR(
+        TRITONBACKEND_RequestRelease(
+            requests[r], TRITONSERVER_REQUEST_RELEASE_ALL),
+        "failed releasing request");
+  }
+  responses.resize(admitted.size());
+  rows.resize(admitted.size());
+  priorities.resize(admitted.size());
+  if (model_state->Decoupled()) {
+    factories.resize(admitted.size());
+  }
+
+  // Split the requests into the batches that are run through the model
+  // one after the other. The responses of a batch are sent as soon as
+  // it completes.
+  std::vector<std::vector<uint32_t>> batches;
+  instance_state->PartitionRequests(
+      admitted.data(), admitted.size(), rows, priorities, &responses,
+      &batches);
+
 #ifdef TRITON_ENABLE_STATS
   // For batch statistics need to know the total batch size of the
-  // requests. This is not necessarily just the number of requests,
-  // because if the model supports batching then any request can be a
-  // batched request itself.
+  // admitted requests, read before the batches release them. This is
+  // not necessarily just the number of requests, because if the model
+  // supports batching then any request can be a batched request itself.
   size_t total_batch_size = 0;
   bool supports_first_dim_batching;
   RESPOND_ALL_AND_SET_NULL_IF_ERROR(
-      responses, request_count,
+      responses, responses.size(),
       model_state->SupportsFirstDimBatching(&supports_first_dim_batching));
   if (!supports_first_dim_batching) {
-    total_batch_size = request_count;
+    total_batch_size = admitted.size();
   } else {
-    for (uint32_t r = 0; r < request_count; ++r) {
-      auto& request = requests[r];
+    for (auto request : admitted) {
       TRITONBACKEND_Input* input = nullptr;
       LOG_IF_ERROR(
           TRITONBACKEND_RequestInputByIndex(request, 0 /* index */, &input),
@@ -1051,38 +7074,43 @@ TRITONBACKEND_ModelInstanceExecute(
       }
     }
   }
-#else
-(void)exec_start_ns;
-(void)exec_end_ns;
-(void)compute_start_ns;
-(void)compute_end_ns;
 #endif  // TRITON_ENABLE_STATS
 
-  // Report statistics for each request, and then release the request.
-  for (uint32_t r = 0; r < request_count; ++r) {
-    auto& request = requests[r];
-
-#ifdef TRITON_ENABLE_STATS
-    LOG_IF_ERROR(
-        TRITONBACKEND_ModelInstanceReportStatistics(
-            instance_state->TritonModelInstance(), request,
-            (responses[r] != nullptr) /* success */, exec_start_ns,
-            compute_start_ns, compute_end_ns, exec_end_ns),
-        "failed reporting request statistics");
-#endif  // TRITON_ENABLE_STATS
+  const bool profiled = (instance_state->Profiler() != nullptr) &&
+                        instance_state->Profiler()->SampleExecution();
 
-    LOG_IF_ERROR(
-        TRITONBACKEND_RequestRelease(request, TRITONSERVER_REQUEST_RELEASE_ALL),
-        "failed releasing request");
+  uint64_t compute_start_ns = 0;
+  uint64_t compute_end_ns = 0;
+  for (const auto& batch : batches) {
+    std::vector<TRITONBACKEND_Request*> batch_requests;
+    std::vector<TRITONBACKEND_Response*> batch_responses;
+    std::vector<TRITONBACKEND_ResponseFactory*> batch_factories;
+    for (const auto r : batch) {
+      batch_requests.push_back(admitted[r]);
+      batch_responses.push_back(responses[r]);
+      if (model_state->Decoupled()) {
+        batch_factories.push_back(factories[r]);
+      }
+    }
+    ExecuteBatch(
+        instance_state, batch_requests.data(), batch_requests.size(),
+        std::move(batch_responses), batch_factories, exec_start_ns, profiled,
+        &compute_start_ns, &compute_end_ns);
   }
 
 #ifdef TRITON_ENABLE_STATS
-  // Report batch statistics.
-  LOG_IF_ERROR(
-      TRITONBACKEND_ModelInstanceReportBatchStatistics(
-          instance_state->TritonModelInstance(), total_batch_size,
-          exec_start_ns, compute_start_ns, compute_end_ns, exec_end_ns),
-      "failed reporting batch request statistics");
+  // Report the batch statistics once for the execution, whatever the
+  // number of batches its requests were run in. An execution whose
+  // requests were all shed ran no batch.
+  if (!batches.empty()) {
+    uint64_t exec_end_ns = 0;
+    SET_TIMESTAMP(exec_end_ns);
+    LOG_IF_ERROR(
+        TRITONBACKEND_ModelInstanceReportBatchStatistics(
+            instance_state->TritonModelInstance(), total_batch_size,
+            exec_start_ns, compute_start_ns, compute_end_ns, exec_end_ns),
+        "failed reporting batch request statistics");
+  }
 #endif  // TRITON_ENABLE_STATS
 
   return nullptr;  // success
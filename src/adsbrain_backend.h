@@ -24,14 +24,25 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <functional>
 #include <memory>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <typeinfo>
 #include <unordered_map>
 #include <vector>
 
 // To use the adsbrain backend, you need to 1) derive AdsbrainInferenceModel to
 // implement the model-specific logic; 2) implement the C API
-// `CreateInferenceModel(...)` to create the model instance. 3) compile the C++
+// `CreateInferenceModel(...)` to create the model instance and use
+// ADSBRAIN_DEFINE_MODEL_ABI() next to it. 3) compile the C++
 // model inference code into a shared library and put it and all the dependent
 // shared libraies to the model serving directory; 4) update config.pbtxt to use
 // the adsbrain backend and specify the shared library name and required
@@ -39,6 +50,401 @@
 
 namespace triton { namespace backend { namespace adsbrain {
 
+// Datatypes of the tensors exchanged between the backend and the model. They
+// correspond to TYPE_STRING, TYPE_FP32, TYPE_FP16, TYPE_INT8 and TYPE_INT64 in
+// config.pbtxt. FP16 elements are passed as their raw uint16_t bits.
+enum class DataType { BYTES, FP32, FP16, INT8, INT64 };
+
+// Size in bytes of one element of 'datatype', or 0 for BYTES.
+inline size_t
+DataTypeByteSize(DataType datatype)
+{
+  switch (datatype) {
+    case DataType::FP32:
+      return sizeof(float);
+    case DataType::FP16:
+      return sizeof(uint16_t);
+    case DataType::INT8:
+      return sizeof(int8_t);
+    case DataType::INT64:
+      return sizeof(int64_t);
+    default:
+      return 0;
+  }
+}
+
+// Alignment in bytes of the numeric batch buffers exchanged with the model,
+// suitable for aligned AVX2 and AVX-512 loads and stores.
+constexpr size_t kTensorAlignment = 64;
+
+// Allocator returning memory aligned to kTensorAlignment bytes.
+template <typename T>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U>&)
+  {
+  }
+
+  T* allocate(size_t n)
+  {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, kTensorAlignment, n * sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(ptr);
+  }
+  void deallocate(T* ptr, size_t) { free(ptr); }
+};
+
+template <typename T, typename U>
+bool
+operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+  return true;
+}
+
+template <typename T, typename U>
+bool
+operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+  return false;
+}
+
+// A byte buffer aligned to kTensorAlignment bytes.
+typedef std::vector<char, AlignedAllocator<char>> AlignedBytes;
+
+// A view of one element of a BYTES tensor. The memory is owned by the backend
+// and is only valid during the inference call.
+struct BytesElement {
+  const char* data;
+  size_t size;
+};
+
+// A read-only view of one input tensor over all the requests in a batch. The
+// elements of the requests are concatenated in request order; the elements of
+// request 'r' are [request_offsets[r], request_offsets[r + 1]).
+struct InputTensor {
+  std::string name;
+  DataType datatype;
+
+  // Shape of the tensor in each request, as sent by the client.
+  std::vector<std::vector<int64_t>> request_shapes;
+
+  // Element offset of each request, 'request_count + 1' entries.
+  std::vector<size_t> request_offsets;
+
+  // The elements of a BYTES tensor.
+  std::vector<BytesElement> elements;
+
+  // The row-major data of a numeric tensor, aligned to kTensorAlignment
+  // bytes.
+  const void* data = nullptr;
+  size_t byte_size = 0;
+
+  // Shape of a numeric tensor viewed as one batch matrix, [rows, dims...],
+  // where a row is one batch element of a request. The rows of request 'r'
+  // start at row request_offsets[r] / (elements per row). Empty if the
+  // requests do not share the same non-batch dimensions, in which case
+  // 'data' is simply the concatenation of the requests.
+  std::vector<int64_t> shape;
+
+  // Distance in bytes between the start of consecutive rows of 'data'. It is
+  // larger than the row size when the rows are padded to kTensorAlignment
+  // bytes ('align_numeric_rows' parameter); the padding is zero-filled.
+  size_t row_stride = 0;
+
+  template <typename T>
+  const T* Data() const
+  {
+    return static_cast<const T*>(data);
+  }
+
+  template <typename T>
+  const T* Row(size_t row) const
+  {
+    return reinterpret_cast<const T*>(
+        static_cast<const char*>(data) + row * row_stride);
+  }
+};
+
+// One output tensor over all the requests in a batch. The model appends the
+// elements of every request in request order.
+struct OutputTensor {
+  std::string name;
+  DataType datatype;
+
+  // Shape of the tensor in each response. It can be left empty if the output
+  // has no variable-size dimension, in which case the shape from
+  // config.pbtxt is used, prefixed with the request batch size if the model
+  // supports batching.
+  std::vector<std::vector<int64_t>> shapes;
+
+  // The elements of a BYTES tensor.
+  std::vector<std::string> strings;
+
+  // The row-major data of a numeric tensor, aligned to kTensorAlignment
+  // bytes.
+  AlignedBytes data;
+
+  template <typename T>
+  void Append(const T* values, size_t count)
+  {
+    const char* bytes = reinterpret_cast<const char*>(values);
+    data.insert(data.end(), bytes, bytes + count * sizeof(T));
+  }
+
+  // Resize the data to 'count' elements of type 'T' and return it so the
+  // model can write the whole batch in place.
+  template <typename T>
+  T* MutableData(size_t count)
+  {
+    data.resize(count * sizeof(T));
+    return reinterpret_cast<T*>(data.data());
+  }
+};
+
+// One field of the decoded payloads stored column-wise: 'values[i]' is the
+// value of the field in payload 'i', with a null 'data' if the payload does not
+// have the field.
+struct PayloadColumn {
+  std::string name;
+  std::vector<BytesElement> values;
+};
+
+// The payloads of a BYTES input decoded into columns by the backend when the
+// 'payload_decoder' parameter is set. Payload 'i' is element 'i' of the input,
+// so the 'request_offsets' of the input also index the payloads.
+struct DecodedPayloads {
+  std::string input_name;
+  size_t payload_count = 0;
+  std::vector<PayloadColumn> columns;
+
+  const PayloadColumn* Find(const std::string& name) const
+  {
+    for (const auto& column : columns) {
+      if (column.name == name) {
+        return &column;
+      }
+    }
+    return nullptr;
+  }
+};
+
+// The position of a request in its sequence when the model uses the sequence
+// batcher. 'start' and 'end' are only set if the corresponding
+// CONTROL_SEQUENCE_START / CONTROL_SEQUENCE_END control inputs are configured.
+struct SequenceRequest {
+  uint64_t correlation_id = 0;
+  bool start = false;
+  bool end = false;
+};
+
+// The inputs of a batch of requests, in the order of the inputs in
+// config.pbtxt.
+struct InferenceInputs {
+  size_t request_count = 0;
+  std::vector<InputTensor> tensors;
+
+  // The decoded payloads, empty if no payload decoder is configured.
+  DecodedPayloads payloads;
+
+  // The sequence of each request, empty if the model does not use the
+  // sequence batcher.
+  std::vector<SequenceRequest> sequences;
+
+  // The implicit state of the sequence of each request as left by the
+  // previous request, one tensor per 'sequence_batching.state' entry of
+  // config.pbtxt named after its 'input_name'. The first request of a
+  // sequence gets the initial state, or zeros if the state has none.
+  std::vector<InputTensor> states;
+
+  const InputTensor* Find(const std::string& name) const
+  {
+    for (const auto& tensor : tensors) {
+      if (tensor.name == name) {
+        return &tensor;
+      }
+    }
+    return nullptr;
+  }
+
+  const InputTensor* FindState(const std::string& name) const
+  {
+    for (const auto& state : states) {
+      if (state.name == name) {
+        return &state;
+      }
+    }
+    return nullptr;
+  }
+};
+
+class ResponseSender;
+
+// The outputs of a batch of requests. The backend creates one entry for each
+// output in config.pbtxt, in the same order, before calling the model.
+struct InferenceOutputs {
+  std::vector<OutputTensor> tensors;
+
+  // Sends partial responses before the model returns, null unless the model
+  // is decoupled.
+  ResponseSender* response_sender = nullptr;
+
+  // The updated implicit state of each request, one tensor per
+  // 'sequence_batching.state' entry named after its 'output_name'. The state
+  // is persisted for the next request of the sequence. A state left without
+  // elements and shapes keeps its previous value.
+  std::vector<OutputTensor> states;
+
+  OutputTensor* Find(const std::string& name)
+  {
+    for (auto& tensor : tensors) {
+      if (tensor.name == name) {
+        return &tensor;
+      }
+    }
+    return nullptr;
+  }
+
+  const OutputTensor* Find(const std::string& name) const
+  {
+    for (const auto& tensor : tensors) {
+      if (tensor.name == name) {
+        return &tensor;
+      }
+    }
+    return nullptr;
+  }
+
+  OutputTensor* FindState(const std::string& name)
+  {
+    for (auto& state : states) {
+      if (state.name == name) {
+        return &state;
+      }
+    }
+    return nullptr;
+  }
+};
+
+// Sends the responses of a decoupled model, i.e. configured with
+// 'model_transaction_policy { decoupled: true }' in config.pbtxt, while
+// RunTensorInference is running. Every call sends one more response to the
+// requests, so clients can start working on early results such as a first-pass
+// top-K before the refined list is ready. The outputs passed to Send are laid
+// out like the ones returned by RunTensorInference but may hold any subset of
+// the model outputs, which are looked up by name; their implicit states are
+// ignored. When RunTensorInference returns, the outputs it filled are sent as
+// the final response, or the requests are simply completed if it left them all
+// empty. A request whose response cannot be created is failed and gets no
+// further responses. The sender is only valid during the call and must not be
+// used from several threads at once.
+class ResponseSender {
+ public:
+  virtual ~ResponseSender() {}
+
+  // Send 'outputs', holding the elements of every request of the batch, as
+  // one partial response to each request.
+  virtual void Send(const InferenceOutputs& outputs) = 0;
+
+  // Send 'outputs', holding only the elements of request 'request_idx', as a
+  // partial response to that request.
+  virtual void Send(size_t request_idx, const InferenceOutputs& outputs) = 0;
+};
+
+// Metrics published by the model on the Triton metrics endpoint, such as
+// candidate counts, feature-miss rates or internal stage latencies. They are
+// labelled with the model, version and instance. Updates only touch atomics
+// owned by the instance and can be made per request and from any thread; the
+// backend forwards them after each batch. The metrics are only reported if the
+// backend is built with metrics support, otherwise updates have no effect.
+class Counter {
+ public:
+  virtual ~Counter() {}
+
+  // Add 'value', which must not be negative, to the counter.
+  virtual void Increment(double value = 1) = 0;
+};
+
+class Gauge {
+ public:
+  virtual ~Gauge() {}
+
+  virtual void Set(double value) = 0;
+  virtual void Increment(double value = 1) = 0;
+};
+
+// Reported like a Prometheus histogram, as the 'name_bucket' counters labelled
+// with the upper bound 'le' of each bucket, and the 'name_sum' and
+// 'name_count' counters.
+class Histogram {
+ public:
+  virtual ~Histogram() {}
+
+  virtual void Observe(double value) = 0;
+};
+
+// Registers the metrics of a model instance. The metrics are owned by the
+// backend and remain valid until the model is destroyed. Registering a name
+// again returns the same metric. A metric that cannot be reported, e.g. whose
+// name is already used by a metric of another kind, is still returned but its
+// updates are dropped and an error is logged.
+class MetricsRegistry {
+ public:
+  virtual ~MetricsRegistry() {}
+
+  virtual Counter* RegisterCounter(
+      const std::string& name, const std::string& description) = 0;
+  virtual Gauge* RegisterGauge(
+      const std::string& name, const std::string& description) = 0;
+
+  // 'bounds' are the increasing upper bounds of the buckets, a last bucket
+  // holding the larger values is added.
+  virtual Histogram* RegisterHistogram(
+      const std::string& name, const std::string& description,
+      const std::vector<double>& bounds) = 0;
+};
+
+// Assets shared by all the models of the Triton process, such as the embedding
+// tables used by several Triton models or by every instance of a model. An
+// asset is loaded by the first model getting its name and released once every
+// model that got it is destroyed, so the models loaded while another model
+// holds the asset share it without loading it again.
+class SharedAssets {
+ public:
+  virtual ~SharedAssets() {}
+
+  // Return the asset 'name', calling 'load' to load it if no model holds it.
+  // Concurrent calls for the same name wait for a single load, and 'load' must
+  // not get 'name' itself. An exception thrown by 'load' is propagated and the
+  // next call loads the asset again. Throws std::invalid_argument if 'name'
+  // holds an asset of another type.
+  template <typename T>
+  std::shared_ptr<T> Get(
+      const std::string& name, const std::function<std::shared_ptr<T>()>& load)
+  {
+    return std::static_pointer_cast<T>(
+        GetAsset(name, typeid(T).name(), [&load]() -> std::shared_ptr<void> {
+          return load();
+        }));
+  }
+
+  // Allocate 'size' bytes of zeroed memory for an asset, aligned to the huge
+  // page size and backed by huge pages if the 'huge_pages' parameter of the
+  // model requests them. The memory is released once the returned pointer and
+  // its copies are destroyed.
+  virtual std::shared_ptr<void> AllocateMemory(size_t size) = 0;
+
+ protected:
+  // 'type' identifies the type of the asset across the model libraries.
+  virtual std::shared_ptr<void> GetAsset(
+      const std::string& name, const std::string& type,
+      const std::function<std::shared_ptr<void>()>& load) = 0;
+};
+
 // This class is the base class for the implementation of customized inference
 // model using adsbrain backend. The derived class should implement the
 // following functions:
@@ -46,6 +452,8 @@ namespace triton { namespace backend { namespace adsbrain {
 // - RunInference: run the inference with the given requests. The number and
 // order of responses need to be as same as the number and order of requests.
 // This function needs to be thread-safe if multiple instances are launched.
+// Models with several inputs/outputs or numeric tensors implement
+// RunTensorInference instead.
 // - Destrunctor: destroy the model instance and release the resources.
 class AdsbrainInferenceModel {
  public:
@@ -57,17 +465,117 @@ class AdsbrainInferenceModel {
   virtual void Initialize(
       const std::unordered_map<std::string, std::string>& configs) = 0;
 
+  // Called before Initialize with the registry of the metrics the model
+  // publishes, which remains valid until the model is destroyed. Models
+  // without metrics of their own do not need to implement it.
+  virtual void InitializeMetrics(MetricsRegistry* /* metrics */) {}
+
+  // Called before Initialize with the assets shared across the models of the
+  // process, which remain valid until the model is destroyed. Models that do
+  // not share assets do not need to implement it.
+  virtual void InitializeSharedAssets(SharedAssets* /* assets */) {}
+
+  // Write the state prepared by Initialize to the file 'path', in a layout the
+  // model can use in place once it is mapped in memory, e.g. with offsets
+  // instead of pointers. Called after Initialize if the 'snapshot_directory'
+  // parameter is set and no snapshot exists. Return false if the model does
+  // not support snapshots, which is the default.
+  virtual bool WriteSnapshot(const std::string& /* path */) { return false; }
+
+  // Initialize the model from the snapshot it wrote with WriteSnapshot,
+  // instead of calling Initialize. 'data' is the snapshot mapped read-only in
+  // memory, which remains valid until the model is destroyed, and 'configs'
+  // are the parameters passed to Initialize. Return false, or throw, to
+  // ignore the snapshot, e.g. if its format is outdated: Initialize is then
+  // called instead.
+  virtual bool InitializeFromSnapshot(
+      const std::unordered_map<std::string, std::string>& /* configs */,
+      const void* /* data */, size_t /* size */)
+  {
+    return false;
+  }
+
   // Run inference on the model for the provided requests and return the
   // responses as strings. The number and order of responses must be as same as
   // the number and order of requests. This function fully controls the output
   // content format/shema. This function needs to be thread-safe if multiple
   // instances are launched.
   virtual std::vector<std::string> RunInference(
-      const std::vector<std::string>& requests) = 0;
+      const std::vector<std::string>& /* requests */)
+  {
+    throw std::runtime_error("RunInference is not implemented by the model");
+  }
+
+  // Merge the outputs of the shards of a model sharded with the 'shard_count'
+  // parameter into 'outputs', e.g. a top-K merge of the candidates scored by
+  // each shard. Every shard is initialized with its 'shard_index' and
+  // 'shard_count' in the parameters and runs the whole batch. 'shard_outputs'
+  // holds their outputs in shard order, laid out like 'outputs', and can be
+  // moved from. Called on the model of the instance that received the batch,
+  // possibly while it runs another batch as a shard.
+  virtual void CombineShardOutputs(
+      const InferenceInputs& /* inputs */,
+      std::vector<InferenceOutputs>* /* shard_outputs */,
+      InferenceOutputs* /* outputs */)
+  {
+    throw std::runtime_error(
+        "CombineShardOutputs is not implemented by the model");
+  }
+
+  // Run inference on the typed views of all the input tensors of a batch of
+  // requests and fill 'outputs'. The views are only valid during the call.
+  // The default implementation passes the first element of the first input
+  // of each request to RunInference and returns the response strings as the
+  // first output in the shape of [1].
+  virtual void RunTensorInference(
+      const InferenceInputs& inputs, InferenceOutputs* outputs)
+  {
+    const InputTensor& input = inputs.tensors.front();
+    OutputTensor& output = outputs->tensors.front();
+    if ((input.datatype != DataType::BYTES) ||
+        (output.datatype != DataType::BYTES)) {
+      throw std::runtime_error(
+          "RunInference requires a BYTES input and output, implement "
+          "RunTensorInference instead");
+    }
+
+    std::vector<std::string> requests;
+    requests.reserve(inputs.request_count);
+    for (size_t r = 0; r < inputs.request_count; ++r) {
+      if (input.request_offsets[r] < input.request_offsets[r + 1]) {
+        const BytesElement& element =
+            input.elements[input.request_offsets[r]];
+        requests.emplace_back(element.data, element.size);
+      } else {
+        requests.emplace_back();
+      }
+    }
+
+    output.strings = RunInference(requests);
+    output.shapes.assign(inputs.request_count, std::vector<int64_t>{1});
+  }
 };
 
 }}}  // namespace triton::backend::adsbrain
 
+// Version of the interface between the backend and the model libraries, i.e.
+// of AdsbrainInferenceModel and of the types it exchanges with the backend. It
+// is incremented whenever a change, such as a new virtual function or a new
+// member of these types, requires the model libraries to be rebuilt.
+#define ADSBRAIN_MODEL_ABI_VERSION 10
+
+// Define AdsbrainModelAbiVersion(), which returns the
+// ADSBRAIN_MODEL_ABI_VERSION the model library is built with. Every model
+// library must use it once at global scope, next to its CreateInferenceModel();
+// the backend refuses to load a library without it or built with another
+// version.
+#define ADSBRAIN_DEFINE_MODEL_ABI()                         \
+  extern "C" __attribute__((visibility("default"))) uint32_t \
+  AdsbrainModelAbiVersion()                                 \
+  {                                                         \
+    return ADSBRAIN_MODEL_ABI_VERSION;                      \
+  }
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -0,0 +1,141 @@
+// Copyright 2021-2022, MICROSOFT CORPORATION & AFFILIATES. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//  * Neither the name of MICROSOFT CORPORATION nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+// Format of the request capture files written by the adsbrain backend with the
+// 'capture_sample_rate' parameter and read by adsbrain_replay. All the
+// integers are stored in the byte order of the host (little-endian on the
+// supported platforms) and all the strings are length-prefixed by a uint32.
+//
+// The file starts with a header:
+//   - kCaptureMagic;
+//   - the name of the input of the model, which is a BYTES input: the
+//     capture is refused for models with other inputs;
+//   - uint8 flags, kCaptureDecoupled if the model is decoupled;
+//   - uint32 output count, then the uint8 DataType and the name of each
+//     output of the model configuration;
+//   - uint32 parameter count, then the key and the value of each parameter
+//     passed to Initialize().
+//
+// The header is followed by one record per captured batch, in the order the
+// batches were captured:
+//   - uint64 start time of the execution of the batch in nanoseconds since
+//     the capture started;
+//   - uint32 request count, then for each request:
+//     - uint32 dimension count and the int64 dimensions of the shape of the
+//       input in the request;
+//     - one length-prefixed string per element of the input.
+//
+// A file cut short while it was written ends with a truncated record, which
+// readers ignore.
+
+namespace triton { namespace backend { namespace adsbrain {
+
+constexpr char kCaptureMagic[8] = {'A', 'B', 'C', 'A', 'P', 'T', '0', '1'};
+
+constexpr uint8_t kCaptureDecoupled = 0x1;
+
+// Append the raw bytes of 'value' to 'buffer'.
+template <typename T>
+void
+AppendCaptureValue(std::string* buffer, const T value)
+{
+  buffer->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+inline void
+AppendCaptureString(std::string* buffer, const char* data, const size_t size)
+{
+  AppendCaptureValue<uint32_t>(buffer, size);
+  buffer->append(data, size);
+}
+
+//
+// CaptureCursor
+//
+// Reads the values of a capture file from memory. A read past the end
+// of the data fails and leaves the cursor at the end.
+//
+class CaptureCursor {
+ public:
+  CaptureCursor(const char* data, const size_t size)
+      : cur_(data), end_(data + size)
+  {
+  }
+
+  bool AtEnd() const { return cur_ == end_; }
+  const char* Position() const { return cur_; }
+
+  template <typename T>
+  bool Read(T* value)
+  {
+    if (static_cast<size_t>(end_ - cur_) < sizeof(T)) {
+      cur_ = end_;
+      return false;
+    }
+    memcpy(value, cur_, sizeof(T));
+    cur_ += sizeof(T);
+    return true;
+  }
+
+  // Read a length-prefixed string as a view into the data.
+  bool ReadString(const char** data, size_t* size)
+  {
+    uint32_t length;
+    if (!Read(&length) || (static_cast<size_t>(end_ - cur_) < length)) {
+      cur_ = end_;
+      return false;
+    }
+    *data = cur_;
+    *size = length;
+    cur_ += length;
+    return true;
+  }
+
+  bool ReadString(std::string* value)
+  {
+    const char* data;
+    size_t size;
+    if (!ReadString(&data, &size)) {
+      return false;
+    }
+    value->assign(data, size);
+    return true;
+  }
+
+ private:
+  const char* cur_;
+  const char* end_;
+};
+
+}}}  // namespace triton::backend::adsbrain
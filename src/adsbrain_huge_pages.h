@@ -0,0 +1,227 @@
+// Copyright 2021-2022, MICROSOFT CORPORATION & AFFILIATES. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//  * Neither the name of MICROSOFT CORPORATION nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+// Huge page backed memory, shared by the adsbrain backend and adsbrain_replay.
+// Large tables looked up at random spend much of their time in TLB misses,
+// which 2 MB pages mostly avoid. The memory is mapped anonymously, aligned to
+// the huge page size and populated when it is allocated, so the pages are
+// in place before the first request.
+
+namespace triton { namespace backend { namespace adsbrain {
+
+enum class HugePages {
+  // Normal pages.
+  NONE,
+  // Transparent huge pages requested with madvise(MADV_HUGEPAGE). The kernel
+  // backs the memory with huge pages as far as it can.
+  TRANSPARENT,
+  // Explicit huge pages of the hugetlbfs pool, reserved by the administrator
+  // through /proc/sys/vm/nr_hugepages.
+  HUGETLBFS
+};
+
+inline bool
+ParseHugePages(const std::string& name, HugePages* huge_pages)
+{
+  if (name == "none") {
+    *huge_pages = HugePages::NONE;
+  } else if (name == "transparent") {
+    *huge_pages = HugePages::TRANSPARENT;
+  } else if (name == "hugetlbfs") {
+    *huge_pages = HugePages::HUGETLBFS;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char*
+HugePagesName(const HugePages huge_pages)
+{
+  switch (huge_pages) {
+    case HugePages::TRANSPARENT:
+      return "transparent";
+    case HugePages::HUGETLBFS:
+      return "hugetlbfs";
+    default:
+      return "none";
+  }
+}
+
+// The default huge page size of the system, read once from /proc/meminfo.
+inline size_t
+HugePageSize()
+{
+  static const size_t size = []() -> size_t {
+    size_t kb = 2048;
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (file != nullptr) {
+      char line[256];
+      while (fgets(line, sizeof(line), file) != nullptr) {
+        unsigned long value;
+        if (sscanf(line, "Hugepagesize: %lu kB", &value) == 1) {
+          kb = value;
+          break;
+        }
+      }
+      fclose(file);
+    }
+    return kb * 1024;
+  }();
+  return size;
+}
+
+// 'size' rounded up to a whole number of huge pages, at least one.
+inline size_t
+HugePageMappingSize(const size_t size)
+{
+  const size_t page_size = HugePageSize();
+  return ((std::max<size_t>(size, 1) + page_size - 1) / page_size) * page_size;
+}
+
+// Map 'size' bytes of zeroed memory aligned to the huge page size, backed as
+// requested by 'huge_pages' if possible. Explicit huge pages fall back to
+// transparent huge pages if the pool is short, which fall back to normal pages
+// if the kernel does not support them. Set 'used' to the kind of pages the
+// memory was mapped with. Return nullptr if the memory cannot be mapped. The
+// memory is released with FreeHugePages.
+inline void*
+AllocateHugePages(
+    const size_t size, const HugePages huge_pages, HugePages* used)
+{
+  const size_t mapping_size = HugePageMappingSize(size);
+  char* memory = nullptr;
+  if (huge_pages == HugePages::HUGETLBFS) {
+    void* ptr = mmap(
+        nullptr, mapping_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      memory = static_cast<char*>(ptr);
+      *used = HugePages::HUGETLBFS;
+    }
+  }
+
+  if (memory == nullptr) {
+    // Over-allocate by a huge page to align the mapping, whose unaligned
+    // ends are unmapped.
+    const size_t page_size = HugePageSize();
+    void* ptr = mmap(
+        nullptr, mapping_size + page_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      return nullptr;
+    }
+    char* start = static_cast<char*>(ptr);
+    char* end = start + mapping_size + page_size;
+    memory = reinterpret_cast<char*>(
+        ((reinterpret_cast<uintptr_t>(start) + page_size - 1) / page_size) *
+        page_size);
+    if (memory > start) {
+      munmap(start, memory - start);
+    }
+    if (end > memory + mapping_size) {
+      munmap(memory + mapping_size, end - (memory + mapping_size));
+    }
+
+    *used = HugePages::NONE;
+#ifdef MADV_HUGEPAGE
+    if ((huge_pages != HugePages::NONE) &&
+        (madvise(memory, mapping_size, MADV_HUGEPAGE) == 0)) {
+      *used = HugePages::TRANSPARENT;
+    }
+#endif  // MADV_HUGEPAGE
+  }
+
+  // Fault the pages in now, as huge pages where the kernel can.
+  const size_t base_page_size = sysconf(_SC_PAGESIZE);
+  for (size_t offset = 0; offset < mapping_size; offset += base_page_size) {
+    memory[offset] = 0;
+  }
+
+  return memory;
+}
+
+inline void
+FreeHugePages(void* ptr, const size_t size)
+{
+  munmap(ptr, HugePageMappingSize(size));
+}
+
+// The bytes of the memory at 'ptr' allocated with AllocateHugePages that are
+// backed by huge pages, as reported by the kernel in /proc/self/smaps for
+// transparent huge pages.
+inline size_t
+HugePageBytes(const void* ptr, const size_t size, const HugePages used)
+{
+  const size_t mapping_size = HugePageMappingSize(size);
+  if (used == HugePages::HUGETLBFS) {
+    return mapping_size;
+  }
+  if (used == HugePages::NONE) {
+    return 0;
+  }
+
+  FILE* file = fopen("/proc/self/smaps", "r");
+  if (file == nullptr) {
+    return 0;
+  }
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(ptr);
+  const uintptr_t end = begin + mapping_size;
+  bool in_range = false;
+  size_t bytes = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    // Every mapping starts with its address range, followed by its fields.
+    unsigned long mapping_begin, mapping_end;
+    if (sscanf(line, "%lx-%lx ", &mapping_begin, &mapping_end) == 2) {
+      in_range = (mapping_begin < end) && (mapping_end > begin);
+      continue;
+    }
+    unsigned long kb;
+    if (in_range && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)) {
+      bytes += kb * 1024;
+    }
+  }
+  fclose(file);
+
+  // A mapping merged with a neighbouring one may report more.
+  return std::min(bytes, mapping_size);
+}
+
+}}}  // namespace triton::backend::adsbrain
@@ -0,0 +1,143 @@
+// Copyright 2021-2022, MICROSOFT CORPORATION & AFFILIATES. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//  * Neither the name of MICROSOFT CORPORATION nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+#include <zstd.h>
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+
+// The header of the compressed payload elements of the adsbrain backend. A
+// record starts with its PayloadCodec byte. Unless the codec is NONE, it is
+// followed by the uncompressed size as a little-endian uint32 and by the
+// compressed data. The size comes from the client, so the header is checked
+// against the limit and the compressed data before the size is used to reserve
+// any memory.
+
+namespace triton { namespace backend { namespace adsbrain {
+
+// Codec of a compressed payload or response string, stored in its first byte.
+enum class PayloadCodec : uint8_t { NONE = 0, LZ4 = 1, ZSTD = 2 };
+
+// Size of the header of a record that is not stored as is.
+constexpr size_t kPayloadHeaderSize = 1 + sizeof(uint32_t);
+
+// The largest expansion of lz4 data, reached by long runs of a single byte.
+constexpr size_t kLz4MaxRatio = 255;
+
+enum class PayloadHeaderStatus {
+  OK,
+  // The record is too short to hold its header.
+  TRUNCATED,
+  // The codec is unknown or the backend is built without it.
+  UNSUPPORTED_CODEC,
+  // The uncompressed size is above the limit.
+  TOO_LARGE,
+  // The compressed data cannot expand to the uncompressed size.
+  SIZE_MISMATCH
+};
+
+struct PayloadHeader {
+  PayloadCodec codec = PayloadCodec::NONE;
+  // Size of the data once uncompressed.
+  size_t uncompressed_size = 0;
+  // The data following the header, compressed unless the codec is NONE.
+  const char* data = nullptr;
+  size_t data_size = 0;
+};
+
+// Parse the header of the 'record_size' bytes of 'record' into 'header'. The
+// uncompressed size of a compressed record must not exceed
+// 'max_uncompressed_size', 255 times the lz4 data or the content size of the
+// zstd frame when the frame declares it. Records stored as is are used in
+// place and are not limited.
+inline PayloadHeaderStatus
+ParsePayloadHeader(
+    const char* record, const size_t record_size,
+    const size_t max_uncompressed_size, PayloadHeader* header)
+{
+  if (record_size < 1) {
+    return PayloadHeaderStatus::TRUNCATED;
+  }
+
+  header->codec = static_cast<PayloadCodec>(record[0]);
+  if (header->codec == PayloadCodec::NONE) {
+    header->uncompressed_size = record_size - 1;
+    header->data = record + 1;
+    header->data_size = record_size - 1;
+    return PayloadHeaderStatus::OK;
+  }
+
+  bool supported = false;
+#ifdef TRITON_ADSBRAIN_ENABLE_LZ4
+  supported |= (header->codec == PayloadCodec::LZ4);
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+  supported |= (header->codec == PayloadCodec::ZSTD);
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+  if (!supported) {
+    return PayloadHeaderStatus::UNSUPPORTED_CODEC;
+  }
+  if (record_size < kPayloadHeaderSize) {
+    return PayloadHeaderStatus::TRUNCATED;
+  }
+
+  uint32_t size;
+  memcpy(&size, record + 1, sizeof(uint32_t));
+  header->uncompressed_size = size;
+  header->data = record + kPayloadHeaderSize;
+  header->data_size = record_size - kPayloadHeaderSize;
+
+  if (header->uncompressed_size > max_uncompressed_size) {
+    return PayloadHeaderStatus::TOO_LARGE;
+  }
+  if ((header->codec == PayloadCodec::LZ4) &&
+      (header->uncompressed_size > kLz4MaxRatio * header->data_size)) {
+    return PayloadHeaderStatus::SIZE_MISMATCH;
+  }
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+  if (header->codec == PayloadCodec::ZSTD) {
+    // Frames written by streaming compressors may not declare their size,
+    // which is then only bounded by the limit.
+    const unsigned long long frame_size =
+        ZSTD_getFrameContentSize(header->data, header->data_size);
+    if ((frame_size == ZSTD_CONTENTSIZE_ERROR) ||
+        ((frame_size != ZSTD_CONTENTSIZE_UNKNOWN) &&
+         (frame_size != header->uncompressed_size))) {
+      return PayloadHeaderStatus::SIZE_MISMATCH;
+    }
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+
+  return PayloadHeaderStatus::OK;
+}
+
+}}}  // namespace triton::backend::adsbrain
@@ -0,0 +1,641 @@
+// Copyright 2021-2022, MICROSOFT CORPORATION & AFFILIATES. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//  * Neither the name of MICROSOFT CORPORATION nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// adsbrain_replay replays a request capture of the adsbrain backend through a
+// model library, without Triton, and reports the throughput and the latency
+// distribution of the batches. The batches are run as they were captured, at
+// the original rate, faster or back to back, by one or several model
+// instances.
+
+#include "adsbrain_backend.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "adsbrain_capture.h"
+#include "adsbrain_huge_pages.h"
+
+namespace triton { namespace backend { namespace adsbrain {
+
+typedef std::unique_ptr<AdsbrainInferenceModel> (
+    *createAdsbrainInferenceModel)();
+typedef uint32_t (*adsbrainModelAbiVersion)();
+
+//
+// CapturedBatch
+//
+// One captured batch, its elements being views into the capture file
+// data.
+//
+struct CapturedBatch {
+  uint64_t time_ns = 0;
+  size_t request_count = 0;
+  std::vector<std::vector<int64_t>> request_shapes;
+  std::vector<size_t> request_offsets;
+  std::vector<BytesElement> elements;
+};
+
+//
+// Capture
+//
+// A capture file loaded in memory.
+//
+struct Capture {
+  std::vector<char> data;
+  std::string input_name;
+  bool decoupled = false;
+  std::vector<std::pair<std::string, DataType>> outputs;
+  std::unordered_map<std::string, std::string> parameters;
+  std::vector<CapturedBatch> batches;
+};
+
+struct ReplayOptions {
+  std::string model_lib_path;
+  std::string capture_path;
+  double rate = 1;
+  size_t instances = 1;
+  std::vector<std::pair<std::string, std::string>> parameters;
+};
+
+//
+// DiscardedMetric
+//
+// The metrics registered by the model, whose updates are dropped
+// during the replay.
+//
+class DiscardedMetric : public Counter, public Gauge, public Histogram {
+ public:
+  void Increment(double /* value */) override {}
+  void Set(double /* value */) override {}
+  void Observe(double /* value */) override {}
+};
+
+class DiscardedMetricsRegistry : public MetricsRegistry {
+ public:
+  Counter* RegisterCounter(
+      const std::string& /* name */,
+      const std::string& /* description */) override
+  {
+    return &metric_;
+  }
+  Gauge* RegisterGauge(
+      const std::string& /* name */,
+      const std::string& /* description */) override
+  {
+    return &metric_;
+  }
+  Histogram* RegisterHistogram(
+      const std::string& /* name */, const std::string& /* description */,
+      const std::vector<double>& /* bounds */) override
+  {
+    return &metric_;
+  }
+
+ private:
+  DiscardedMetric metric_;
+};
+
+//
+// DiscardedResponseSender
+//
+// Drops the partial responses of a decoupled model.
+//
+class DiscardedResponseSender : public ResponseSender {
+ public:
+  void Send(const InferenceOutputs& /* outputs */) override {}
+  void Send(size_t /* request_idx */, const InferenceOutputs& /* outputs */)
+      override
+  {
+  }
+};
+
+//
+// ReplaySharedAssets
+//
+// Shares the assets between the model instances of the replay. The
+// assets are held until the replay ends.
+//
+class ReplaySharedAssets : public SharedAssets {
+ public:
+  explicit ReplaySharedAssets(const HugePages huge_pages)
+      : huge_pages_(huge_pages)
+  {
+  }
+
+  std::shared_ptr<void> AllocateMemory(size_t size) override
+  {
+    HugePages used;
+    void* ptr = AllocateHugePages(size, huge_pages_, &used);
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    fprintf(
+        stderr, "shared asset: mapped %zu bytes, %zu bytes in huge pages\n",
+        HugePageMappingSize(size), HugePageBytes(ptr, size, used));
+    return std::shared_ptr<void>(
+        ptr, [size](void* ptr) { FreeHugePages(ptr, size); });
+  }
+
+ protected:
+  std::shared_ptr<void> GetAsset(
+      const std::string& name, const std::string& type,
+      const std::function<std::shared_ptr<void>()>& load) override
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = assets_.find(name);
+    if (it != assets_.end()) {
+      if (it->second.first != type) {
+        throw std::invalid_argument(
+            "shared asset '" + name + "' is held with another type");
+      }
+      return it->second.second;
+    }
+
+    std::shared_ptr<void> asset = load();
+    if (asset == nullptr) {
+      throw std::invalid_argument("shared asset '" + name + "' loaded as null");
+    }
+    assets_.emplace(name, std::make_pair(type, asset));
+    return asset;
+  }
+
+ private:
+  HugePages huge_pages_;
+  std::mutex mu_;
+  std::unordered_map<std::string, std::pair<std::string, std::shared_ptr<void>>>
+      assets_;
+};
+
+// The time of the replay in nanoseconds.
+uint64_t
+NowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void
+PrintUsage(const char* program)
+{
+  fprintf(
+      stderr,
+      "Usage: %s [options] <model_lib_path> <capture_file>\n"
+      "Replay a request capture of the adsbrain backend through a model.\n"
+      "\n"
+      "Options:\n"
+      "  -r, --rate <rate>        speed of the replay relative to the\n"
+      "                           capture, 0 to run the batches back to\n"
+      "                           back (default 1)\n"
+      "  -n, --instances <count>  model instances running the batches\n"
+      "                           concurrently (default 1)\n"
+      "  -p, --param <key=value>  override a parameter passed to\n"
+      "                           Initialize(), can be repeated\n",
+      program);
+}
+
+bool
+ParseOptions(const int argc, char** argv, ReplayOptions* options)
+{
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const bool has_value = (i + 1 < argc);
+    if ((arg == "-r") || (arg == "--rate")) {
+      char* end = nullptr;
+      options->rate = has_value ? strtod(argv[++i], &end) : -1;
+      if ((end == nullptr) || (*end != '\0') || !(options->rate >= 0)) {
+        fprintf(stderr, "invalid --rate\n");
+        return false;
+      }
+    } else if ((arg == "-n") || (arg == "--instances")) {
+      char* end = nullptr;
+      const long instances = has_value ? strtol(argv[++i], &end, 10) : 0;
+      if ((end == nullptr) || (*end != '\0') || (instances <= 0)) {
+        fprintf(stderr, "invalid --instances\n");
+        return false;
+      }
+      options->instances = instances;
+    } else if ((arg == "-p") || (arg == "--param")) {
+      const std::string parameter = has_value ? argv[++i] : "";
+      const size_t eq = parameter.find('=');
+      if ((eq == std::string::npos) || (eq == 0)) {
+        fprintf(stderr, "invalid --param, expected key=value\n");
+        return false;
+      }
+      options->parameters.emplace_back(
+          parameter.substr(0, eq), parameter.substr(eq + 1));
+    } else if ((arg == "-h") || (arg == "--help")) {
+      return false;
+    } else if (!arg.empty() && (arg[0] == '-')) {
+      fprintf(stderr, "unknown option '%s'\n", arg.c_str());
+      return false;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  if (positional.size() != 2) {
+    return false;
+  }
+  options->model_lib_path = positional[0];
+  options->capture_path = positional[1];
+  return true;
+}
+
+// Load the capture file at 'path' into 'capture'. The batches are
+// sorted by time, as the instances of a model write them concurrently.
+bool
+LoadCapture(const std::string& path, Capture* capture, std::string* error)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    *error = "failed to open '" + path + "': " + strerror(errno);
+    return false;
+  }
+  char chunk[1 << 16];
+  size_t read_size;
+  while ((read_size = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    capture->data.insert(capture->data.end(), chunk, chunk + read_size);
+  }
+  const bool read_error = (ferror(file) != 0);
+  fclose(file);
+  if (read_error) {
+    *error = "failed to read '" + path + "'";
+    return false;
+  }
+
+  CaptureCursor cursor(capture->data.data(), capture->data.size());
+  char magic[sizeof(kCaptureMagic)];
+  bool valid = cursor.Read(&magic) &&
+               (memcmp(magic, kCaptureMagic, sizeof(magic)) == 0);
+  uint8_t flags = 0;
+  uint32_t output_count = 0;
+  valid = valid && cursor.ReadString(&capture->input_name) &&
+          cursor.Read(&flags) && cursor.Read(&output_count);
+  capture->decoupled = ((flags & kCaptureDecoupled) != 0);
+  for (uint32_t o = 0; valid && (o < output_count); ++o) {
+    uint8_t datatype;
+    std::string name;
+    valid = cursor.Read(&datatype) && cursor.ReadString(&name);
+    capture->outputs.emplace_back(name, static_cast<DataType>(datatype));
+  }
+  uint32_t parameter_count = 0;
+  valid = valid && cursor.Read(&parameter_count);
+  for (uint32_t p = 0; valid && (p < parameter_count); ++p) {
+    std::string key, value;
+    valid = cursor.ReadString(&key) && cursor.ReadString(&value);
+    capture->parameters[key] = value;
+  }
+  if (!valid) {
+    *error = "'" + path + "' is not a capture file";
+    return false;
+  }
+
+  // A record cut short ends the capture.
+  while (!cursor.AtEnd()) {
+    CapturedBatch batch;
+    uint32_t request_count;
+    bool complete = cursor.Read(&batch.time_ns) && cursor.Read(&request_count);
+    batch.request_count = request_count;
+    batch.request_offsets.assign(1, 0);
+    for (uint32_t r = 0; complete && (r < request_count); ++r) {
+      uint32_t dim_count;
+      complete = cursor.Read(&dim_count);
+      std::vector<int64_t> shape;
+      int64_t element_count = 1;
+      for (uint32_t d = 0; complete && (d < dim_count); ++d) {
+        int64_t dim;
+        complete = cursor.Read(&dim) && (dim >= 0);
+        shape.push_back(dim);
+        element_count *= dim;
+      }
+      for (int64_t e = 0; complete && (e < element_count); ++e) {
+        BytesElement element;
+        complete = cursor.ReadString(&element.data, &element.size);
+        batch.elements.push_back(element);
+      }
+      batch.request_shapes.push_back(std::move(shape));
+      batch.request_offsets.push_back(batch.elements.size());
+    }
+    if (complete) {
+      capture->batches.push_back(std::move(batch));
+    }
+  }
+
+  std::stable_sort(
+      capture->batches.begin(), capture->batches.end(),
+      [](const CapturedBatch& a, const CapturedBatch& b) {
+        return a.time_ns < b.time_ns;
+      });
+  return true;
+}
+
+//
+// Replay
+//
+// Runs the batches of a capture through the model instances, each
+// instance taking the next batch once it is due.
+//
+class Replay {
+ public:
+  Replay(const Capture& capture, const double rate)
+      : capture_(capture), rate_(rate), next_batch_(0),
+        latency_ns_(capture.batches.size(), 0),
+        model_ns_(capture.batches.size(), 0), failed_batches_(0),
+        start_ns_(0), end_ns_(0)
+  {
+  }
+
+  // Run the whole capture, one thread per model.
+  void Run(const std::vector<std::unique_ptr<AdsbrainInferenceModel>>& models);
+
+  // Print the throughput and the latency distribution of the replay.
+  void Report() const;
+
+ private:
+  void RunInstance(AdsbrainInferenceModel* model);
+
+  const Capture& capture_;
+  const double rate_;
+  std::atomic<size_t> next_batch_;
+
+  // The time from when each batch was due to when it completed, and
+  // the time spent in the model.
+  std::vector<uint64_t> latency_ns_;
+  std::vector<uint64_t> model_ns_;
+
+  std::mutex mu_;
+  size_t failed_batches_;
+  std::string first_error_;
+
+  uint64_t start_ns_;
+  uint64_t end_ns_;
+};
+
+void
+Replay::Run(const std::vector<std::unique_ptr<AdsbrainInferenceModel>>& models)
+{
+  start_ns_ = NowNs();
+  std::vector<std::thread> threads;
+  for (const auto& model : models) {
+    threads.emplace_back(&Replay::RunInstance, this, model.get());
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  end_ns_ = NowNs();
+}
+
+void
+Replay::RunInstance(AdsbrainInferenceModel* model)
+{
+  const auto& batches = capture_.batches;
+  DiscardedResponseSender response_sender;
+  // Captures are only written for models whose single input is a BYTES
+  // input, so the batch is rebuilt as that input alone.
+  InferenceInputs inputs;
+  inputs.tensors.resize(1);
+  InputTensor& input = inputs.tensors.front();
+  input.name = capture_.input_name;
+  input.datatype = DataType::BYTES;
+
+  size_t idx;
+  while ((idx = next_batch_.fetch_add(1)) < batches.size()) {
+    const CapturedBatch& batch = batches[idx];
+    uint64_t due_ns = NowNs();
+    if (rate_ > 0) {
+      due_ns = start_ns_ + static_cast<uint64_t>(
+                               (batch.time_ns - batches.front().time_ns) /
+                               rate_);
+      const uint64_t now_ns = NowNs();
+      if (due_ns > now_ns) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(due_ns - now_ns));
+      }
+    }
+
+    inputs.request_count = batch.request_count;
+    input.request_shapes = batch.request_shapes;
+    input.request_offsets = batch.request_offsets;
+    input.elements = batch.elements;
+    input.byte_size = 0;
+    for (const auto& element : batch.elements) {
+      input.byte_size += element.size;
+    }
+
+    InferenceOutputs outputs;
+    outputs.tensors.resize(capture_.outputs.size());
+    for (size_t o = 0; o < capture_.outputs.size(); ++o) {
+      outputs.tensors[o].name = capture_.outputs[o].first;
+      outputs.tensors[o].datatype = capture_.outputs[o].second;
+    }
+    if (capture_.decoupled) {
+      outputs.response_sender = &response_sender;
+    }
+
+    const uint64_t model_start_ns = NowNs();
+    try {
+      model->RunTensorInference(inputs, &outputs);
+    }
+    catch (const std::exception& ex) {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (failed_batches_++ == 0) {
+        first_error_ = ex.what();
+      }
+    }
+    const uint64_t model_end_ns = NowNs();
+    model_ns_[idx] = model_end_ns - model_start_ns;
+    latency_ns_[idx] = model_end_ns - std::min(due_ns, model_start_ns);
+  }
+}
+
+void
+Replay::Report() const
+{
+  size_t requests = 0;
+  size_t bytes = 0;
+  for (const auto& batch : capture_.batches) {
+    requests += batch.request_count;
+    for (const auto& element : batch.elements) {
+      bytes += element.size;
+    }
+  }
+  const double wall_s = (end_ns_ - start_ns_) / 1e9;
+  const double capture_s =
+      capture_.batches.empty() ? 0
+                               : (capture_.batches.back().time_ns -
+                                  capture_.batches.front().time_ns) /
+                                     1e9;
+
+  printf(
+      "batches %zu, requests %zu, payload bytes %zu, captured over %.3f s\n",
+      capture_.batches.size(), requests, bytes, capture_s);
+  printf(
+      "replayed in %.3f s: %.1f requests/s, %.1f batches/s\n", wall_s,
+      (wall_s > 0) ? requests / wall_s : 0,
+      (wall_s > 0) ? capture_.batches.size() / wall_s : 0);
+  if (failed_batches_ > 0) {
+    printf(
+        "failed batches %zu, first error: %s\n", failed_batches_,
+        first_error_.c_str());
+  }
+
+  const auto print_distribution = [](const char* name,
+                                     std::vector<uint64_t> values_ns) {
+    if (values_ns.empty()) {
+      return;
+    }
+    std::sort(values_ns.begin(), values_ns.end());
+    uint64_t total_ns = 0;
+    for (const auto value : values_ns) {
+      total_ns += value;
+    }
+    const auto percentile_us = [&values_ns](const double p) {
+      const size_t idx = std::min<size_t>(
+          values_ns.size() - 1, floor(p * values_ns.size()));
+      return values_ns[idx] / 1e3;
+    };
+    printf(
+        "%s us: avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, "
+        "max %.1f\n",
+        name, total_ns / 1e3 / values_ns.size(), percentile_us(0.5),
+        percentile_us(0.9), percentile_us(0.99), percentile_us(0.999),
+        values_ns.back() / 1e3);
+  };
+  // The latency includes the time a batch waited for an instance after
+  // it was due.
+  print_distribution("batch latency", latency_ns_);
+  print_distribution("model time", model_ns_);
+}
+
+int
+RunReplay(const ReplayOptions& options)
+{
+  Capture capture;
+  std::string error;
+  if (!LoadCapture(options.capture_path, &capture, &error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  // The model is initialized with the parameters it was captured with.
+  std::unordered_map<std::string, std::string> parameters = capture.parameters;
+  parameters["model_lib_path"] = options.model_lib_path;
+  for (const auto& parameter : options.parameters) {
+    parameters[parameter.first] = parameter.second;
+  }
+
+  // Like in the backend, the shared assets are backed by the huge pages
+  // of the 'huge_pages' parameter.
+  HugePages huge_pages = HugePages::NONE;
+  auto huge_pages_it = parameters.find("huge_pages");
+  if ((huge_pages_it != parameters.end()) &&
+      !ParseHugePages(huge_pages_it->second, &huge_pages)) {
+    fprintf(
+        stderr, "unsupported huge_pages '%s'\n", huge_pages_it->second.c_str());
+    return 1;
+  }
+
+  void* model_lib_handle = dlopen(options.model_lib_path.c_str(), RTLD_NOW);
+  if (model_lib_handle == nullptr) {
+    fprintf(stderr, "Cannot open library: %s\n", dlerror());
+    return 1;
+  }
+  adsbrainModelAbiVersion abi_version_func =
+      (adsbrainModelAbiVersion)dlsym(
+          model_lib_handle, "AdsbrainModelAbiVersion");
+  if ((abi_version_func == nullptr) ||
+      ((*abi_version_func)() != ADSBRAIN_MODEL_ABI_VERSION)) {
+    fprintf(
+        stderr,
+        "model library %s was built against another adsbrain_backend.h and "
+        "must be rebuilt\n",
+        options.model_lib_path.c_str());
+    dlclose(model_lib_handle);
+    return 1;
+  }
+  createAdsbrainInferenceModel create_model_func =
+      (createAdsbrainInferenceModel)dlsym(
+          model_lib_handle, "CreateInferenceModel");
+  if (create_model_func == nullptr) {
+    fprintf(stderr, "Cannot load symbol CreateInferenceModel: %s\n", dlerror());
+    dlclose(model_lib_handle);
+    return 1;
+  }
+
+  int status = 0;
+  {
+    // Declared before the models, which may use their metrics and
+    // shared assets until they are destroyed.
+    DiscardedMetricsRegistry metrics;
+    ReplaySharedAssets assets(huge_pages);
+    std::vector<std::unique_ptr<AdsbrainInferenceModel>> models;
+    try {
+      for (size_t i = 0; i < options.instances; ++i) {
+        models.push_back((*create_model_func)());
+        models.back()->InitializeMetrics(&metrics);
+        models.back()->InitializeSharedAssets(&assets);
+        models.back()->Initialize(parameters);
+      }
+    }
+    catch (const std::exception& ex) {
+      fprintf(stderr, "failed to initialize the model: %s\n", ex.what());
+      status = 1;
+    }
+
+    if (status == 0) {
+      Replay replay(capture, options.rate);
+      replay.Run(models);
+      replay.Report();
+    }
+  }
+
+  dlclose(model_lib_handle);
+  return status;
+}
+
+}}}  // namespace triton::backend::adsbrain
+
+int
+main(int argc, char** argv)
+{
+  triton::backend::adsbrain::ReplayOptions options;
+  if (!triton::backend::adsbrain::ParseOptions(argc, argv, &options)) {
+    triton::backend::adsbrain::PrintUsage(argv[0]);
+    return 2;
+  }
+  return triton::backend::adsbrain::RunReplay(options);
+}
@@ -0,0 +1,229 @@
+// Copyright 2021-2022, MICROSOFT CORPORATION & AFFILIATES. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//  * Neither the name of MICROSOFT CORPORATION nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#ifdef TRITON_ADSBRAIN_ENABLE_LZ4
+#include <lz4.h>
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+
+#include "adsbrain_payload_header.h"
+
+//
+// Unit tests of the parsing of the compressed payload headers, which
+// must reject the headers that would make the backend reserve memory
+// the data cannot fill.
+//
+
+namespace triton { namespace backend { namespace adsbrain {
+namespace {
+
+int failures = 0;
+
+#define EXPECT_EQ(expected, actual)                                      \
+  do {                                                                   \
+    if ((expected) != (actual)) {                                        \
+      fprintf(                                                           \
+          stderr, "%s:%d: expected %s == %s\n", __FILE__, __LINE__,      \
+          #expected, #actual);                                           \
+      ++failures;                                                        \
+    }                                                                    \
+  } while (false)
+
+constexpr size_t kMaxUncompressedSize = 1 << 20;
+
+// A record with the header of 'codec' and 'uncompressed_size' followed by
+// 'data'.
+std::string
+Record(
+    const PayloadCodec codec, const uint32_t uncompressed_size,
+    const std::string& data)
+{
+  std::string record(1, static_cast<char>(codec));
+  record.append(
+      reinterpret_cast<const char*>(&uncompressed_size), sizeof(uint32_t));
+  return record + data;
+}
+
+PayloadHeaderStatus
+Parse(const std::string& record, PayloadHeader* header)
+{
+  return ParsePayloadHeader(
+      record.data(), record.size(), kMaxUncompressedSize, header);
+}
+
+void
+TestUncompressed()
+{
+  PayloadHeader header;
+  const std::string record = std::string(1, '\0') + "payload";
+  EXPECT_EQ(PayloadHeaderStatus::OK, Parse(record, &header));
+  EXPECT_EQ(PayloadCodec::NONE, header.codec);
+  EXPECT_EQ(size_t(7), header.uncompressed_size);
+  EXPECT_EQ(record.data() + 1, header.data);
+  EXPECT_EQ(size_t(7), header.data_size);
+
+  // Data stored as is is used in place and is not limited.
+  const std::string large(kMaxUncompressedSize + 2, '\0');
+  EXPECT_EQ(PayloadHeaderStatus::OK, Parse(large, &header));
+}
+
+void
+TestTruncatedHeader()
+{
+  PayloadHeader header;
+  EXPECT_EQ(
+      PayloadHeaderStatus::TRUNCATED,
+      ParsePayloadHeader("", 0, kMaxUncompressedSize, &header));
+#ifdef TRITON_ADSBRAIN_ENABLE_LZ4
+  const std::string record = Record(PayloadCodec::LZ4, 16, "");
+  for (size_t size = 1; size < kPayloadHeaderSize; ++size) {
+    EXPECT_EQ(
+        PayloadHeaderStatus::TRUNCATED,
+        ParsePayloadHeader(record.data(), size, kMaxUncompressedSize, &header));
+  }
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+}
+
+void
+TestUnknownCodec()
+{
+  PayloadHeader header;
+  for (const int codec : {3, 0x7f, 0xff}) {
+    const std::string record =
+        Record(static_cast<PayloadCodec>(codec), 16, "data");
+    EXPECT_EQ(PayloadHeaderStatus::UNSUPPORTED_CODEC, Parse(record, &header));
+    // The codec is rejected before the rest of the header is read.
+    EXPECT_EQ(
+        PayloadHeaderStatus::UNSUPPORTED_CODEC,
+        ParsePayloadHeader(record.data(), 1, kMaxUncompressedSize, &header));
+  }
+#ifndef TRITON_ADSBRAIN_ENABLE_LZ4
+  EXPECT_EQ(
+      PayloadHeaderStatus::UNSUPPORTED_CODEC,
+      Parse(Record(PayloadCodec::LZ4, 16, "data"), &header));
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+#ifndef TRITON_ADSBRAIN_ENABLE_ZSTD
+  EXPECT_EQ(
+      PayloadHeaderStatus::UNSUPPORTED_CODEC,
+      Parse(Record(PayloadCodec::ZSTD, 16, "data"), &header));
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+}
+
+void
+TestLz4()
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_LZ4
+  const std::string payload(4096, 'a');
+  std::vector<char> compressed(LZ4_compressBound(payload.size()));
+  const int compressed_size = LZ4_compress_default(
+      payload.data(), compressed.data(), payload.size(), compressed.size());
+  const std::string data(compressed.data(), compressed_size);
+
+  PayloadHeader header;
+  EXPECT_EQ(
+      PayloadHeaderStatus::OK,
+      Parse(Record(PayloadCodec::LZ4, payload.size(), data), &header));
+  EXPECT_EQ(PayloadCodec::LZ4, header.codec);
+  EXPECT_EQ(payload.size(), header.uncompressed_size);
+  EXPECT_EQ(data.size(), header.data_size);
+
+  // Oversized claimed lengths.
+  EXPECT_EQ(
+      PayloadHeaderStatus::TOO_LARGE,
+      Parse(
+          Record(PayloadCodec::LZ4, kMaxUncompressedSize + 1, data), &header));
+  EXPECT_EQ(
+      PayloadHeaderStatus::TOO_LARGE,
+      Parse(Record(PayloadCodec::LZ4, UINT32_MAX, data), &header));
+  // Lengths the data cannot expand to.
+  EXPECT_EQ(
+      PayloadHeaderStatus::SIZE_MISMATCH,
+      Parse(
+          Record(PayloadCodec::LZ4, kLz4MaxRatio * data.size() + 1, data),
+          &header));
+  EXPECT_EQ(
+      PayloadHeaderStatus::SIZE_MISMATCH,
+      Parse(Record(PayloadCodec::LZ4, 1, ""), &header));
+#endif  // TRITON_ADSBRAIN_ENABLE_LZ4
+}
+
+void
+TestZstd()
+{
+#ifdef TRITON_ADSBRAIN_ENABLE_ZSTD
+  const std::string payload(4096, 'a');
+  std::vector<char> compressed(ZSTD_compressBound(payload.size()));
+  const size_t compressed_size = ZSTD_compress(
+      compressed.data(), compressed.size(), payload.data(), payload.size(), 1);
+  const std::string data(compressed.data(), compressed_size);
+
+  PayloadHeader header;
+  EXPECT_EQ(
+      PayloadHeaderStatus::OK,
+      Parse(Record(PayloadCodec::ZSTD, payload.size(), data), &header));
+  EXPECT_EQ(PayloadCodec::ZSTD, header.codec);
+  EXPECT_EQ(payload.size(), header.uncompressed_size);
+
+  // Oversized claimed lengths.
+  EXPECT_EQ(
+      PayloadHeaderStatus::TOO_LARGE,
+      Parse(Record(PayloadCodec::ZSTD, UINT32_MAX, data), &header));
+  // Lengths other than the one the frame declares.
+  EXPECT_EQ(
+      PayloadHeaderStatus::SIZE_MISMATCH,
+      Parse(Record(PayloadCodec::ZSTD, payload.size() + 1, data), &header));
+  EXPECT_EQ(
+      PayloadHeaderStatus::SIZE_MISMATCH,
+      Parse(Record(PayloadCodec::ZSTD, 16, "not a zstd frame"), &header));
+#endif  // TRITON_ADSBRAIN_ENABLE_ZSTD
+}
+
+}  // namespace
+}}}  // namespace triton::backend::adsbrain
+
+int
+main(int argc, char** argv)
+{
+  using namespace triton::backend::adsbrain;
+
+  TestUncompressed();
+  TestTruncatedHeader();
+  TestUnknownCodec();
+  TestLz4();
+  TestZstd();
+
+  if (failures > 0) {
+    fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}